@@ -27,6 +27,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
 #include <math.h>
@@ -89,6 +90,56 @@ struct conn_cache_entry {
 KHASH_MAP_INIT_INT64(conn_cache, struct conn_cache_entry *)
 
 
+#define HIST_SUB_BITS 7 ///< Sub-bucket bits per power of two (< 1% error).
+#define HIST_SUB (1U << HIST_SUB_BITS)
+#define HIST_BKTS ((65 - HIST_SUB_BITS) * HIST_SUB)
+
+
+/// A log-linear latency histogram in the style of HdrHistogram. Values are in
+/// microseconds; each power of two is split into HIST_SUB buckets.
+///
+struct hist {
+    uint64_t cnt[HIST_BKTS];
+    uint64_t n;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    double sum_sq; ///< Sum of squares, for the standard deviation.
+};
+
+
+/// A request slot of a load-generating connection.
+struct load_req {
+    struct q_stream * s; ///< Stream carrying the request, or zero if unused.
+    uint64_t t_req;      ///< Time the request was due (open loop) or issued.
+    uint_t rxed;         ///< Reply bytes received so far.
+};
+
+
+/// A load-generating connection with load_strms request slots.
+struct load_conn {
+    struct q_conn * c;
+    struct load_req * reqs;
+    uint32_t active; ///< Number of request slots in use.
+    bool closed;
+    uint8_t _unused[3];
+};
+
+
+KHASH_MAP_INIT_INT64(load_conns, struct load_conn *)
+
+
+/// Results of a load-generation run.
+struct load_stats {
+    struct hist hshk; ///< Handshake times.
+    struct hist ttfb; ///< Times to the first reply byte.
+    struct hist done; ///< Request completion times.
+    uint64_t reqs;    ///< Completed requests.
+    uint64_t bytes;   ///< Reply bytes received by completed requests.
+    uint64_t errs;    ///< Failed connections and requests.
+};
+
+
 static uint32_t vers = 0xbabababa;
 static uint32_t timeout = 10;
 static uint32_t num_bufs = 100000;
@@ -101,7 +152,12 @@ static bool test_qr = false;
 #ifndef NO_MIGRATION
 static bool rebind = false;
 static bool switch_ip = false;
+static uint32_t clnt_socks = 0;
 #endif
+static uint32_t load_conns = 0;
+static uint32_t load_strms = 1;
+static uint32_t load_rate = 0;
+static uint32_t load_secs = 10;
 
 
 struct stream_entry {
@@ -137,6 +193,7 @@ usage(const char * const name,
       const char * const cache,
       const char * const tls_log,
       const char * const qlog_dir,
+      const char * const hgrm,
       const bool verify_certs)
 {
     printf("%s [options] URL [URL...]\n", name);
@@ -146,22 +203,41 @@ usage(const char * const name,
            num_bufs);
     printf("\t[-c]\t\tverify TLS certificates; default %s\n",
            verify_certs ? "true" : "false");
+    printf("\t[-D secs]\tload generation duration; default %u\n", load_secs);
     printf("\t[-e version]\tQUIC version to use; default 0x%08x\n", vers);
+    printf("\t[-H prefix]\twrite load latency histograms to "
+           "prefix-*.hgrm; default %s\n",
+           *hgrm ? hgrm : "false");
     printf("\t[-i interface]\tinterface to run over; default %s\n", ifname);
     printf("\t[-l log]\tlog file for TLS keys; default %s\n",
            *tls_log ? tls_log : "false");
     printf("\t[-m]\t\ttest multi-pkt initial (\"quantum-readiness\"); default "
            "%s\n",
            test_qr ? "true" : "false");
+    printf("\t[-M streams]\tconcurrent requests per load connection; "
+           "default %u\n",
+           load_strms);
 #ifndef NO_MIGRATION
     printf("\t[-n]\t\tsimulate NAT rebind (use twice for \"real\" migration); "
            "default %s\n",
            rebind ? "true" : "false");
 #endif
+    printf("\t[-N conns]\tgenerate load on the first URL over this many "
+           "connections, which are\n\t\t\topened one handshake at a time "
+           "before the load starts; default %s\n",
+           load_conns ? "true" : "false");
     printf("\t[-q log]\twrite qlog events to directory; default %s\n",
            *qlog_dir ? qlog_dir : "false");
     printf("\t[-r reps]\trepetitions for all URLs; default %u\n", reps);
+    printf("\t[-R rate]\topen-loop load in requests/sec (0 = closed loop); "
+           "default %u\n",
+           load_rate);
     printf("\t[-s cache]\tTLS 0-RTT state cache; default %s\n", cache);
+#ifndef NO_MIGRATION
+    printf("\t[-S socks]\tshare this many sockets among all connections "
+           "(0 = off); default %u\n",
+           clnt_socks);
+#endif
     printf("\t[-t timeout]\tidle timeout in seconds; default %u\n", timeout);
     printf("\t[-u]\t\tupdate TLS keys; default %s\n",
            flip_keys ? "true" : "false");
@@ -198,8 +274,18 @@ set_from_url(char * const var,
 }
 
 
-static struct q_conn * __attribute__((nonnull))
-get(char * const url, struct w_engine * const w, khash_t(conn_cache) * cc)
+static inline const char * alpn(void)
+{
+    return do_h3 ? "h3-" DRAFT_VERSION_STRING : "hq-" DRAFT_VERSION_STRING;
+}
+
+
+static struct addrinfo * __attribute__((nonnull))
+resolve(const char * const url,
+        char * const dest,
+        const size_t dest_len,
+        char * const path,
+        const size_t path_len)
 {
     // parse and verify the URIs passed on the command line
     struct http_parser_url u = {0};
@@ -213,12 +299,10 @@ get(char * const url, struct w_engine * const w, khash_t(conn_cache) * cc)
            "userinfo unsupported in URL");
 
     // extract relevant info from URL
-    char dest[1024];
     char port[64];
-    char path[2048];
-    set_from_url(dest, sizeof(dest), url, &u, UF_HOST, "localhost");
+    set_from_url(dest, dest_len, url, &u, UF_HOST, "localhost");
     set_from_url(port, sizeof(port), url, &u, UF_PORT, "4433");
-    set_from_url(path, sizeof(path), url, &u, UF_PATH, "/index.html");
+    set_from_url(path, path_len, url, &u, UF_PATH, "/index.html");
 
     struct addrinfo * peer = 0;
     const int err = getaddrinfo(dest, port, 0, &peer);
@@ -228,26 +312,25 @@ get(char * const url, struct w_engine * const w, khash_t(conn_cache) * cc)
             freeaddrinfo(peer);
         return 0;
     }
+    return peer;
+}
 
-    // do we have a connection open to this peer?
-    khiter_t k = kh_get(conn_cache, cc, conn_cache_key(peer->ai_addr));
-    struct conn_cache_entry * cce =
-        (k == kh_end(cc) ? 0 : kh_val(cc, k)); // NOLINT
-
-    // add to stream list
-    struct stream_entry * se = calloc(1, sizeof(*se));
-    ensure(se, "calloc failed");
-    sq_init(&se->rep);
-    sl_insert_head(&sl, se, next);
 
-    sq_init(&se->req);
+static void __attribute__((nonnull(1, 4, 5, 6)))
+mk_req(struct w_engine * const w,
+       const struct q_conn * const c,
+       const int af,
+       const char * const path,
+       const char * const dest,
+       struct w_iov_sq * const q)
+{
     if (do_h3) {
-        q_alloc(w, &se->req, se->c, peer->ai_family, 1024);
-        struct w_iov * const v = sq_first(&se->req);
+        q_alloc(w, q, c, af, 1024);
+        struct w_iov * const v = sq_first(q);
         const uint16_t len =
             (uint16_t)(h3zero_create_request_header_frame(
-                           &v->buf[3], v->buf + v->len - 3, (uint8_t *)path,
-                           strlen(path), dest) -
+                           &v->buf[3], v->buf + v->len - 3,
+                           (const uint8_t *)path, strlen(path), dest) -
                        &v->buf[3]);
 
         v->buf[0] = h3zero_frame_header;
@@ -266,9 +349,50 @@ get(char * const url, struct w_engine * const w, khash_t(conn_cache) * cc)
         char req_str[MAXPATHLEN + 6];
         const int req_str_len =
             snprintf(req_str, sizeof(req_str), "GET %s\r\n", path);
-        q_chunk_str(w, cce ? cce->c : 0, peer->ai_family, req_str,
-                    (uint32_t)req_str_len, &se->req);
+        q_chunk_str(w, c, af, req_str, (uint32_t)req_str_len, q);
     }
+}
+
+
+static bool __attribute__((nonnull))
+h3_settings(struct w_engine * const w, struct q_conn * const c)
+{
+    // we need to open a uni stream for an empty H/3 SETTINGS frame
+    struct q_stream * const ss = q_rsv_stream(c, false);
+    if (ss == 0)
+        return false;
+    static const uint8_t h3_empty_settings[] = {0x00, h3zero_frame_settings,
+                                                0x00};
+    // XXX lsquic doesn't like a FIN on this stream
+    q_write_str(w, ss, (const char *)h3_empty_settings,
+                sizeof(h3_empty_settings), false);
+    return true;
+}
+
+
+static struct q_conn * __attribute__((nonnull))
+get(char * const url, struct w_engine * const w, khash_t(conn_cache) * cc)
+{
+    char dest[1024];
+    char path[2048];
+    struct addrinfo * const peer =
+        resolve(url, dest, sizeof(dest), path, sizeof(path));
+    if (peer == 0)
+        return 0;
+
+    // do we have a connection open to this peer?
+    khiter_t k = kh_get(conn_cache, cc, conn_cache_key(peer->ai_addr));
+    struct conn_cache_entry * cce =
+        (k == kh_end(cc) ? 0 : kh_val(cc, k)); // NOLINT
+
+    // add to stream list
+    struct stream_entry * se = calloc(1, sizeof(*se));
+    ensure(se, "calloc failed");
+    sq_init(&se->rep);
+    sl_insert_head(&sl, se, next);
+
+    sq_init(&se->req);
+    mk_req(w, cce ? cce->c : 0, peer->ai_family, path, dest, &se->req);
 
     const bool opened_new = cce == 0;
     if (cce == 0) {
@@ -281,24 +405,14 @@ get(char * const url, struct w_engine * const w, khash_t(conn_cache) * cc)
 #else
             &se->req, &se->s,
 #endif
-            true,
-            do_h3 ? "h3-" DRAFT_VERSION_STRING : "hq-" DRAFT_VERSION_STRING, 0);
+            true, alpn(), 0);
         if (c == 0) {
             freeaddrinfo(peer);
             return 0;
         }
 
-        if (do_h3) {
-            // we need to open a uni stream for an empty H/3 SETTINGS frame
-            struct q_stream * const ss = q_rsv_stream(c, false);
-            if (ss == 0)
-                return 0;
-            static const uint8_t h3_empty_settings[] = {
-                0x00, h3zero_frame_settings, 0x00};
-            // XXX lsquic doesn't like a FIN on this stream
-            q_write_str(w, ss, (const char *)h3_empty_settings,
-                        sizeof(h3_empty_settings), false);
-        }
+        if (do_h3 && h3_settings(w, c) == false)
+            return 0;
 
         cce = calloc(1, sizeof(*cce));
         ensure(cce, "calloc failed");
@@ -405,6 +519,319 @@ write_object(struct stream_entry * const se)
 }
 
 
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * NS_PER_S + (uint64_t)t.tv_nsec;
+}
+
+
+static uint32_t hist_idx(const uint64_t val)
+{
+    if (val < 2 * HIST_SUB)
+        return (uint32_t)val;
+    const uint32_t shift =
+        (uint32_t)(63 - __builtin_clzll(val)) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (uint32_t)(val >> shift);
+}
+
+
+static uint64_t hist_val(const uint32_t idx)
+{
+    // return the highest value that maps to bucket idx
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    const uint32_t shift = idx / HIST_SUB - 1;
+    return ((uint64_t)(idx - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+
+static void __attribute__((nonnull))
+hist_add(struct hist * const h, const uint64_t nsec)
+{
+    const uint64_t usec = nsec / NS_PER_US;
+    h->cnt[hist_idx(usec)]++;
+    h->min = h->n == 0 ? usec : MIN(h->min, usec);
+    h->max = MAX(h->max, usec);
+    h->sum += usec;
+    h->sum_sq += (double)usec * (double)usec;
+    h->n++;
+}
+
+
+static uint64_t __attribute__((nonnull))
+hist_pct(const struct hist * const h, const double pct)
+{
+    const uint64_t rank = MAX(1, (uint64_t)ceil(pct / 100 * (double)h->n));
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < HIST_BKTS; i++) {
+        n += h->cnt[i];
+        if (n >= rank)
+            return MIN(hist_val(i), h->max);
+    }
+    return h->max;
+}
+
+
+static void __attribute__((nonnull))
+hist_print(const char * const name, const struct hist * const h)
+{
+    if (h->n == 0) {
+        printf("%-10s %10d\n", name, 0);
+        return;
+    }
+    printf("%-10s %10" PRIu64 " %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+           name, h->n, (double)h->min / US_PER_MS,
+           (double)h->sum / (double)h->n / US_PER_MS,
+           (double)hist_pct(h, 50) / US_PER_MS,
+           (double)hist_pct(h, 90) / US_PER_MS,
+           (double)hist_pct(h, 99) / US_PER_MS,
+           (double)hist_pct(h, 99.9) / US_PER_MS, (double)h->max / US_PER_MS);
+}
+
+
+static void __attribute__((nonnull))
+hist_write(const char * const prefix,
+           const char * const name,
+           const struct hist * const h)
+{
+    // write the percentile distribution in the HdrHistogram .hgrm format
+    char file[MAXPATHLEN];
+    snprintf(file, sizeof(file), "%s-%s.hgrm", prefix, name);
+    FILE * const f = fopen(file, "w");
+    if (f == 0) {
+        warn(ERR, "cannot open %s: %s", file, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+            "1/(1-Percentile)");
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < HIST_BKTS && n < h->n; i++) {
+        if (h->cnt[i] == 0)
+            continue;
+        n += h->cnt[i];
+        const double p = (double)n / (double)h->n;
+        if (p < 1)
+            fprintf(f, "%12.3f %14.12f %10" PRIu64 " %14.2f\n",
+                    (double)hist_val(i) / US_PER_MS, p, n, 1 / (1 - p));
+        else
+            fprintf(f, "%12.3f %14.12f %10" PRIu64 "\n",
+                    (double)MIN(hist_val(i), h->max) / US_PER_MS, p, n);
+    }
+    const double mean = (double)h->sum / (double)h->n;
+    const double var = h->sum_sq / (double)h->n - mean * mean;
+    fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+            mean / US_PER_MS, var > 0 ? sqrt(var) / US_PER_MS : 0.0);
+    fprintf(f, "#[Max     = %12.3f, Total count    = %12" PRIu64 "]\n",
+            (double)h->max / US_PER_MS, h->n);
+    fprintf(f, "#[Buckets = %12u, SubBuckets     = %12u]\n", HIST_BKTS,
+            HIST_SUB);
+    fclose(f);
+}
+
+
+static bool __attribute__((nonnull))
+load_issue(struct w_engine * const w,
+           struct load_conn * const lc,
+           const char * const path,
+           const char * const dest,
+           const uint64_t t_req)
+{
+    struct load_req * r = lc->reqs;
+    while (r->s)
+        r++;
+
+    r->s = q_rsv_stream(lc->c, true);
+    if (r->s == 0)
+        return false;
+
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    mk_req(w, lc->c, q_conn_af(lc->c), path, dest, &q);
+    q_write(r->s, &q, true);
+    r->t_req = t_req;
+    r->rxed = 0;
+    lc->active++;
+    return true;
+}
+
+
+static uint32_t __attribute__((nonnull))
+load_rx(struct load_conn * const lc, struct load_stats * const st)
+{
+    // returns the number of requests that finished
+    const uint32_t active = lc->active;
+    if (q_is_conn_closed(lc->c)) {
+        // any outstanding requests failed; the streams go with the conn
+        lc->closed = true;
+        st->errs += lc->active;
+        lc->active = 0;
+        for (uint32_t i = 0; i < load_strms; i++)
+            lc->reqs[i].s = 0;
+        return active;
+    }
+
+    const uint64_t now = now_ns();
+    for (uint32_t i = 0; i < load_strms; i++) {
+        struct load_req * const r = &lc->reqs[i];
+        if (r->s == 0)
+            continue;
+
+        struct w_iov_sq q = w_iov_sq_initializer(q);
+        if (q_read_stream(r->s, &q, false)) {
+            if (r->rxed == 0)
+                hist_add(&st->ttfb, now - r->t_req);
+            r->rxed += w_iov_sq_len(&q);
+            q_free(&q);
+        }
+
+        if (q_peer_closed_stream(r->s) == false)
+            continue;
+
+        if (r->rxed) {
+            hist_add(&st->done, now - r->t_req);
+            st->bytes += r->rxed;
+            st->reqs++;
+        } else
+            st->errs++;
+
+        q_stream_get_written(r->s, &q);
+        q_free(&q);
+        q_free_stream(r->s);
+        r->s = 0;
+        lc->active--;
+    }
+    return active - lc->active;
+}
+
+
+static int __attribute__((nonnull))
+load(struct w_engine * const w, const char * const url, const char * const hgrm)
+{
+    char dest[1024];
+    char path[2048];
+    struct addrinfo * const peer =
+        resolve(url, dest, sizeof(dest), path, sizeof(path));
+    if (peer == 0)
+        return 1;
+
+    static struct load_stats st;
+    struct load_conn * const lc = calloc(load_conns, sizeof(*lc));
+    ensure(lc, "calloc failed");
+    khash_t(load_conns) * const lm = kh_init(load_conns);
+
+    // q_connect() returns after the handshake, so conns are opened in turn
+    uint32_t n_conns = 0;
+    for (uint32_t i = 0; i < load_conns; i++) {
+        const uint64_t t = now_ns();
+        struct q_conn * const c =
+            q_connect(w, peer->ai_addr, dest, 0, 0, true, alpn(), 0);
+        if (c == 0 || (do_h3 && h3_settings(w, c) == false)) {
+            st.errs++;
+            continue;
+        }
+        hist_add(&st.hshk, now_ns() - t);
+
+        struct load_conn * const l = &lc[n_conns++];
+        l->c = c;
+        l->reqs = calloc(load_strms, sizeof(*l->reqs));
+        ensure(l->reqs, "calloc failed");
+        int ret;
+        const khiter_t k = kh_put(load_conns, lm, (uint64_t)(uintptr_t)c, &ret);
+        ensure(ret >= 1, "inserted returned %d", ret);
+        kh_val(lm, k) = l;
+    }
+    freeaddrinfo(peer);
+
+    const uint64_t start = now_ns();
+    const uint64_t end = start + load_secs * NS_PER_S;
+    const uint64_t ival = load_rate ? NS_PER_S / load_rate : 0;
+    uint64_t active = 0;
+    uint64_t issued = 0;
+    uint32_t next = 0;
+
+    if (ival == 0)
+        // closed loop: fill all request slots
+        for (uint32_t i = 0; i < n_conns; i++)
+            while (lc[i].active < load_strms &&
+                   load_issue(w, &lc[i], path, dest, now_ns()))
+                active++;
+
+    // after the run, wait up to the idle timeout for outstanding replies
+    const uint64_t drain = end + timeout * NS_PER_S;
+    uint64_t now = start;
+    while (n_conns && (now < end || (active && now < drain))) {
+        uint64_t wait = now < end ? end - now : drain - now;
+
+        if (ival && now < end) {
+            // open loop: issue due requests round-robin over conns with a free
+            // slot; latencies count from when a request was due, so queueing
+            // delay due to a lack of free slots is included
+            uint64_t due = start + issued * ival;
+            uint32_t tried = 0;
+            while (due <= now && tried < n_conns) {
+                struct load_conn * const l = &lc[next];
+                next = (next + 1) % n_conns;
+                if (l->closed || l->active == load_strms ||
+                    load_issue(w, l, path, dest, due) == false) {
+                    tried++;
+                    continue;
+                }
+                active++;
+                issued++;
+                due += ival;
+                tried = 0;
+            }
+            if (due > now)
+                wait = MIN(wait, due - now);
+        }
+
+        struct q_conn * c;
+        q_ready(w, MAX(1, wait), &c);
+        now = now_ns();
+        if (c == 0)
+            continue;
+
+        const khiter_t k = kh_get(load_conns, lm, (uint64_t)(uintptr_t)c);
+        if (k == kh_end(lm))
+            continue;
+        struct load_conn * const l = kh_val(lm, k);
+        active -= load_rx(l, &st);
+
+        if (ival == 0 && now < end && l->closed == false)
+            while (l->active < load_strms &&
+                   load_issue(w, l, path, dest, now_ns()))
+                active++;
+    }
+
+    st.errs += active;
+    const double elapsed = (double)(now - start) / NS_PER_S;
+    printf("%u conn%s x %u strm%s, %s, %.3f sec\n", n_conns, plural(n_conns),
+           load_strms, plural(load_strms),
+           ival ? "open loop" : "closed loop", elapsed);
+    printf("%" PRIu64 " req%s (%.1f/sec), %" PRIu64 " error%s, %s\n", st.reqs,
+           plural(st.reqs), (double)st.reqs / elapsed, st.errs,
+           plural(st.errs), bps(st.bytes, elapsed));
+    printf("%-10s %10s %9s %9s %9s %9s %9s %9s %9s\n", "msec", "count", "min",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    hist_print("handshake", &st.hshk);
+    hist_print("ttfb", &st.ttfb);
+    hist_print("complete", &st.done);
+    if (*hgrm) {
+        hist_write(hgrm, "handshake", &st.hshk);
+        hist_write(hgrm, "ttfb", &st.ttfb);
+        hist_write(hgrm, "complete", &st.done);
+    }
+
+    for (uint32_t i = 0; i < n_conns; i++)
+        free(lc[i].reqs);
+    free(lc);
+    kh_destroy(load_conns, lm);
+    return st.reqs == 0 || st.errs;
+}
+
+
 int main(int argc, char * argv[])
 {
 #ifndef NDEBUG
@@ -419,6 +846,7 @@ int main(int argc, char * argv[])
     char cache[MAXPATHLEN] = "/tmp/" QUANT "-session";
     char tls_log[MAXPATHLEN] = "";
     char qlog_dir[MAXPATHLEN] = "";
+    char hgrm[MAXPATHLEN] = "";
     bool verify_certs = false;
     int ret = 0;
 
@@ -430,9 +858,9 @@ int main(int argc, char * argv[])
     }
 
     while ((ch = getopt(argc, argv,
-                        "hi:v:s:t:l:cu3zb:wr:q:me:"
+                        "hi:v:s:t:l:cu3zb:wr:q:me:N:M:R:D:H:"
 #ifndef NO_MIGRATION
-                        "n"
+                        "nS:"
 #endif
                         )) != -1) {
         switch (ch) {
@@ -478,12 +906,30 @@ int main(int argc, char * argv[])
         case 'm':
             test_qr = true;
             break;
+        case 'N':
+            load_conns = (uint32_t)MIN(strtoul(optarg, 0, 10), UINT32_MAX);
+            break;
+        case 'M':
+            load_strms = (uint32_t)MAX(1, MIN(strtoul(optarg, 0, 10), 1024));
+            break;
+        case 'R':
+            load_rate = (uint32_t)MIN(strtoul(optarg, 0, 10), NS_PER_S);
+            break;
+        case 'D':
+            load_secs = (uint32_t)MAX(1, MIN(strtoul(optarg, 0, 10), 86400));
+            break;
+        case 'H':
+            strncpy(hgrm, optarg, sizeof(hgrm) - 1);
+            break;
 #ifndef NO_MIGRATION
         case 'n':
             if (rebind)
                 switch_ip = true;
             rebind = true;
             break;
+        case 'S':
+            clnt_socks = (uint32_t)MIN(strtoul(optarg, 0, 10), UINT16_MAX);
+            break;
 #endif
         case 'v':
 #ifndef NDEBUG
@@ -493,7 +939,7 @@ int main(int argc, char * argv[])
         case 'h':
         case '?':
         default:
-            usage(basename(argv[0]), ifname, cache, tls_log, qlog_dir,
+            usage(basename(argv[0]), ifname, cache, tls_log, qlog_dir, hgrm,
                   verify_certs);
         }
     }
@@ -512,9 +958,17 @@ int main(int argc, char * argv[])
             .ticket_store = cache,
             .tls_log = *tls_log ? tls_log : 0,
             .client_cid_len = zlen_cids ? 0 : 4,
+#ifndef NO_MIGRATION
+            .clnt_socks = clnt_socks,
+#endif
             .enable_tls_cert_verify = verify_certs});
     khash_t(conn_cache) * cc = kh_init(conn_cache);
 
+    if (load_conns) {
+        ret = optind < argc ? load(w, argv[optind], hgrm) : 1;
+        goto done;
+    }
+
     if (reps > 1)
         puts("size\ttime\t\tbps\t\turl");
     for (uint64_t r = 1; r <= reps; r++) {
@@ -624,6 +1078,7 @@ int main(int argc, char * argv[])
         }
     }
 
+done:
     free_cc(cc);
     free_sl();
     q_cleanup(w);
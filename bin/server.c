@@ -43,6 +43,10 @@
 #include <sys/types.h>
 #endif
 
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
 #include <http_parser.h>
 
 #include <quant/quant.h>
@@ -66,17 +70,23 @@ static void __attribute__((noreturn)) usage(const char * const name,
                                             const char * const cert,
                                             const char * const key,
                                             const char * const tls_log,
+                                            const char * const tckt_keys,
                                             const uint32_t timeout,
                                             const bool retry,
-                                            const uint32_t num_bufs)
+                                            const uint32_t num_bufs,
+                                            const uint32_t cache_mb)
 {
     printf("%s [options]\n", name);
     printf("\t[-b bufs]\tnumber of network buffers to allocate; default %u\n ",
            num_bufs);
     printf("\t[-c cert]\tTLS certificate; default %s\n", cert);
+    printf("\t[-C size]\tobject cache size in MB (0 = off); default %u\n",
+           cache_mb);
     printf("\t[-d dir]\tserver root directory; default %s\n", dir);
     printf("\t[-i interface]\tinterface to run over; default %s\n", ifname);
     printf("\t[-k key]\tTLS key; default %s\n", key);
+    printf("\t[-K file]\tshared TLS ticket key file; default %s\n",
+           *tckt_keys ? tckt_keys : "false");
     printf("\t[-l log]\tlog file for TLS keys; default %s\n",
            *tls_log ? tls_log : "false");
     printf("\t[-p port]\tdestination port; default %d\n", port);
@@ -98,10 +108,12 @@ struct cb_data {
     struct w_engine * w;
     int dir;
     int af;
+    bool closed; ///< send_err() closed (and freed) the connection.
+    uint8_t _unused[7];
 };
 
 
-static bool send_err(const struct cb_data * const d, const uint16_t code)
+static bool send_err(struct cb_data * const d, const uint16_t code)
 {
     const char * msg;
     bool close = false;
@@ -125,9 +137,10 @@ static bool send_err(const struct cb_data * const d, const uint16_t code)
         msg = "500 Internal Server Error";
     }
 
-    if (close)
+    if (close) {
         q_close(d->c, 0x0003, msg);
-    else
+        d->closed = true;
+    } else
         q_write_str(d->w, d->s, msg, strlen(msg), true);
     return close;
 }
@@ -138,10 +151,185 @@ static uint32_t bench_cnt = 0;
 #endif
 
 
+/// A cached file, held in heap memory outside the buffer pool.
+struct obj {
+    struct obj * prev;     ///< Next more recently used object.
+    struct obj * next;     ///< Next less recently used object.
+    char * path;           ///< Path relative to the server root (hash key).
+    struct q_shared * sh;  ///< File contents, shared by all responses.
+    uint_t len;            ///< Length of the file contents.
+    struct timespec mtime; ///< Modification time, for invalidation.
+    ino_t ino;             ///< Inode number, for invalidation.
+    dev_t dev;             ///< Device number, for invalidation.
+};
+
+
+KHASH_MAP_INIT_STR(obj_cache, struct obj *)
+
+static khash_t(obj_cache) objs = {0};
+static struct obj * lru_head = 0; ///< Most recently used object.
+static struct obj * lru_tail = 0; ///< Least recently used object.
+static uint_t obj_bytes = 0;      ///< Bytes held by the cache.
+static uint_t obj_budget = 0;     ///< Max. bytes held by the cache.
+
+
+static void __attribute__((nonnull)) lru_unlink(struct obj * const o)
+{
+    if (o->prev)
+        o->prev->next = o->next;
+    else
+        lru_head = o->next;
+    if (o->next)
+        o->next->prev = o->prev;
+    else
+        lru_tail = o->prev;
+    o->prev = o->next = 0;
+}
+
+
+static void __attribute__((nonnull)) lru_push(struct obj * const o)
+{
+    o->next = lru_head;
+    if (lru_head)
+        lru_head->prev = o;
+    lru_head = o;
+    if (lru_tail == 0)
+        lru_tail = o;
+}
+
+
+static void __attribute__((nonnull)) obj_del(struct obj * const o)
+{
+    const khiter_t k = kh_get(obj_cache, &objs, o->path);
+    ensure(k != kh_end(&objs), "found");
+    kh_del(obj_cache, &objs, k);
+    lru_unlink(o);
+    obj_bytes -= o->len;
+    // streams still sending the object keep their own reference
+    q_shared_free(o->sh);
+    free(o->path);
+    free(o);
+}
+
+
+static void obj_cache_cleanup(void)
+{
+    while (lru_head)
+        obj_del(lru_head);
+    kh_release(obj_cache, &objs);
+}
+
+
+KHASH_SET_INIT_INT64(conn_set)
+
+/// Conns that were accepted and are not closed yet. Conns that fail the
+/// handshake are closed without ever being accepted.
+static khash_t(conn_set) conns = {0};
+
+
+static void __attribute__((nonnull)) conn_forget(const struct q_conn * const c)
+{
+    const khiter_t k = kh_get(conn_set, &conns, (khint64_t)(uintptr_t)c);
+    if (k != kh_end(&conns))
+        kh_del(conn_set, &conns, k);
+}
+
+
+static bool __attribute__((nonnull))
+obj_is_fresh(const struct obj * const o, const struct stat * const info)
+{
+    return o->mtime.tv_sec == info->st_mtim.tv_sec &&
+           o->mtime.tv_nsec == info->st_mtim.tv_nsec &&
+           o->ino == info->st_ino && o->dev == info->st_dev &&
+           o->len == (uint_t)info->st_size;
+}
+
+
+/// Return the cached contents of the file at @p path, loading them into the
+/// cache first if needed. Returns zero if the file cannot be cached.
+///
+/// @param      d     Callback data of the request.
+/// @param      path  Path of the file, relative to the server root.
+/// @param      info  Current stat(2) information of the file.
+///
+/// @return     Cached object, or zero.
+///
+static struct obj * __attribute__((nonnull))
+obj_get(const struct cb_data * const d,
+        const char * const path,
+        const struct stat * const info)
+{
+    khiter_t k = kh_get(obj_cache, &objs, path);
+    if (k != kh_end(&objs)) {
+        struct obj * const o = kh_val(&objs, k);
+        if (likely(obj_is_fresh(o, info))) {
+            lru_unlink(o);
+            lru_push(o);
+            return o;
+        }
+        warn(INF, "file %s changed, evicting from cache", path);
+        obj_del(o);
+    }
+
+    const uint_t len = (uint_t)info->st_size;
+    if (obj_budget == 0 || len > obj_budget)
+        return 0;
+
+    // make room
+    while (obj_bytes + len > obj_budget)
+        obj_del(lru_tail);
+
+    // keep the contents on the heap, since fill_out() copies them into
+    // fresh packet buffers anyway, and the pool is better left to the conns
+    uint8_t * const buf = malloc(MAX(len, 1));
+    if (buf == 0) {
+        warn(WRN, "could not allocate %" PRIu " bytes of cache for %s", len,
+             path);
+        return 0;
+    }
+
+    const int f = openat(d->dir, path, O_RDONLY | O_CLOEXEC);
+    if (f == -1)
+        goto fail;
+    for (uint_t got = 0; got < len;) {
+        const ssize_t ret = read(f, &buf[got], len - got);
+        if (ret <= 0) {
+            close(f);
+            goto fail;
+        }
+        got += (uint_t)ret;
+    }
+    close(f);
+
+    struct obj * const o = calloc(1, sizeof(*o));
+    ensure(o, "could not calloc");
+    o->sh = q_shared_new_buf(buf, len);
+    o->path = strdup(path);
+    ensure(o->path, "could not strdup");
+    o->len = len;
+    o->mtime = info->st_mtim;
+    o->ino = info->st_ino;
+    o->dev = info->st_dev;
+
+    int ret;
+    k = kh_put(obj_cache, &objs, o->path, &ret);
+    ensure(ret >= 1, "inserted");
+    kh_val(&objs, k) = o;
+    lru_push(o);
+    obj_bytes += len;
+    warn(INF, "cached %" PRIu " bytes of %s", len, path);
+    return o;
+
+fail:
+    free(buf);
+    return 0;
+}
+
+
 static int serve_cb(http_parser * parser, const char * at, size_t len)
 {
     (void)parser;
-    const struct cb_data * const d = parser->data;
+    struct cb_data * const d = parser->data;
     char cid_str[64];
     q_cid(d->c, cid_str, sizeof(cid_str));
     warn(INF, "conn %s str %" PRId " serving URL %.*s", cid_str, q_sid(d->s),
@@ -225,6 +413,12 @@ static int serve_cb(http_parser * parser, const char * at, size_t len)
     if (info.st_size >= UINT32_MAX)
         return send_err(d, 500);
 
+    const struct obj * const o = obj_get(d, path, &info);
+    if (o) {
+        q_write_shared(d->s, o->sh, true);
+        return 0;
+    }
+
     const int f = openat(d->dir, path, O_RDONLY | O_CLOEXEC);
     ensure(f != -1, "could not open %s", path);
 
@@ -252,10 +446,12 @@ int main(int argc, char * argv[])
     char cert[MAXPATHLEN] = "test/dummy.crt";
     char key[MAXPATHLEN] = "test/dummy.key";
     char tls_log[MAXPATHLEN] = "";
+    char tckt_keys[MAXPATHLEN] = "";
     char qlog_dir[MAXPATHLEN] = "";
     uint16_t port[MAXPORTS] = {4433, 4434};
     size_t num_ports = 0;
     uint32_t num_bufs = 100000;
+    uint32_t cache_mb = 16;
     int ch;
     int ret = 0;
     bool retry = false;
@@ -267,7 +463,7 @@ int main(int argc, char * argv[])
         tls_log[MAXPATHLEN - 1] = 0;
     }
 
-    while ((ch = getopt(argc, argv, "hi:p:d:v:c:k:t:b:q:rl:")) != -1) {
+    while ((ch = getopt(argc, argv, "hi:p:d:v:c:C:k:K:t:b:q:rl:")) != -1) {
         switch (ch) {
         case 'q':
             strncpy(qlog_dir, optarg, sizeof(qlog_dir) - 1);
@@ -281,9 +477,15 @@ int main(int argc, char * argv[])
         case 'c':
             strncpy(cert, optarg, sizeof(cert) - 1);
             break;
+        case 'C':
+            cache_mb = (uint32_t)strtoul(optarg, 0, 10);
+            break;
         case 'k':
             strncpy(key, optarg, sizeof(key) - 1);
             break;
+        case 'K':
+            strncpy(tckt_keys, optarg, sizeof(tckt_keys) - 1);
+            break;
         case 'p':
             port[num_ports++] =
                 (uint16_t)MIN(UINT16_MAX, strtoul(optarg, 0, 10));
@@ -313,7 +515,7 @@ int main(int argc, char * argv[])
         case '?':
         default:
             usage(basename(argv[0]), ifname, qlog_dir, port[0], dir, cert, key,
-                  tls_log, timeout, retry, num_bufs);
+                  tls_log, tckt_keys, timeout, retry, num_bufs, cache_mb);
         }
     }
 
@@ -321,6 +523,7 @@ int main(int argc, char * argv[])
         // if no -p args were given, we listen on two ports by default
         num_ports = 2;
 
+    obj_budget = (uint_t)MIN((uint64_t)cache_mb * 1024 * 1024, UINT_T_MAX);
     const int dir_fd = open(dir, O_RDONLY | O_CLOEXEC);
     ensure(dir_fd != -1, "%s does not exist", dir);
 
@@ -332,6 +535,8 @@ int main(int argc, char * argv[])
                                            },
                                        .qlog_dir = *qlog_dir ? qlog_dir : 0,
                                        .tls_log = *tls_log ? tls_log : 0,
+                                       .tls_ticket_keys =
+                                           *tckt_keys ? tckt_keys : 0,
                                        .force_retry = retry,
                                        .num_bufs = num_bufs,
                                        .tls_cert = cert,
@@ -350,38 +555,92 @@ int main(int argc, char * argv[])
 
     bool first_conn = true;
     http_parser_settings settings = {.on_url = serve_cb};
+    http_parser parser;
+    struct q_event ev[256];
 
     while (1) {
-        struct q_conn * c;
-        const bool have_active =
-            q_ready(w, first_conn ? 0 : timeout * NS_PER_S, &c);
-        if (c == 0) {
-            if (have_active == false && timeout)
+        const uint32_t n = q_poll(w, ev, sizeof(ev) / sizeof(ev[0]),
+                                  first_conn ? 0 : timeout * NS_PER_S);
+        if (n == 0) {
+            // only exit once all conns are gone, like q_ready() did
+            if (timeout && kh_size(&conns) == 0)
                 break;
             continue;
         }
         first_conn = false;
 
-        // do we need to q_accept?
-        if (q_is_new_serv_conn(c))
-            q_accept(w, 0);
+        // a conn closed while handling this batch is freed, skip its events
+        const struct q_conn * closed = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            struct q_conn * const c = ev[i].c;
+            struct q_stream * const s = ev[i].s;
+            if (c == closed)
+                continue;
+
+            if (ev[i].ev & Q_EV_NEW_CONN) {
+                const struct q_conn * const ac = q_accept(w, 0);
+                if (ac) {
+                    int r;
+                    kh_put(conn_set, &conns, (khint64_t)(uintptr_t)ac, &r);
+                }
+            }
 
-        if (q_is_conn_closed(c)) {
-            q_close(c, 0, 0);
-            continue;
-        }
+            if (ev[i].ev & Q_EV_CONN_CLOSED) {
+                conn_forget(c);
+                q_close(c, 0, 0);
+                closed = c;
+                continue;
+            }
 
-        // do we need to handle a request?
-        struct cb_data d = {.c = c, .w = w, .dir = dir_fd};
-        http_parser parser = {.data = &d};
+            struct w_iov_sq q = w_iov_sq_initializer(q);
+            if ((ev[i].ev & Q_EV_READABLE) && q_read_stream(s, &q, false)) {
+                if (q_is_uni_stream(s)) {
+                    warn(NTE, "can't serve request on uni stream: %.*s",
+                         sq_first(&q)->len, sq_first(&q)->buf);
+                    q_free(&q);
+                    continue;
+                }
 
-    again:
-        http_parser_init(&parser, HTTP_REQUEST);
-        struct w_iov_sq q = w_iov_sq_initializer(q);
-        struct q_stream * s = q_read(c, &q, false);
+                // handle the request
+                struct cb_data d = {.c = c,
+                                     .w = w,
+                                     .dir = dir_fd,
+                                     .s = s,
+                                     .af = sq_first(&q)->wv_af};
+                parser.data = &d;
+                http_parser_init(&parser, HTTP_REQUEST);
+                struct w_iov * v;
+                sq_foreach (v, &q, next) {
+                    if (v->len == 0)
+                        // skip empty bufs (such as pure FINs)
+                        continue;
+
+                    const size_t parsed = http_parser_execute(
+                        &parser, &settings, (char *)v->buf, v->len);
+                    // serve_cb() may already have closed the conn
+                    if (parsed != v->len && d.closed == false) {
+                        warn(ERR, "HTTP parser error: %.*s",
+                             (int)(v->len - parsed), &v->buf[parsed]);
+                        hexdump(v->buf, v->len);
+                        // XXX the strnlen() test is super-hacky
+                        const uint16_t code =
+                            strnlen((char *)v->buf, v->len) == v->len ? 400
+                                                                      : 505;
+                        send_err(&d, code);
+                        ret = 1;
+                    }
+                    break;
+                }
+                q_free(&q);
+                if (d.closed) {
+                    // its remaining events in this batch are stale
+                    conn_forget(c);
+                    closed = c;
+                    continue;
+                }
+            }
 
-        if (sq_empty(&q)) {
-            if (s && q_is_stream_closed(s)) {
+            if (ev[i].ev & Q_EV_STRM_CLOSED) {
                 // retrieve the TX'ed request
                 q_stream_get_written(s, &q);
 #ifndef NDEBUG
@@ -395,43 +654,12 @@ int main(int argc, char * argv[])
 #endif
                 q_free_stream(s);
                 q_free(&q);
-                goto again;
-            }
-            continue;
-        }
-
-        if (q_is_uni_stream(s)) {
-            warn(NTE, "can't serve request on uni stream: %.*s",
-                 sq_first(&q)->len, sq_first(&q)->buf);
-
-        } else {
-            d.s = s;
-            d.af = sq_first(&q)->wv_af;
-            struct w_iov * v;
-            sq_foreach (v, &q, next) {
-                if (v->len == 0)
-                    // skip empty bufs (such as pure FINs)
-                    continue;
-
-                const size_t parsed = http_parser_execute(
-                    &parser, &settings, (char *)v->buf, v->len);
-                if (parsed != v->len) {
-                    warn(ERR, "HTTP parser error: %.*s", (int)(v->len - parsed),
-                         &v->buf[parsed]);
-                    hexdump(v->buf, v->len);
-                    // XXX the strnlen() test is super-hacky
-                    if (strnlen((char *)v->buf, v->len) == v->len)
-                        send_err(&d, 400);
-                    else
-                        send_err(&d, 505);
-                    ret = 1;
-                }
-                q_free(&q);
-                goto again;
             }
         }
     }
 
+    obj_cache_cleanup();
+    kh_release(conn_set, &conns);
     q_cleanup(w);
     warn(DBG, "%s exiting", basename(argv[0]));
     return ret;
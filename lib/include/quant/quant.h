@@ -41,11 +41,14 @@ extern "C" {
 
 struct w_iov_sq;
 struct q_stream;
+struct q_shared;
 
 
 struct q_conn_conf {
     uint_t idle_timeout;             // seconds
     uint_t tls_key_update_frequency; // seconds
+    uint_t max_strm_out;             // stream send buffer (0 = no limit)
+    uint_t max_conn_out;             // conn send buffer (0 = no limit)
     uint8_t enable_spinbit : 1;
     uint8_t enable_udp_zero_checksums : 1;
     uint8_t enable_tls_key_updates : 1; // TODO default to on eventually
@@ -63,10 +66,19 @@ struct q_conf {
     const char * const tls_key;      // required for server
     const char * const tls_log;
     const char * const qlog_dir;
-    uint32_t num_bufs;
+    const char * const tls_ticket_keys; // server only; shareable key file
+    uint32_t num_bufs;                // buffer pool size, fixed at q_init()
+    uint32_t conn_buf_quota;          // max. send bufs per conn (0 = no limit)
+    uint32_t clnt_socks; // client only; sockets shared by all conns (0 = off)
+    uint32_t tls_ticket_key_rotation; // server only; in seconds
+    // server only; send Retry while any of these is exceeded (0 = ignore)
+    uint32_t retry_half_open; // number of connections in the handshake
+    uint32_t retry_init_rate; // new connections per second
+    uint8_t retry_buf_pct;    // percentage of buffers in use
     uint8_t enable_tls_cert_verify : 1;
-    uint8_t force_retry : 1; // ignored on client
-    uint8_t : 6;
+    uint8_t force_retry : 1;   // ignored on client
+    uint8_t use_hugepages : 1; // back buffers and meta-data with hugepages
+    uint8_t : 5;
     uint8_t client_cid_len;
     uint8_t server_cid_len;
 };
@@ -77,6 +89,7 @@ struct q_conn_info {
     uint_t pkts_in_invalid;
 
     uint_t pkts_out;
+    uint_t dgrams_out; // less than pkts_out when pkts were coalesced
     uint_t pkts_out_lost;
     uint_t pkts_out_rtx;
 
@@ -100,6 +113,22 @@ struct q_conn_info {
 };
 
 
+// event types reported by q_poll(), or'ed together per connection or stream
+#define Q_EV_NEW_CONN 0x01    // new server conn, needs q_accept()
+#define Q_EV_READABLE 0x02    // new stream data (or FIN) for q_read_stream()
+#define Q_EV_WRITABLE 0x04    // window opened or send buffer drained
+#define Q_EV_STRM_CLOSED 0x08 // stream is closed in both directions
+#define Q_EV_CONN_CLOSED 0x10 // conn is closed, needs q_close()
+
+
+struct q_event {
+    struct q_conn * c;
+    struct q_stream * s; // zero for conn events
+    uint8_t ev;          // Q_EV_* bitmask
+    uint8_t _unused[7];
+};
+
+
 extern struct w_engine * __attribute__((nonnull(1)))
 q_init(const char * const ifname, const struct q_conf * const conf);
 
@@ -131,6 +160,29 @@ q_is_new_serv_conn(const struct q_conn * const c);
 extern bool __attribute__((nonnull))
 q_write(struct q_stream * const s, struct w_iov_sq * const q, const bool fin);
 
+extern bool __attribute__((nonnull))
+q_write_some(struct q_stream * const s,
+             struct w_iov_sq * const q,
+             const bool fin);
+
+extern struct q_shared * __attribute__((nonnull))
+q_shared_new(struct w_iov_sq * const q);
+
+// like q_shared_new(), but takes over a malloc()'ed buffer instead of pool
+// buffers; it is freed with the last reference
+extern struct q_shared * __attribute__((nonnull))
+q_shared_new_buf(uint8_t * const buf, const size_t len);
+
+extern void __attribute__((nonnull)) q_shared_free(struct q_shared * const sh);
+
+extern bool __attribute__((nonnull))
+q_write_shared(struct q_stream * const s,
+               struct q_shared * const sh,
+               const bool fin);
+
+// buffers returned by q_read() and q_read_stream() may share memory with other
+// RX buffers and are read-only; q_write() copies them before queueing for TX,
+// and returns false (leaving the data in the queue) if it runs out of buffers
 extern struct q_stream * __attribute__((nonnull))
 q_read(struct q_conn * const c, struct w_iov_sq * const q, const bool all);
 
@@ -195,6 +247,11 @@ extern bool q_ready(struct w_engine * const w,
                     const uint64_t nsec,
                     struct q_conn ** const ready);
 
+extern uint32_t __attribute__((nonnull)) q_poll(struct w_engine * const w,
+                                                struct q_event * const ev,
+                                                const uint32_t n,
+                                                const uint64_t nsec);
+
 extern bool __attribute__((nonnull))
 q_is_uni_stream(const struct q_stream * const s);
 
@@ -58,6 +58,7 @@
 #include "frame.h"
 #include "loop.h"
 #include "marshall.h"
+#include "netsim.h"
 #include "pkt.h"
 #include "pn.h"
 #include "qlog.h"
@@ -81,6 +82,7 @@
 const char * const conn_state_str[] = {CONN_STATES};
 
 struct q_conn_sl c_ready = sl_head_initializer(c_ready);
+struct q_conn_sq c_ev = sq_head_initializer(c_ev);
 struct q_conn_sl c_zcid = sl_head_initializer(c_zcid);
 
 #ifndef NO_SERVER
@@ -187,6 +189,69 @@ get_local_sock_by_ipnp(struct per_engine_data * const ped,
 #endif
 
 
+#ifndef NO_MIGRATION
+/// Return one of the client sockets bound to local address @p idx that are
+/// shared by all client connections, binding a new one if fewer than
+/// q_conf::clnt_socks exist. Connections on shared sockets are demultiplexed
+/// by their CIDs.
+///
+/// @param      w     Warpcore engine.
+/// @param      idx   Local address index.
+/// @param      opt   Socket options to use for a new socket.
+///
+/// @return     Shared client socket, or zero on error.
+///
+static struct w_sock * __attribute__((nonnull))
+get_clnt_sock(struct w_engine * const w,
+              const uint16_t idx,
+              const struct w_sockopt * const opt)
+{
+    struct per_engine_data * const ped = ped(w);
+    uint_t n = 0;
+    for (size_t i = 0; i < kv_size(ped->clnt_socks); i++)
+        if (w_addr_cmp(&w->ifaddr[idx].addr,
+                       &kv_A(ped->clnt_socks, i)->ws_laddr))
+            n++;
+
+    if (n < ped->conf.clnt_socks) {
+        struct w_sock * const ws = w_bind(w, idx, 0, opt);
+        if (likely(ws)) {
+#ifndef NO_NETSIM
+            if (unlikely(netsim_on))
+                netsim_bind(ws);
+#endif
+            kv_push(struct w_sock *, ped->clnt_socks, ws);
+            return ws;
+        }
+        if (n == 0)
+            return 0;
+        // otherwise, fall back to one of the existing sockets
+    }
+
+    // pick the next of the n sockets round-robin
+    uint_t pick = ped->clnt_socks_rr++ % n;
+    for (size_t i = 0;; i++) {
+        struct w_sock * const ws = kv_A(ped->clnt_socks, i);
+        if (w_addr_cmp(&w->ifaddr[idx].addr, &ws->ws_laddr) && pick-- == 0)
+            return ws;
+    }
+}
+
+
+static bool __attribute__((nonnull))
+is_clnt_sock(const struct w_sock * const ws)
+{
+    if (w_connected(ws))
+        return true;
+    const struct per_engine_data * const ped = ped(w_engine(ws));
+    for (size_t i = 0; i < kv_size(ped->clnt_socks); i++)
+        if (kv_A(ped->clnt_socks, i) == ws)
+            return true;
+    return false;
+}
+#endif
+
+
 #ifndef NO_SRT_MATCHING
 struct q_conn * get_conn_by_srt(uint8_t * const srt)
 {
@@ -253,6 +318,7 @@ void use_next_dcid(struct q_conn * const c)
         c->spin = 0; // need to reset spin value
     c->tx_retire_cid = c->dcid->retired = true;
     c->dcid = dcid;
+    c->sh_hdr_len = 0;
 }
 #endif
 
@@ -302,36 +368,45 @@ static void __attribute__((nonnull)) log_sent_pkts(struct q_conn * const c)
 #endif
 
 
-static void __attribute__((nonnull))
+static bool __attribute__((nonnull))
 rtx_pkt(struct w_iov * const v, struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
+
+    // on RTX, remember orig pkt meta data (unless the pkt is lost already)
+    if (m->lost == false) {
+        const uint16_t data_start = m->strm_data_pos;
+        struct pkt_meta * m_orig;
+        struct w_iov * const v_orig =
+            alloc_iov(c->w, q_conn_af(c), 0, data_start, &m_orig);
+        if (unlikely(v_orig == 0))
+            // try again once buffers are available
+            return false;
+        pm_cpy(m_orig, m, true);
+        memcpy(v_orig->buf - data_start, v->buf - data_start, data_start);
+        m_orig->has_rtx = true;
+        sl_insert_head(&m->rtx, m_orig, rtx_next);
+        sl_insert_head(&m_orig->rtx, m, rtx_next);
+        pm_by_nr_del(&m->pn->sent_pkts, m);
+        // we reinsert m with its new pkt nr in on_pkt_sent()
+        pm_by_nr_ins(&m_orig->pn->sent_pkts, m_orig);
+    }
+
 #ifndef NO_QINFO
     c->i.pkts_out_rtx++;
 #endif
-
-    if (m->lost)
-        // we don't need to do the steps below if the pkt is lost already
-        return;
-
-    // on RTX, remember orig pkt meta data
-    const uint16_t data_start = m->strm_data_pos;
-    struct pkt_meta * m_orig;
-    struct w_iov * const v_orig =
-        alloc_iov(c->w, q_conn_af(c), 0, data_start, &m_orig);
-    pm_cpy(m_orig, m, true);
-    memcpy(v_orig->buf - data_start, v->buf - data_start, data_start);
-    m_orig->has_rtx = true;
-    sl_insert_head(&m->rtx, m_orig, rtx_next);
-    sl_insert_head(&m_orig->rtx, m, rtx_next);
-    pm_by_nr_del(&m->pn->sent_pkts, m);
-    // we reinsert m with its new pkt nr in on_pkt_sent()
-    pm_by_nr_ins(&m_orig->pn->sent_pkts, m_orig);
+    return true;
 }
 
 
 static void do_w_tx(struct w_sock * const ws, struct w_iov_sq * const q)
 {
+#ifndef NO_NETSIM
+    if (unlikely(netsim_on)) {
+        netsim_tx(ws, q);
+        return;
+    }
+#endif
 #ifndef FUZZING
     w_tx(ws, q);
     do
@@ -347,6 +422,8 @@ static void __attribute__((nonnull)) tx_vneg_resp(struct w_sock * const ws,
 {
     struct pkt_meta * mx;
     struct w_iov * const xv = alloc_iov(ws->w, ws->ws_af, 0, 0, &mx);
+    if (unlikely(xv == 0))
+        return;
 
     struct w_iov_sq q = w_iov_sq_initializer(q);
     sq_insert_head(&q, xv, next);
@@ -383,16 +460,23 @@ static void __attribute__((nonnull)) do_tx_txq(struct q_conn * const c,
 {
 #ifndef NO_QINFO
     c->i.pkts_out += w_iov_sq_cnt(q);
+    c->i.dgrams_out += w_iov_sq_cnt(q);
 #endif
 
     const uint16_t pmtu =
         MIN(w_max_udp_payload(ws), (uint16_t)c->tp_peer.max_pkt);
 
-    if (w_iov_sq_cnt(q) > 1 && unlikely(is_lh(*sq_first(q)->buf))) {
+    // enc_pkt() already coalesced what it could into the txq datagrams
+    const bool coal = q == &c->txq && c->tx_coal > 0;
+    if ((w_iov_sq_cnt(q) > 1 || coal) && unlikely(is_lh(*sq_first(q)->buf))) {
         const bool do_pmtud =
             c->rec.max_pkt_size == MIN_INI_LEN && pmtu > MIN_INI_LEN;
-        c->pmtud_pkt = coalesce(
-            q, unlikely(do_pmtud) ? pmtu : c->rec.max_pkt_size, do_pmtud);
+        c->pmtud_pkt =
+            unlikely(do_pmtud) ? pad_pmtud_probe(q, pmtu) : UINT16_MAX;
+    }
+    if (q == &c->txq) {
+        c->tx_tail = 0;
+        c->tx_coal = 0;
     }
     do_w_tx(ws, q);
 
@@ -413,8 +497,8 @@ static void __attribute__((nonnull)) do_tx(struct q_conn * const c)
     if (likely(sq_empty(&c->txq) == false))
         do_tx_txq(c, &c->txq, c->sock);
 #ifndef NO_MIGRATION
-    if (likely(sq_empty(&c->migr_txq) == false))
-        do_tx_txq(c, &c->migr_txq, c->migr_sock);
+    if (unlikely(c->migr) && sq_empty(&c->migr->txq) == false)
+        do_tx_txq(c, &c->migr->txq, c->migr->sock);
 #endif
     log_sent_pkts(c);
 }
@@ -460,7 +544,7 @@ static void __attribute__((nonnull)) do_conn_mgmt(struct q_conn * const c)
         if (!is_clnt(c) && unlikely(c->tx_new_tok && c->tok_len == 0 &&
                                     c->pns[ep_init].abandoned))
             // TODO: find a better way to send NEW_TOKEN
-            make_rtry_tok(c);
+            c->tok_len = make_tok(c->w, &c->peer, 0, conn_tok(c));
 
         do_stream_id_fc(c, c->cnt_uni, false, true);
         do_stream_id_fc(c, c->cnt_bidi, true, true);
@@ -488,10 +572,64 @@ static void __attribute__((nonnull)) do_conn_mgmt(struct q_conn * const c)
 }
 
 
+/// Returns how many bytes of new stream data the windows currently allow us to
+/// send on stream @p s, but at least one packet's worth.
+///
+/// @param      s     Stream.
+///
+/// @return     Number of bytes.
+///
+static uint_t __attribute__((nonnull)) out_wnd(const struct q_stream * const s)
+{
+    const struct q_conn * const c = s->c;
+    const uint_t pkt = c->rec.max_pkt_size - AEAD_LEN - DATA_OFFSET;
+    uint_t wnd = c->rec.cur.cwnd > c->rec.cur.in_flight
+                     ? c->rec.cur.cwnd - c->rec.cur.in_flight
+                     : 0;
+    wnd = MIN(wnd, s->out_data_max > s->out_data
+                       ? s->out_data_max - s->out_data
+                       : 0);
+    wnd = MIN(wnd, c->tp_peer.max_data > c->out_data_str
+                       ? c->tp_peer.max_data - c->out_data_str
+                       : 0);
+    return MAX(wnd, pkt);
+}
+
+
+/// Returns how many packets the current TX burst on stream @p s can at most
+/// consist of, so their ciphertext buffers can be reserved in one go.
+///
+/// @param      s     Stream.
+///
+/// @return     Number of packets.
+///
+static uint32_t __attribute__((nonnull))
+tx_burst_len(const struct q_stream * const s)
+{
+    const struct q_conn * const c = s->c;
+    if (c->tx_limit)
+        return c->tx_limit;
+
+    const uint_t wnd = c->rec.cur.cwnd > c->rec.cur.in_flight
+                           ? c->rec.cur.cwnd - c->rec.cur.in_flight
+                           : 0;
+    const uint_t n = MIN(w_iov_sq_cnt(&s->out), wnd / c->rec.max_pkt_size + 1);
+    return (uint32_t)MIN(n, TX_BURST_MAX);
+}
+
+
 static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
 {
     struct q_conn * const c = s->c;
 
+    if (unlikely(!sq_empty(&s->out_refs))) {
+        // copy more shared data once everything queued so far has been sent
+        // cppcheck-suppress nullPointer
+        const struct w_iov * const last = sq_last(&s->out, w_iov, next);
+        if (last == 0 || meta(last).txed)
+            fill_out(s, out_wnd(s));
+    }
+
     const bool has_data =
         (sq_empty(&s->out) == false && out_fully_acked(s) == false);
 
@@ -525,6 +663,10 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
     struct w_iov * v = s->out_una;
     sq_foreach_from (v, &s->out, next) {
         struct pkt_meta * const m = &meta(v);
+        if (likely(s->id >= 0) && m->txed == false)
+            // size the data for the current, rather than the queuing-time PMTU
+            rechunk_out(s, v);
+
         if (unlikely(has_wnd(c, v->len) == false && c->tx_limit == 0)) {
             c->no_wnd = true;
             break;
@@ -544,14 +686,26 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
             continue;
         }
 
+        if (sq_empty(&c->tx_bat)) {
+            // reserve the ciphertext buffers for the (rest of the) burst up
+            // front, before touching any flow control or RTX state below
+            w_alloc_cnt(c->w, q_conn_af(c), &c->tx_bat, tx_burst_len(s), 0, 0);
+            if (unlikely(sq_empty(&c->tx_bat))) {
+                warn(ERR, "buffer pool exhausted, delaying TX on %s conn %s",
+                     conn_type(c), cid_str(c->scid));
+                break;
+            }
+        }
+
+        const bool do_rtx = m->lost || (c->tx_limit && m->txed);
+        if (unlikely(do_rtx) && rtx_pkt(v, m) == false)
+            break;
+
         if (likely(c->state == conn_estb && s->id >= 0)) {
             do_stream_fc(s, v->len);
             do_conn_fc(c, v->len);
         }
-
-        const bool do_rtx = m->lost || (c->tx_limit && m->txed);
-        if (unlikely(do_rtx))
-            rtx_pkt(v, m);
+        c->tx_burst = encoded > 0;
 
         if (unlikely(enc_pkt(s, do_rtx, true, c->tx_limit > 0, false, v, m) ==
                      false))
@@ -572,6 +726,11 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
             break;
     }
 
+    // return any reserved buffers the burst did not use
+    c->tx_burst = false;
+    if (unlikely(sq_empty(&c->tx_bat) == false))
+        w_free(&c->tx_bat);
+
     return (c->tx_limit == 0 || encoded < c->tx_limit) && c->no_wnd == false;
 }
 
@@ -585,7 +744,41 @@ tx_ack(struct q_conn * const c, const epoch_t e, const bool tx_ack_eliciting)
 
     struct pkt_meta * m;
     struct w_iov * const v = alloc_iov(c->w, q_conn_af(c), 0, 0, &m);
-    return enc_pkt(c->cstrms[e], false, false, tx_ack_eliciting, false, v, m);
+    if (unlikely(v == 0))
+        return false;
+    if (unlikely(enc_pkt(c->cstrms[e], false, false, tx_ack_eliciting, false,
+                         v, m) == false)) {
+        free_iov(v, m);
+        return false;
+    }
+    return true;
+}
+
+
+/// Send the next DPLPMTUD probe, a PING padded to the probe size, if the
+/// search asks for one and the congestion window allows it.
+///
+/// @param      c     Connection.
+///
+static void __attribute__((nonnull)) tx_pmtud_probe(struct q_conn * const c)
+{
+    const uint16_t len = pmtud_probe_size(c);
+    if (likely(len == 0) || has_wnd(c, len) == false)
+        return;
+
+    struct pkt_meta * m;
+    struct w_iov * const v = alloc_iov(c->w, q_conn_af(c), len, 0, &m);
+    if (unlikely(v == 0))
+        return;
+
+    if (unlikely(enc_pkt(c->cstrms[ep_data], false, false, true, true, v, m) ==
+                 false)) {
+        free_iov(v, m);
+        return;
+    }
+    c->rec.pmtud_probe = len;
+    warn(NTE, "testing PMTU %u on %s conn %s", len, conn_type(c),
+         cid_str(c->scid));
 }
 
 
@@ -605,13 +798,6 @@ void tx(struct q_conn * const c)
         goto done;
     }
 
-#ifndef NO_SERVER
-    if (unlikely(c->tx_rtry)) {
-        tx_ack(c, ep_init, false);
-        goto done;
-    }
-#endif
-
     if (unlikely(c->state == conn_opng) && is_clnt(c) && c->try_0rtt &&
         c->pns[pn_data].data.out_0rtt.aead == 0) {
         // if we have no 0-rtt keys here, the ticket didn't have any - disable
@@ -638,13 +824,16 @@ void tx(struct q_conn * const c)
             if (tx_stream(s) == false)
                 break;
         });
+
+        if (likely(c->state == conn_estb))
+            tx_pmtud_probe(c);
     }
 
 done:;
     // make sure we sent enough packets when we have a TX limit
-    uint_t sent = w_iov_sq_cnt(&c->txq)
+    uint_t sent = w_iov_sq_cnt(&c->txq) + c->tx_coal
 #ifndef NO_MIGRATION
-                  + w_iov_sq_cnt(&c->migr_txq)
+                  + (unlikely(c->migr) ? w_iov_sq_cnt(&c->migr->txq) : 0)
 #endif
         ;
     while ((unlikely(c->tx_limit) && sent < c->tx_limit) ||
@@ -782,6 +971,7 @@ void add_dcid(struct q_conn * const c, const struct cid * const id)
 #endif
     }
     cid_cpy(dcid, id);
+    c->sh_hdr_len = 0;
 #ifndef NO_SRT_MATCHING
     if (id->has_srt)
         conns_by_srt_ins(c, dcid->srt);
@@ -792,6 +982,160 @@ void add_dcid(struct q_conn * const c, const struct cid * const id)
 }
 
 
+#ifndef NO_SERVER
+static void __attribute__((nonnull)) end_half_open(struct q_conn * const c)
+{
+    if (c->is_half_open) {
+        c->is_half_open = false;
+        ped(c->w)->half_open--;
+    }
+}
+
+
+static bool __attribute__((const))
+over_lim(const bool engaged, const uint_t val, const uint_t lim)
+{
+    // engage at the limit, disengage below 3/4 of it
+    return lim && (engaged ? val * 4 >= lim * 3 : val >= lim);
+}
+
+
+static bool __attribute__((nonnull)) need_rtry(struct w_engine * const w)
+{
+    struct per_engine_data * const ped = ped(w);
+    const struct q_conf * const conf = &ped->conf;
+    if (conf->force_retry)
+        return true;
+    if (likely(conf->retry_half_open == 0 && conf->retry_init_rate == 0 &&
+               conf->retry_buf_pct == 0))
+        return false;
+
+    const uint64_t now = loop_now();
+    if (now - ped->ini_t >= NS_PER_S) {
+        ped->ini_rate = (uint_t)(ped->ini_cnt * NS_PER_S / (now - ped->ini_t));
+        ped->ini_cnt = 0;
+        ped->ini_t = now;
+    }
+
+    const uint_t bufs_free = w_iov_sq_cnt(&w->iov);
+    const uint_t buf_pct =
+        bufs_free >= conf->num_bufs
+            ? 0
+            : (uint_t)(100 * (conf->num_bufs - bufs_free) / conf->num_bufs);
+
+    const bool on = ped->rtry_on;
+    const bool need = over_lim(on, ped->half_open, conf->retry_half_open) ||
+                      over_lim(on, ped->ini_rate, conf->retry_init_rate) ||
+                      over_lim(on, buf_pct, conf->retry_buf_pct);
+    if (unlikely(need != on)) {
+        warn(NTE,
+             "%sengaging Retry, %" PRIu " half-open conns, %" PRIu
+             " new conns/sec, %" PRIu "%% bufs in use",
+             need ? "" : "dis", ped->half_open, ped->ini_rate, buf_pct);
+        ped->rtry_on = need;
+    }
+    return need;
+}
+
+
+/// Statelessly answer the Initial in @p v with a Retry. The odcid travels in
+/// the token, so no connection state is needed until the client returns it.
+///
+/// @param      ws    Warpcore socket the Initial was received on.
+/// @param[in]  v     The received Initial.
+/// @param[in]  m     Packet meta-data of @p v.
+///
+static void __attribute__((nonnull)) tx_rtry(struct w_sock * const ws,
+                                             const struct w_iov * const v,
+                                             const struct pkt_meta * const m)
+{
+    struct pkt_meta * mx;
+    struct w_iov * const xv = alloc_iov(ws->w, ws->ws_af, 0, 0, &mx);
+    if (unlikely(xv == 0))
+        return;
+
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    sq_insert_head(&q, xv, next);
+
+    // the client will switch its dcid to this one
+    struct cid scid = {.seq = 0};
+    mk_rand_cid(&scid, ped(ws->w)->conf.server_cid_len, false);
+    uint8_t tok[RTRY_TOK_LEN_MAX];
+    const uint16_t tok_len = make_tok(ws->w, &v->saddr, &m->hdr.dcid, tok);
+
+    mx->txed = 1;
+    mx->hdr.type = LH_RTRY;
+    mx->hdr.flags = LH | LH_RTRY | (uint8_t)w_rand_uniform32(0x0f);
+    mx->hdr.vers = m->hdr.vers;
+
+    uint8_t * pos = xv->buf;
+    const uint8_t * const end = xv->buf + xv->len;
+    enc1(&pos, end, mx->hdr.flags);
+    enc4(&pos, end, mx->hdr.vers);
+    enc_lh_cids(&pos, end, mx, &m->hdr.scid, &scid);
+    encb(&pos, end, tok, tok_len);
+    uint8_t rit[RIT_LEN];
+    make_rit(ws->w, mx->hdr.vers, &m->hdr.dcid, mx->hdr.flags, &mx->hdr.dcid,
+             &mx->hdr.scid, tok, tok_len, rit);
+    encb(&pos, end, rit, RIT_LEN);
+
+    mx->udp_len = xv->len = (uint16_t)(pos - xv->buf);
+    xv->saddr = v->saddr;
+    xv->flags = v->flags;
+    log_pkt("TX", xv, &xv->saddr, tok, tok_len, rit);
+    ped(ws->w)->rtry_t = loop_now();
+    do_w_tx(ws, &q);
+    q_free(&q);
+}
+
+
+/// Decide whether the Initial in @p v, which would open a new connection,
+/// needs to be answered with a Retry, and validate any token it carries. This
+/// happens before any connection state is allocated for it.
+///
+/// @param      ws       Warpcore socket the Initial was received on.
+/// @param[in]  v        The received Initial.
+/// @param[in]  m        Packet meta-data of @p v.
+/// @param[in]  tok      Token in the Initial, if any.
+/// @param[in]  tok_len  Length of @p tok.
+/// @param[out] odcid    Original DCID, if @p tok is a valid Retry token.
+///
+/// @return     True if a connection should be opened, false if a Retry was
+///             sent instead.
+///
+static bool __attribute__((nonnull(1, 2, 3, 6)))
+rtry_or_validate(struct w_sock * const ws,
+                 const struct w_iov * const v,
+                 const struct pkt_meta * const m,
+                 const uint8_t * const tok,
+                 const uint16_t tok_len,
+                 struct cid * const odcid)
+{
+    struct per_engine_data * const ped = ped(ws->w);
+    ped->ini_cnt++;
+
+    // TODO: remove this interop hack eventually
+    const bool rtry = bswap16(ws->ws_lport) == 4434 || need_rtry(ws->w);
+
+    // also check tokens of clients that got Retry just before it was
+    // disengaged, so we include their odcid in the TPs
+    if (tok_len && (rtry || loop_now() - ped->rtry_t < NS_PER_S)) {
+        if (verify_tok(ws->w, &v->saddr, tok, tok_len, odcid))
+            return true;
+        warn(rtry ? WRN : NTE, "invalid token, %s",
+             rtry ? "sending retry" : "ignoring");
+    }
+
+    if (rtry == false)
+        return true;
+
+    warn(INF, "sending retry");
+    tx_rtry(ws, v, m);
+    return false;
+}
+#endif
+
+
 static void __attribute__((nonnull))
 rx_crypto(struct q_conn * const c, const struct pkt_meta * const m_cur)
 {
@@ -816,12 +1160,16 @@ rx_crypto(struct q_conn * const c, const struct pkt_meta * const m_cur)
 
         if (c->state == conn_idle || c->state == conn_opng) {
             conn_to_state(c, conn_estb);
+#ifndef NO_SERVER
+            end_half_open(c);
+#endif
             if (is_clnt(c))
                 maybe_api_return(q_connect, c, 0);
 #ifndef NO_SERVER
             else if (c->needs_accept == false) {
                 sl_insert_head(&accept_queue, c, node_aq);
                 c->needs_accept = true;
+                post_ev(c, 0, Q_EV_NEW_CONN);
             }
 
 #endif
@@ -984,32 +1332,9 @@ static bool __attribute__((nonnull)) rx_pkt(const struct w_sock * const ws
     switch (c->state) {
     case conn_idle:
 #ifndef NO_SERVER
-        // this is a new connection
+        // this is a new connection, rx_pkts() already dealt with Retry
         c->vers = m->hdr.vers;
 
-        // TODO: remove this interop hack eventually
-        if (bswap16(ws->ws_lport) == 4434 || ped(c->w)->conf.force_retry) {
-            if (m->hdr.type == LH_INIT && tok_len) {
-                if (verify_rtry_tok(c, tok, tok_len) == false) {
-                    warn(ERR, "retry token verification failed");
-                    enter_closing(c);
-                    goto done;
-                }
-            } else {
-                if (c->tx_rtry) {
-                    warn(DBG, "already tx'ing retry, ignoring");
-                    goto done;
-                }
-                warn(INF, "sending retry");
-                // send a RETRY
-                make_rtry_tok(c);
-                ok = true;
-                c->needs_tx = c->tx_rtry = true;
-                update_act_scid(c);
-                goto done;
-            }
-        }
-
 #ifdef DEBUG_EXTRA
         warn(INF, "supporting clnt-requested vers 0x%0" PRIx32, c->vers);
 #endif
@@ -1118,7 +1443,7 @@ static bool __attribute__((nonnull)) rx_pkt(const struct w_sock * const ws
 
                 // handle an incoming retry packet
                 c->tok_len = tok_len;
-                memcpy(c->tok, tok, c->tok_len);
+                memcpy(conn_tok(c), tok, c->tok_len);
                 vneg_or_rtry_resp(c, false);
                 warn(INF, "handling serv retry w/tok %s",
                      tok_str(c->tok, c->tok_len));
@@ -1195,6 +1520,56 @@ done:
 }
 
 
+#ifndef NO_RX_FAST
+/// Check whether @p xv is a short-header packet for an established connection
+/// that can skip the generic header handling in rx_pkts(), i.e., one that
+/// needs no long-header parsing, is not part of a coalesced datagram, and
+/// arrives from the current peer address with the current SCID. Does not
+/// modify @p xv, so the caller can fall back to the generic path.
+///
+/// @param      ws       Warpcore socket the packet was received on.
+/// @param      xv       Received (encrypted) packet.
+/// @param      v        Buffer for the decrypted packet.
+/// @param      m        Packet meta-data for @p v.
+/// @param[in]  cid_len  Length of the DCID in short-header packets.
+///
+/// @return     The connection @p xv belongs to, or zero if the generic path
+///             must handle it.
+///
+static struct q_conn * __attribute__((nonnull))
+rx_fast_conn(const struct w_sock * const ws,
+             const struct w_iov * const xv,
+             const struct w_iov * const v,
+             struct pkt_meta * const m,
+             const uint8_t cid_len)
+{
+    const uint8_t flags = xv->buf[0];
+    if (unlikely((flags & LH) != SH || xv->len <= 1 + cid_len + AEAD_LEN))
+        return 0;
+
+    m->hdr.dcid.len = cid_len;
+    memcpy(m->hdr.dcid.id, &xv->buf[1], cid_len);
+
+#ifndef NO_MIGRATION
+    struct q_conn * const c =
+        cid_len ? get_conn_by_cid(&m->hdr.dcid) : (struct q_conn *)ws->data;
+#else
+    struct q_conn * const c = (struct q_conn *)ws->data;
+#endif
+    if (unlikely(c == 0 || c->state != conn_estb ||
+                 (cid_len && cid_cmp(&m->hdr.dcid, c->scid) != 0) ||
+                 w_sockaddr_cmp(&c->peer, &v->saddr) == false))
+        return 0;
+
+    m->udp_len = xv->len;
+    m->hdr.flags = flags;
+    m->hdr.type = pkt_type(flags);
+    m->hdr.hdr_len = 1 + cid_len;
+    return c;
+}
+#endif
+
+
 #ifdef FUZZING
 void
 #else
@@ -1218,6 +1593,11 @@ static void __attribute__((nonnull))
         // allocate new w_iov for the (eventual) unencrypted data and meta-data
         struct pkt_meta * m;
         struct w_iov * const v = alloc_iov(ws->w, ws->ws_af, 0, 0, &m);
+        if (unlikely(v == 0)) {
+            // drop the pkt, the peer will retransmit
+            w_free_iov(xv);
+            continue;
+        }
         v->saddr = xv->saddr;
         v->flags = xv->flags;
         v->ttl = xv->ttl;
@@ -1225,17 +1605,31 @@ static void __attribute__((nonnull))
         m->t = loop_now();
 
         bool pkt_valid = false;
+#ifndef NO_MIGRATION
+        const bool is_clnt = is_clnt_sock(ws);
+#else
         const bool is_clnt = w_connected(ws);
+#endif
         struct q_conn * c = 0;
         uint8_t tok[MAX_TOK_LEN];
         uint16_t tok_len = 0;
         uint8_t rit[RIT_LEN];
-        if (unlikely(!dec_pkt_hdr_beginning(
-                xv, v, m, is_clnt, tok, &tok_len, rit,
-                is_clnt ? (ws->data ? 0 : ped(ws->w)->conf.client_cid_len)
-                        : ped(ws->w)->conf.server_cid_len))) {
+        const uint8_t cid_len =
+            is_clnt ? (ws->data ? 0 : ped(ws->w)->conf.client_cid_len)
+                    : ped(ws->w)->conf.server_cid_len;
+
+#ifndef NO_RX_FAST
+        // most pkts are 1-RTT pkts of established conns, so try that first
+        const bool fast = likely(outer_dcid.len == 0) &&
+                          (c = rx_fast_conn(ws, xv, v, m, cid_len)) != 0;
+        if (likely(fast))
+            goto rx_remainder;
+#endif
+
+        if (unlikely(!dec_pkt_hdr_beginning(xv, v, m, is_clnt, tok, &tok_len,
+                                            rit, cid_len))) {
             // we might still need to send a vneg packet
-            if (w_connected(ws) == false) {
+            if (is_clnt == false) {
                 if (m->hdr.scid.len == 0 || m->hdr.scid.len >= 4) {
                     warn(ERR, "received invalid %u-byte %s pkt, sending vneg",
                          v->len, pkt_type_str(m->hdr.flags, &m->hdr.vers));
@@ -1299,6 +1693,13 @@ static void __attribute__((nonnull))
                     goto drop;
                 }
 
+#ifndef NO_SERVER
+                // decide on Retry before allocating any conn state
+                struct cid odcid = {.len = 0};
+                if (rtry_or_validate(ws, v, m, tok, tok_len, &odcid) == false)
+                    goto drop;
+#endif
+
                 warn(NTE, "new serv conn on port %u from %s%s%s:%u w/cid=%s",
                      bswap16(ws->ws_lport), v->wv_af == AF_INET6 ? "[" : "",
                      w_ntop(&v->wv_addr, ip_tmp),
@@ -1308,19 +1709,39 @@ static void __attribute__((nonnull))
                 c = new_conn(w_engine(ws), UINT16_MAX, &m->hdr.scid,
                              &m->hdr.dcid, &v->saddr, 0, ws->ws_lport,
                              &(struct q_conn_conf){.version = m->hdr.vers});
-                if (likely(c))
+                if (likely(c)) {
                     init_tls(c, 0, 0);
+#ifndef NO_SERVER
+                    // include the odcid of a Retry'ed handshake in the TPs
+                    cid_cpy(&c->odcid, &odcid);
+                    c->is_half_open = true;
+                    ped(c->w)->half_open++;
+#endif
+                }
             }
         }
 
         if (likely(c)) {
+#ifndef NO_MIGRATION
+            // shared client sockets are unconnected, so check the source
+            if (unlikely(is_clnt && c->holds_sock == false &&
+                         w_sockaddr_cmp(&c->peer, &v->saddr) == false)) {
+                log_pkt("RX", v, &v->saddr, tok, tok_len, rit);
+                warn(ERR, "%u-byte %s pkt for conn %s not from peer, ignoring",
+                     v->len, pkt_type_str(m->hdr.flags, &m->hdr.vers),
+                     cid_str(c->scid));
+                goto drop;
+            }
+#endif
+
             // FIXME: validate cid len of non-first Initial packets to >= 8
 
             if (m->hdr.scid.len && cid_cmp(&m->hdr.scid, c->dcid) != 0) {
                 if (m->hdr.vers && m->hdr.type == LH_RTRY) {
                     uint8_t computed_rit[RIT_LEN];
-                    make_rit(c, m->hdr.flags, &m->hdr.dcid, &m->hdr.scid, tok,
-                             tok_len, computed_rit);
+                    make_rit(c->w, c->vers, &c->odcid, m->hdr.flags,
+                             &m->hdr.dcid, &m->hdr.scid, tok, tok_len,
+                             computed_rit);
                     if (memcmp(rit, computed_rit, RIT_LEN) != 0) {
                         log_pkt("RX", v, &v->saddr, tok, tok_len, rit);
                         warn(ERR, "rit mismatch, computed %s",
@@ -1364,15 +1785,20 @@ static void __attribute__((nonnull))
         }
 
         if (likely(has_pkt_nr(m->hdr.flags, m->hdr.vers))) {
-            bool decoal;
             if (unlikely(m->hdr.type == LH_INIT && c->cstrms[ep_init] == 0)) {
                 // we already abandoned Initial pkt processing, ignore
                 log_pkt("RX", v, &v->saddr, tok, tok_len, rit);
                 warn(INF, "ignoring %u-byte %s pkt due to abandoned processing",
                      v->len, pkt_type_str(m->hdr.flags, &m->hdr.vers));
                 goto drop;
-            } else if (unlikely(dec_pkt_hdr_remainder(xv, v, m, c, x,
-                                                      &decoal) == false)) {
+            }
+
+#ifndef NO_RX_FAST
+        rx_remainder:;
+#endif
+            bool decoal;
+            if (unlikely(dec_pkt_hdr_remainder(xv, v, m, c, x, &decoal) ==
+                         false)) {
                 v->len = xv->len;
                 log_pkt("RX", v, &v->saddr, tok, tok_len, rit);
                 if (m->is_reset)
@@ -1387,6 +1813,12 @@ static void __attribute__((nonnull))
                 goto drop;
             }
 
+#ifndef NO_RX_FAST
+            if (likely(fast))
+                // rx_fast_conn() checked the scid and peer address
+                goto decoal_done;
+#endif
+
             if (m->hdr.dcid.len && cid_cmp(&m->hdr.dcid, c->scid) != 0) {
                 struct cid * const scid =
 #ifndef NO_MIGRATION
@@ -1441,7 +1873,7 @@ static void __attribute__((nonnull))
             if (w_sockaddr_cmp(&c->peer, &v->saddr) == false
 #ifndef NO_MIGRATION
                 && (c->tx_path_chlg == false ||
-                    w_sockaddr_cmp(&c->migr_peer, &v->saddr) == false)
+                    w_sockaddr_cmp(&c->migr->peer, &v->saddr) == false)
 #endif
             ) {
 #if !defined(NO_MIGRATION) || !defined(NDEBUG)
@@ -1470,9 +1902,10 @@ static void __attribute__((nonnull))
                      v->wv_af == AF_INET6 ? "]" : "", bswap16(v->saddr.port),
                      m->hdr.nr, max_recv_all);
 
-                rand_bytes(&c->path_chlg_out, sizeof(c->path_chlg_out));
-                c->migr_peer = v->saddr;
-                c->migr_sock = ws;
+                struct conn_migr * const cm = conn_migr(c);
+                rand_bytes(&cm->path_chlg_out, sizeof(cm->path_chlg_out));
+                cm->peer = v->saddr;
+                cm->sock = ws;
                 c->needs_tx = c->tx_path_chlg = true;
                 c->tx_limit = 1;
 #endif
@@ -1567,11 +2000,48 @@ static void __attribute__((nonnull)) restart_ack_alarm(struct q_conn * const c)
 }
 
 
+#if !defined(NO_SERVER) && !defined(NO_MIGRATION)
+/// When the buffer reserve is half used up, close the server connection that
+/// holds the most un-ACK'ed send data, instead of running out of buffers.
+///
+/// @param      w     Warpcore engine.
+///
+static void __attribute__((nonnull)) shed_load(struct w_engine * const w)
+{
+    if (likely(w_iov_sq_cnt(&w->iov) >=
+               ped(w)->conf.num_bufs / (2 * BUF_RSV_DIV)))
+        return;
+
+    struct q_conn * c;
+    struct q_conn * victim = 0;
+    kh_foreach_value(&conns_by_id, c, {
+        if (is_clnt(c) == false && c->state == conn_estb &&
+            (victim == 0 || c->out_unacked > victim->out_unacked))
+            victim = c;
+    });
+    if (victim == 0)
+        return;
+
+    warn(ERR, "buffer pool exhausted, shedding %s conn %s w/%" PRIu " bytes",
+         conn_type(victim), cid_str(victim->scid), victim->out_unacked);
+    err_close(victim, ERR_INTERNAL, 0, "buffer pool exhausted");
+}
+#endif
+
+
 void rx(struct w_sock * const ws)
 {
     struct w_iov_sq x = w_iov_sq_initializer(x);
     struct q_conn_sl crx = sl_head_initializer(crx);
-    w_rx(ws, &x);
+#if !defined(NO_SERVER) && !defined(NO_MIGRATION)
+    shed_load(ws->w);
+#endif
+#ifndef NO_NETSIM
+    if (unlikely(netsim_on))
+        netsim_rx(ws, &x);
+    else
+#endif
+        w_rx(ws, &x);
     rx_pkts(&x, &crx, ws);
 
     // for all connections that had RX events
@@ -1614,13 +2084,7 @@ void rx(struct w_sock * const ws)
             }
         }
 
-#ifndef NO_SERVER
-        if (unlikely(c->tx_rtry))
-            // if we sent a retry, forget the entire connection existed
-            free_conn(c);
-        else
-#endif
-            if (c->have_new_data && !c->in_c_ready) {
+        if (c->have_new_data && !c->in_c_ready) {
             sl_insert_head(&c_ready, c, node_rx_ext);
             c->in_c_ready = true;
             maybe_api_return(q_ready, 0, 0);
@@ -1716,6 +2180,13 @@ static void __attribute__((nonnull)) enter_closed(struct q_conn * const c)
         c->in_c_ready = true;
     }
 
+    // pending stream events are moot now
+    while (!sq_empty(&c->ev_strms)) {
+        sq_first(&c->ev_strms)->ev = 0;
+        sq_remove_head(&c->ev_strms, node_ev);
+    }
+    post_ev(c, 0, Q_EV_CONN_CLOSED);
+
     // terminate whatever API call is currently active
     maybe_api_return(c, 0);
     maybe_api_return(q_ready, 0, 0);
@@ -1792,6 +2263,13 @@ void update_conf(struct q_conn * const c, const struct q_conn_conf * const conf)
         true;
 #endif
     c->key_flips_enabled = get_conf_uncond(c->w, conf, enable_tls_key_updates);
+    c->max_strm_out = get_conf(c->w, conf, max_strm_out);
+    c->max_out = get_conf(c->w, conf, max_conn_out);
+    const uint32_t quota = ped(c->w)->conf.conn_buf_quota;
+    if (c->max_out == 0 && quota)
+        // enforce the per-connection buffer quota via the send buffer limit
+        c->max_out = quota * (uint_t)(default_max_pkt_len(q_conn_af(c)) -
+                                      AEAD_LEN - DATA_OFFSET);
 
     if (c->tp_peer.disable_active_migration == false || c->key_flips_enabled) {
         c->tls_key_update_frequency =
@@ -1854,11 +2332,22 @@ struct q_conn * new_conn(struct w_engine * const w,
     c->sockopt.enable_udp_zero_checksums =
         get_conf_uncond(c->w, conf, enable_udp_zero_checksums);
 
-    if (is_clnt(c) || peer == 0) {
+#ifndef NO_MIGRATION
+    if (is_clnt(c) && ped(w)->conf.clnt_socks) {
+        c->sock = get_clnt_sock(w, idx, &c->sockopt);
+        if (unlikely(c->sock == 0))
+            goto fail;
+    } else
+#endif
+        if (is_clnt(c) || peer == 0) {
         c->sock = w_bind(w, idx, port, &c->sockopt);
         if (unlikely(c->sock == 0))
             goto fail;
         c->holds_sock = true;
+#ifndef NO_NETSIM
+        if (unlikely(netsim_on))
+            netsim_bind(c->sock);
+#endif
 #ifndef NO_SERVER
         if (peer == 0)
             // remember server socket
@@ -1876,8 +2365,9 @@ struct q_conn * new_conn(struct w_engine * const w,
     c->next_sid_bidi = is_clnt(c) ? 0 : STRM_FL_SRV;
     c->next_sid_uni = is_clnt(c) ? STRM_FL_UNI : STRM_FL_UNI | STRM_FL_SRV;
     sq_init(&c->txq);
+    sq_init(&c->tx_bat);
+    sq_init(&c->ev_strms);
 #ifndef NO_MIGRATION
-    sq_init(&c->migr_txq);
     splay_init(&c->dcids_by_seq);
     splay_init(&c->scids_by_seq);
 #endif
@@ -1933,7 +2423,7 @@ struct q_conn * new_conn(struct w_engine * const w,
 #if !defined(NO_MIGRATION) && !defined(NO_SERVER)
     // TODO: avoid encoding RFC1918 addresses
     if (!is_clnt(c) && peer && w->have_ip4 && w->have_ip6) {
-        // populate tp_mine.pref_addr
+        // populate our preferred address
         const uint16_t other_af_idx =
             w->ifaddr[idx].addr.af == AF_INET ? 0 : w->addr4_pos;
         struct w_sock * const ws = get_local_sock_by_ipnp(
@@ -1947,19 +2437,19 @@ struct q_conn * new_conn(struct w_engine * const w,
                  w->ifaddr[other_af_idx].addr.af == AF_INET6 ? "]" : "",
                  bswap16(port));
 
-            memcpy(&c->tp_mine.pref_addr.addr4,
+            struct pref_addr * const pa = conn_pref_addr(c);
+            memcpy(&pa->addr4,
                    w->ifaddr[idx].addr.af == AF_INET ? &c->sock->ws_loc
                                                      : &ws->ws_loc,
-                   sizeof(c->tp_mine.pref_addr.addr4));
-            memcpy(&c->tp_mine.pref_addr.addr6,
+                   sizeof(pa->addr4));
+            memcpy(&pa->addr6,
                    w->ifaddr[idx].addr.af == AF_INET6 ? &c->sock->ws_loc
                                                       : &ws->ws_loc,
-                   sizeof(c->tp_mine.pref_addr.addr6));
+                   sizeof(pa->addr6));
 
-            c->max_cid_seq_out = c->tp_mine.pref_addr.cid.seq = 1;
-            mk_rand_cid(&c->tp_mine.pref_addr.cid,
-                        ped(c->w)->conf.server_cid_len, true);
-            add_scid(c, &c->tp_mine.pref_addr.cid);
+            c->max_cid_seq_out = pa->cid.seq = 1;
+            mk_rand_cid(&pa->cid, ped(c->w)->conf.server_cid_len, true);
+            add_scid(c, &pa->cid);
         }
     }
 #endif
@@ -2030,6 +2520,9 @@ void free_conn(struct q_conn * const c)
     maybe_api_return(c, 0);
 
     stop_all_alarms(c);
+#ifndef NO_SERVER
+    end_half_open(c);
+#endif
 
     struct q_stream * s;
     kh_foreach_value(&c->strms_by_id, s, { free_stream(s); });
@@ -2056,30 +2549,63 @@ void free_conn(struct q_conn * const c)
     kh_release(cids_by_id, &c->scids_by_id);
 #endif
 
-    if (c->holds_sock)
+    if (c->holds_sock) {
         // only close the socket for the final server connection
+#ifndef NO_NETSIM
+        if (unlikely(netsim_on))
+            netsim_close(c->sock);
+#endif
         w_close(c->sock);
+    }
 
     if (c->in_c_ready)
         sl_remove(&c_ready, c, q_conn, node_rx_ext);
 
+    if (c->in_c_ev)
+        sq_remove(&c_ev, c, q_conn, node_ev);
+
 #ifndef NO_SERVER
     if (c->needs_accept)
         sl_remove(&accept_queue, c, q_conn, node_aq);
 #endif
 
     qlog_close(c);
+#ifndef NO_MIGRATION
+    free(c->migr);
+#endif
+    free(c->pref_addr);
+    free(c->tok);
     free(c);
 }
 
 
+void post_ev(struct q_conn * const c,
+             struct q_stream * const s,
+             const uint8_t ev)
+{
+    if (s) {
+        if (s->ev == 0)
+            sq_insert_tail(&c->ev_strms, s, node_ev);
+        s->ev |= ev;
+    } else
+        c->ev |= ev;
+
+    if (c->in_c_ev == false) {
+        sq_insert_tail(&c_ev, c, node_ev);
+        c->in_c_ev = true;
+    }
+    maybe_api_return(q_poll, 0, 0);
+}
+
+
 #ifndef NO_QINFO
 void conn_info_populate(struct q_conn * const c)
 {
     // fill some q_conn_info fields based on other conn fields
-    c->i.cwnd = c->rec.cur.cwnd;
-    c->i.ssthresh = c->rec.cur.ssthresh;
-    c->i.rtt = c->rec.cur.srtt / (float)US_PER_S;
-    c->i.rttvar = c->rec.cur.rttvar / (float)US_PER_S;
+    struct q_conn_info * const ci = &c->i;
+    ci->cwnd = c->rec.cur.cwnd;
+    ci->ssthresh = c->rec.cur.ssthresh;
+    ci->rtt = c->rec.cur.srtt / (float)US_PER_S;
+    ci->rttvar = c->rec.cur.rttvar / (float)US_PER_S;
 }
 #endif
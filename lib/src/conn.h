@@ -29,6 +29,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef NO_MIGRATION
@@ -122,14 +123,13 @@ struct transport_params {
     uint_t max_pkt;
     uint_t act_cid_lim;
     uint_t ack_del_exp;
-    struct pref_addr pref_addr;
-    struct cid orig_cid;
     bool disable_active_migration;
     uint8_t _unused[7];
 };
 
 
 sl_head(q_conn_sl, q_conn);
+sq_head(q_conn_sq, q_conn);
 
 
 #define CONN_STATE(k, v) k = v
@@ -151,10 +151,21 @@ extern const char * const conn_state_str[];
 #define DEF_ACK_DEL_EXP 3
 #define DEF_MAX_ACK_DEL 25 // ms
 
+#define TX_BURST_MAX 32 // ciphertext buffers reserved per tx_stream() burst
+
 #ifndef NO_MIGRATION
 splay_head(cids_by_seq, cid);
 
 KHASH_INIT(cids_by_id, struct cid *, struct cid *, 1, hash_cid, kh_cid_cmp)
+
+
+/// Path probing state. Only allocated once a peer changes its address.
+struct conn_migr {
+    struct w_sockaddr peer; ///< Peer's desired migration address.
+    struct w_sock * sock;   ///< Socket the peer's probe arrived on.
+    struct w_iov_sq txq;    ///< Packets to transmit on the probed path.
+    uint8_t path_chlg_out[PATH_CHLG_LEN]; ///< Our PATH_CHALLENGE data.
+};
 #endif
 
 /// A QUIC connection.
@@ -162,17 +173,10 @@ struct q_conn {
     sl_entry(q_conn) node_rx_int;   ///< For maintaining the internal RX queue.
     sl_entry(q_conn) node_rx_ext;   ///< For maintaining the external RX queue.
     sl_entry(q_conn) node_zcid_int; ///< Zero-CID client connections.
+    sq_entry(q_conn) node_ev;       ///< For maintaining the event queue.
 #ifndef NO_SERVER
     sl_entry(q_conn) node_aq;   ///< For maintaining the accept queue.
     sl_entry(q_conn) node_embr; ///< For bound but unconnected connections.
-#endif
-#ifndef NO_MIGRATION
-    struct cids_by_seq dcids_by_seq; ///< Destination CID hash by sequence.
-    struct cids_by_seq scids_by_seq; ///< Source CID hash by sequence.
-    khash_t(cids_by_id) scids_by_id; ///< Source CID hash by ID.
-    struct w_sockaddr migr_peer;     ///< Peer's desired migration address.
-    struct w_sock * migr_sock;
-    struct w_iov_sq migr_txq;
 #endif
     struct cid * dcid; ///< Active destination CID.
     struct cid * scid; ///< Active source CID.
@@ -208,10 +212,8 @@ struct q_conn {
     uint32_t have_new_data : 1; ///< New stream data was enqueued.
     uint32_t in_c_ready : 1;    ///< Connection is listed in c_ready.
 #ifndef NO_SERVER
-    uint32_t tx_rtry : 1;      ///< We need to send a RETRY.
     uint32_t needs_accept : 1; ///< Need to call q_accept() for connection.
 #else
-    uint32_t _unused_tx_rtry : 1;
     uint32_t _unused_needs_accept : 1;
 #endif
     uint32_t key_flips_enabled : 1; ///< Are TLS key updates enabled?
@@ -223,7 +225,13 @@ struct q_conn {
     uint32_t tx_hshk_done : 1;      ///< Send HANDSHAKE_DONE.
     uint32_t in_c_zcid : 1;
     uint32_t tx_new_tok : 1; ///< Send NEW_TOKEN.
-    uint32_t : 2;
+#ifndef NO_SERVER
+    uint32_t is_half_open : 1; ///< Counted in per_engine_data::half_open.
+#else
+    uint32_t _unused_is_half_open : 1;
+#endif
+    uint32_t in_c_ev : 1; ///< Connection is listed in c_ev.
+    uint32_t : 1;
 
     conn_state_t state; ///< State of the connection.
 
@@ -247,12 +255,12 @@ struct q_conn {
     khash_t(strms_by_id) strms_by_id;      ///< Regular streams.
     struct diet clsd_strms;
     sl_head(q_stream_head, q_stream) need_ctrl;
+    sq_head(q_stream_ev, q_stream) ev_strms; ///< Streams with pending events.
 
     struct w_sock * sock; ///< File descriptor (socket) for the connection.
 
     timeout_t tls_key_update_frequency;
 
-    struct transport_params tp_mine; ///< Local transport parameters.
     struct transport_params tp_peer; ///< Remote transport parameters.
 
     struct recovery rec; ///< Loss recovery state.
@@ -270,16 +278,19 @@ struct q_conn {
     uint_t path_val_win; ///< Window for path validation.
     uint_t in_data;      ///< Current inbound connection data.
     uint_t out_data;     ///< Current outbound connection data.
+    uint_t out_unacked;  ///< Un-ACK'ed outbound stream data (all streams).
+    uint_t max_out;      ///< Limit for out_unacked, zero if unlimited.
+    uint_t max_strm_out; ///< Limit for q_stream::out_unacked, or zero.
 
     epoch_t min_rx_epoch;
 
     uint8_t path_chlg_in[PATH_CHLG_LEN];
     uint8_t path_resp_out[PATH_CHLG_LEN];
 
-#ifndef NO_MIGRATION
-    uint8_t path_chlg_out[PATH_CHLG_LEN];
-    uint8_t path_resp_in[PATH_CHLG_LEN];
-#endif
+    uint8_t sh_hdr[1 + CID_LEN_MAX]; ///< Cached 1-RTT header: flags and DCID.
+    uint8_t sh_hdr_len; ///< Length of sh_hdr, zero when it must be rebuilt.
+    uint8_t tx_tail;    ///< LH type of the last pkt in the txq, else zero.
+    uint8_t tx_coal;    ///< Number of pkts coalesced into txq datagrams.
 
     struct w_sockopt sockopt; ///< Socket options.
     uint_t max_cid_seq_out;
@@ -287,10 +298,7 @@ struct q_conn {
     struct cid odcid; ///< Original destination CID of first Initial.
 
     struct w_iov_sq txq;
-
-#ifndef NO_QINFO
-    struct q_conn_info i;
-#endif
+    struct w_iov_sq tx_bat; ///< Ciphertext buffers reserved for a TX burst.
 
     uint_t err_code;
     uint8_t err_frm;
@@ -302,15 +310,44 @@ struct q_conn {
 #endif
 
     uint16_t tok_len;
-    uint8_t tok[MAX_TOK_LEN]; // some stacks send ungodly large tokens
-
     uint16_t pmtud_pkt;
+    uint8_t ev;           ///< Pending Q_EV_* connection events.
+    uint8_t out_full : 1; ///< Send buffer limit max_out was hit.
+    uint8_t tx_burst : 1; ///< Encoding a non-first pkt of a TX burst.
+    uint8_t : 6;
     uint32_t tx_limit;
+#if HAVE_64BIT
+    uint8_t _unused2[4];
+#endif
 
 #ifndef NO_QLOG
     FILE * qlog;
     uint64_t qlog_last_t;
-    char qlog_file[MAXPATHLEN];
+#endif
+
+    // members below are rarely read while processing packets; keeping them
+    // out of the way packs the per-packet state above into fewer cache lines
+
+#ifndef NO_MIGRATION
+    struct cids_by_seq dcids_by_seq; ///< Destination CID hash by sequence.
+    struct cids_by_seq scids_by_seq; ///< Source CID hash by sequence.
+    khash_t(cids_by_id) scids_by_id; ///< Source CID hash by ID.
+#endif
+    struct transport_params tp_mine; ///< Local transport parameters.
+#ifndef NO_QINFO
+    struct q_conn_info i; ///< Statistics, only written per packet.
+#endif
+
+    // cold state below is allocated on first use, since most connections
+    // never need it; keep the members above this line small
+
+    uint8_t * tok; ///< Token buffer of MAX_TOK_LEN bytes, see conn_tok().
+    struct pref_addr * pref_addr; ///< Preferred address, see conn_pref_addr().
+#ifndef NO_MIGRATION
+    struct conn_migr * migr; ///< Path probing state, see conn_migr().
+#endif
+#ifndef NO_QLOG
+    char * qlog_file; ///< Path of the qlog file, if qlog is enabled.
 #endif
 };
 
@@ -324,6 +361,7 @@ extern struct q_conn_sl c_embr;
 
 
 extern struct q_conn_sl c_ready;
+extern struct q_conn_sq c_ev;
 extern struct q_conn_sl c_zcid;
 
 #if !defined(NDEBUG) && defined(DEBUG_EXTRA) && !defined(FUZZING)
@@ -376,6 +414,9 @@ extern struct q_conn * new_conn(struct w_engine * const w,
 
 extern void __attribute__((nonnull)) free_conn(struct q_conn * const c);
 
+extern void __attribute__((nonnull(1)))
+post_ev(struct q_conn * const c, struct q_stream * const s, const uint8_t ev);
+
 extern void __attribute__((nonnull))
 add_scid(struct q_conn * const c, struct cid * const id);
 
@@ -435,6 +476,46 @@ pn_for_epoch(struct q_conn * const c, const epoch_t e)
 }
 
 
+static inline uint8_t * __attribute__((nonnull, no_instrument_function))
+conn_tok(struct q_conn * const c)
+{
+    // some stacks send ungodly large tokens
+    if (unlikely(c->tok == 0)) {
+        c->tok = malloc(MAX_TOK_LEN);
+        ensure(c->tok, "could not malloc");
+    }
+    return c->tok;
+}
+
+
+static inline struct pref_addr * __attribute__((nonnull,
+                                               no_instrument_function))
+conn_pref_addr(struct q_conn * const c)
+{
+    // a server advertises its own, a client stores the one of its peer
+    if (unlikely(c->pref_addr == 0)) {
+        c->pref_addr = calloc(1, sizeof(*c->pref_addr));
+        ensure(c->pref_addr, "could not calloc");
+    }
+    return c->pref_addr;
+}
+
+
+#ifndef NO_MIGRATION
+static inline struct conn_migr * __attribute__((nonnull,
+                                               no_instrument_function))
+conn_migr(struct q_conn * const c)
+{
+    if (unlikely(c->migr == 0)) {
+        c->migr = calloc(1, sizeof(*c->migr));
+        ensure(c->migr, "could not calloc");
+        sq_init(&c->migr->txq);
+    }
+    return c->migr;
+}
+#endif
+
+
 static inline int __attribute__((nonnull, no_instrument_function))
 cids_by_seq_cmp(const struct cid * const a, const struct cid * const b)
 {
@@ -112,6 +112,29 @@ static void track_frame(struct pkt_meta * const m,
         *(val) = (uint_t)_v;                                                   \
     } while (0)
 
+#define decv2_chk(val1, val2, pos, end, c, type)                               \
+    do {                                                                       \
+        uint64_t _v1;                                                          \
+        uint64_t _v2;                                                          \
+        if (unlikely(decv2(&_v1, &_v2, (pos), (end)) == false))                \
+            err_close_return((c), ERR_FRAME_ENC, (type),                       \
+                             "decv2 %s/%s in %s:%u", #val1, #val2, __FILE__,   \
+                             __LINE__);                                        \
+        *(val1) = (uint_t)_v1;                                                 \
+        *(val2) = (uint_t)_v2;                                                 \
+    } while (0)
+
+// like decv2_chk(), but does not truncate val2, which is a uint64_t
+#define decv2_chk64(val1, val2, pos, end, c, type)                             \
+    do {                                                                       \
+        uint64_t _v1;                                                          \
+        if (unlikely(decv2(&_v1, (val2), (pos), (end)) == false))              \
+            err_close_return((c), ERR_FRAME_ENC, (type),                       \
+                             "decv2 %s/%s in %s:%u", #val1, #val2, __FILE__,   \
+                             __LINE__);                                        \
+        *(val1) = (uint_t)_v1;                                                 \
+    } while (0)
+
 #define decb_chk(val, pos, end, len, c, type)                                  \
     do {                                                                       \
         if (unlikely(decb((val), (pos), (end), (len)) == false))               \
@@ -241,8 +264,6 @@ dec_stream_or_crypto_frame(const uint8_t type,
                            struct w_iov * const v)
 {
     struct pn_space * const pn = m->pn;
-    if (unlikely(pn == 0))
-        return false;
     struct q_conn * const c = pn->c;
     m->strm_frm_pos = (uint16_t)(*pos - v->buf) - 1;
 
@@ -402,6 +423,7 @@ dec_stream_or_crypto_frame(const uint8_t type,
             do_stream_fc(m->strm, 0);
             do_conn_fc(c, 0);
             c->have_new_data = true;
+            post_ev(c, m->strm, Q_EV_READABLE);
             maybe_api_return(q_read, c, 0);
             maybe_api_return(q_read_stream, c, m->strm);
         }
@@ -509,15 +531,11 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
         m->ack_frm_pos = (uint16_t)(*pos - start);
 
     struct pn_space * const pn = m->pn;
-    if (unlikely(pn == 0))
-        return false;
     struct q_conn * const c = pn->c;
 
     uint_t lg_ack_in_frm = 0;
-    decv_chk(&lg_ack_in_frm, pos, end, c, type);
-
     uint64_t ack_delay_raw = 0;
-    decv_chk(&ack_delay_raw, pos, end, c, type);
+    decv2_chk64(&lg_ack_in_frm, &ack_delay_raw, pos, end, c, type);
 
     // TODO: figure out a better way to handle huge ACK delays
     if (sizeof(uint64_t) != sizeof(uint_t) &&
@@ -549,10 +567,10 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
     uint_t lg_ack = lg_ack_in_frm;
     uint64_t lg_ack_in_frm_t = 0;
     bool got_new_ack = false;
+    uint_t gap = 0;
+    uint_t ack_rng = 0;
+    decv_chk(&ack_rng, pos, end, c, type);
     for (uint_t n = ack_rng_cnt + 1; n > 0; n--) {
-        uint_t gap = 0;
-        uint_t ack_rng = 0;
-        decv_chk(&ack_rng, pos, end, c, type);
 
         if (unlikely(ack_rng > (UINT16_MAX << 4)))
             err_close_return(c, ERR_INTERNAL, type, "ACK rng len %" PRIu,
@@ -646,14 +664,16 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
 
     next_rng:
         if (n > 1) {
-            decv_chk(&gap, pos, end, c, type);
-            if (unlikely((lg_ack - ack_rng) < gap + 2)) {
+            // decode the gap together with the length of the next range
+            const uint_t prev_rng = ack_rng;
+            decv2_chk(&gap, &ack_rng, pos, end, c, type);
+            if (unlikely((lg_ack - prev_rng) < gap + 2)) {
                 warn(DBG, "lg_ack=%" PRIu ", ack_rng=%" PRIu ", gap=%" PRIu,
-                     lg_ack, ack_rng, -gap);
+                     lg_ack, prev_rng, -gap);
                 err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
                                  "illegal ACK frame");
             }
-            lg_ack -= ack_rng + gap + 2;
+            lg_ack -= prev_rng + gap + 2;
         }
     }
 
@@ -693,10 +713,7 @@ dec_close_frame(const uint8_t type,
                 const uint8_t * const end,
                 const struct pkt_meta * const m)
 {
-    struct pn_space * const pn = m->pn;
-    if (unlikely(pn == 0))
-        return false;
-    struct q_conn * const c = pn->c;
+    struct q_conn * const c = m->pn->c;
 
     uint_t err_code;
     decv_chk(&err_code, pos, end, c, type);
@@ -745,21 +762,22 @@ dec_close_frame(const uint8_t type,
 
 
 static bool __attribute__((nonnull))
-dec_max_strm_data_frame(const uint8_t ** pos,
+dec_max_strm_data_frame(const uint8_t type,
+                        const uint8_t ** pos,
                         const uint8_t * const end,
                         const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     dint_t sid = 0;
-    decv_chk((uint_t *)&sid, pos, end, c, FRM_MSD);
+    decv_chk((uint_t *)&sid, pos, end, c, type);
 
     uint_t max = 0;
-    decv_chk(&max, pos, end, c, FRM_MSD);
+    decv_chk(&max, pos, end, c, type);
 
     warn(INF, FRAM_IN "MAX_STREAM_DATA" NRM " id=" FMT_SID " max=%" PRIu, sid,
          max);
 
-    struct q_stream * const s = get_and_validate_strm(c, sid, FRM_MSD, true);
+    struct q_stream * const s = get_and_validate_strm(c, sid, type, true);
     if (unlikely(s == 0))
         return true;
 
@@ -768,6 +786,7 @@ dec_max_strm_data_frame(const uint8_t ** pos,
         if (s->blocked) {
             s->blocked = false;
             c->needs_tx = true;
+            post_ev(c, s, Q_EV_WRITABLE);
         }
         need_ctrl_update(s);
     } else if (max < s->out_data_max)
@@ -807,18 +826,21 @@ dec_max_strms_frame(const uint8_t type,
 
 
 static bool __attribute__((nonnull))
-dec_max_data_frame(const uint8_t ** pos,
+dec_max_data_frame(const uint8_t type,
+                   const uint8_t ** pos,
                    const uint8_t * const end,
                    const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     uint_t max = 0;
-    decv_chk(&max, pos, end, c, FRM_MCD);
+    decv_chk(&max, pos, end, c, type);
 
     warn(INF, FRAM_IN "MAX_DATA" NRM " max=%" PRIu, max);
 
     if (max > c->tp_peer.max_data) {
         c->tp_peer.max_data = max;
+        if (c->blocked)
+            post_ev(c, 0, Q_EV_WRITABLE);
         c->blocked = false;
     } else if (max < c->tp_peer.max_data)
         warn(NTE, "MAX_DATA %" PRIu " < current value %" PRIu, max,
@@ -829,21 +851,22 @@ dec_max_data_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_strm_data_blocked_frame(const uint8_t ** pos,
+dec_strm_data_blocked_frame(const uint8_t type,
+                            const uint8_t ** pos,
                             const uint8_t * const end,
                             const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     dint_t sid = 0;
-    decv_chk((uint_t *)&sid, pos, end, c, FRM_SDB);
+    decv_chk((uint_t *)&sid, pos, end, c, type);
 
     uint_t off = 0;
-    decv_chk(&off, pos, end, c, FRM_SDB);
+    decv_chk(&off, pos, end, c, type);
 
     warn(INF, FRAM_IN "STREAM_DATA_BLOCKED" NRM " id=" FMT_SID " lim=%" PRIu,
          sid, off);
 
-    struct q_stream * const s = get_and_validate_strm(c, sid, FRM_SDB, false);
+    struct q_stream * const s = get_and_validate_strm(c, sid, type, false);
     if (unlikely(s == 0))
         return true;
 
@@ -857,13 +880,14 @@ dec_strm_data_blocked_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_data_blocked_frame(const uint8_t ** pos,
+dec_data_blocked_frame(const uint8_t type,
+                       const uint8_t ** pos,
                        const uint8_t * const end,
                        const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     uint_t off = 0;
-    decv_chk(&off, pos, end, c, FRM_CDB);
+    decv_chk(&off, pos, end, c, type);
 
     warn(INF, FRAM_IN "DATA_BLOCKED" NRM " lim=%" PRIu, off);
 
@@ -884,7 +908,7 @@ dec_streams_blocked_frame(const uint8_t type,
     struct q_conn * const c = m->pn->c;
 
     uint_t max = 0;
-    decv_chk(&max, pos, end, c, FRM_SBB);
+    decv_chk(&max, pos, end, c, type);
 
     warn(INF, FRAM_IN "STREAMS_BLOCKED" NRM " 0x%02x=%s max=%" PRIu, type,
          type == FRM_SBB ? "bi" : "uni", max);
@@ -896,21 +920,22 @@ dec_streams_blocked_frame(const uint8_t type,
 
 
 static bool __attribute__((nonnull))
-dec_stop_sending_frame(const uint8_t ** pos,
+dec_stop_sending_frame(const uint8_t type,
+                       const uint8_t ** pos,
                        const uint8_t * const end,
                        const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     dint_t sid = 0;
-    decv_chk((uint_t *)&sid, pos, end, c, FRM_STP);
+    decv_chk((uint_t *)&sid, pos, end, c, type);
 
     uint_t err_code;
-    decv_chk(&err_code, pos, end, c, FRM_STP);
+    decv_chk(&err_code, pos, end, c, type);
 
     warn(INF, FRAM_IN "STOP_SENDING" NRM " id=" FMT_SID " err=%s0x%" PRIx NRM,
          sid, err_code ? RED : NRM, err_code);
 
-    struct q_stream * const s = get_and_validate_strm(c, sid, FRM_STP, true);
+    struct q_stream * const s = get_and_validate_strm(c, sid, type, true);
     if (unlikely(s == 0))
         return true;
 
@@ -919,12 +944,13 @@ dec_stop_sending_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_path_challenge_frame(const uint8_t ** pos,
+dec_path_challenge_frame(const uint8_t type,
+                         const uint8_t ** pos,
                          const uint8_t * const end,
                          const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
-    decb_chk(c->path_chlg_in, pos, end, PATH_CHLG_LEN, c, FRM_PCL);
+    decb_chk(c->path_chlg_in, pos, end, PATH_CHLG_LEN, c, type);
 
     warn(INF, FRAM_IN "PATH_CHALLENGE" NRM " data=%s",
          pcr_str(c->path_chlg_in));
@@ -937,45 +963,46 @@ dec_path_challenge_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_path_response_frame(const uint8_t ** pos,
+dec_path_response_frame(const uint8_t type,
+                        const uint8_t ** pos,
                         const uint8_t * const end,
                         const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
 
 #ifndef NO_MIGRATION
-    decb_chk(c->path_resp_in, pos, end, PATH_CHLG_LEN, c, FRM_PRP);
+    uint8_t pri[PATH_CHLG_LEN];
+    decb_chk(pri, pos, end, PATH_CHLG_LEN, c, type);
 
-    warn(INF, FRAM_IN "PATH_RESPONSE" NRM " data=%s", pcr_str(c->path_resp_in));
+    warn(INF, FRAM_IN "PATH_RESPONSE" NRM " data=%s", pcr_str(pri));
 
     if (unlikely(c->tx_path_chlg == false)) {
-        warn(NTE, "unexpected PATH_RESPONSE %s, ignoring",
-             pcr_str(c->path_resp_in));
+        warn(NTE, "unexpected PATH_RESPONSE %s, ignoring", pcr_str(pri));
         return true;
     }
 
-    if (unlikely(memcmp(c->path_resp_in, c->path_chlg_out, PATH_CHLG_LEN))) {
-        warn(NTE, "PATH_RESPONSE %s != %s, ignoring", pcr_str(c->path_resp_in),
-             pcr_str(c->path_chlg_out));
+    const struct conn_migr * const cm = c->migr;
+    if (unlikely(memcmp(pri, cm->path_chlg_out, PATH_CHLG_LEN))) {
+        warn(NTE, "PATH_RESPONSE %s != %s, ignoring", pcr_str(pri),
+             pcr_str(cm->path_chlg_out));
         return true;
     }
 
     warn(NTE, "migration from %s%s%s:%u to %s%s%s:%u complete",
          c->peer.addr.af == AF_INET6 ? "[" : "", w_ntop(&c->peer.addr, ip_tmp),
          c->peer.addr.af == AF_INET6 ? "]" : "", bswap16(c->peer.port),
-         c->migr_peer.addr.af == AF_INET6 ? "[" : "",
-         w_ntop(&c->migr_peer.addr, ip_tmp),
-         c->migr_peer.addr.af == AF_INET6 ? "]" : "",
-         bswap16(c->migr_peer.port));
+         cm->peer.addr.af == AF_INET6 ? "[" : "",
+         w_ntop(&cm->peer.addr, ip_tmp),
+         cm->peer.addr.af == AF_INET6 ? "]" : "", bswap16(cm->peer.port));
 
-    c->peer = c->migr_peer;
-    c->sock = c->migr_sock;
+    c->peer = cm->peer;
+    c->sock = cm->sock;
     c->tx_path_chlg = false;
     c->tx_limit = 0;
 
 #else
     uint8_t pri[PATH_CHLG_LEN];
-    decb_chk(pri, pos, end, PATH_CHLG_LEN, c, FRM_PRP);
+    decb_chk(pri, pos, end, PATH_CHLG_LEN, c, type);
     warn(INF, FRAM_IN "PATH_RESPONSE" NRM " data=%s", pcr_str(pri));
     warn(NTE, "unexpected PATH_RESPONSE %s, ignoring", pcr_str(pri));
 #endif
@@ -985,7 +1012,8 @@ dec_path_response_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_new_cid_frame(const uint8_t ** pos,
+dec_new_cid_frame(const uint8_t type,
+                  const uint8_t ** pos,
                   const uint8_t * const end,
                   const struct pkt_meta * const m)
 {
@@ -997,9 +1025,9 @@ dec_new_cid_frame(const uint8_t ** pos,
 #endif
     };
 
-    decv_chk(&dcid.seq, pos, end, c, FRM_CID);
-    decv_chk(&dcid.rpt, pos, end, c, FRM_CID);
-    dec1_chk(&dcid.len, pos, end, c, FRM_CID);
+    decv_chk(&dcid.seq, pos, end, c, type);
+    decv_chk(&dcid.rpt, pos, end, c, type);
+    dec1_chk(&dcid.len, pos, end, c, type);
 
 #ifndef NO_SRT_MATCHING
     uint8_t * const srt = dcid.srt;
@@ -1008,8 +1036,8 @@ dec_new_cid_frame(const uint8_t ** pos,
 #endif
 
     if (likely(dcid.len <= CID_LEN_MAX)) {
-        decb_chk(dcid.id, pos, end, dcid.len, c, FRM_CID);
-        decb_chk(srt, pos, end, SRT_LEN, c, FRM_CID);
+        decb_chk(dcid.id, pos, end, dcid.len, c, type);
+        decb_chk(srt, pos, end, SRT_LEN, c, type);
     }
 
 #if !defined(NO_MIGRATION) || !defined(NDEBUG)
@@ -1029,19 +1057,19 @@ dec_new_cid_frame(const uint8_t ** pos,
 
 #ifndef NO_MIGRATION
     const uint_t max_act_cids =
-        c->tp_mine.act_cid_lim + (c->tp_peer.pref_addr.cid.len ? 1 : 0);
+        c->tp_mine.act_cid_lim + (is_clnt(c) && c->pref_addr ? 1 : 0);
     if (likely(dup == false) &&
         unlikely(splay_count(&c->dcids_by_seq) > max_act_cids))
-        err_close_return(c, ERR_CONNECTION_ID_LIMIT, FRM_CID,
+        err_close_return(c, ERR_CONNECTION_ID_LIMIT, type,
                          "illegal seq %" PRIu " (have %" PRIu "/%" PRIu ")",
                          dcid.seq, splay_count(&c->dcids_by_seq), max_act_cids);
 
     if (unlikely(dcid.rpt > dcid.seq))
-        err_close_return(c, ERR_PROTOCOL_VIOLATION, FRM_CID, "illegal rpt %u",
+        err_close_return(c, ERR_PROTOCOL_VIOLATION, type, "illegal rpt %u",
                          dcid.rpt);
 
     if (unlikely(dcid.len > CID_LEN_MAX))
-        err_close_return(c, ERR_PROTOCOL_VIOLATION, FRM_CID, "illegal len %u",
+        err_close_return(c, ERR_PROTOCOL_VIOLATION, type, "illegal len %u",
                          dcid.len);
 
     if (dup == false)
@@ -1049,7 +1077,7 @@ dec_new_cid_frame(const uint8_t ** pos,
 
         // FIXME: retire cids
 #else
-    err_close_return(c, ERR_PROTOCOL_VIOLATION, FRM_CID,
+    err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
                      "migration disabled but got NEW_CONNECTION_ID");
 #endif
 
@@ -1058,26 +1086,27 @@ dec_new_cid_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_reset_stream_frame(const uint8_t ** pos,
+dec_reset_stream_frame(const uint8_t type,
+                       const uint8_t ** pos,
                        const uint8_t * const end,
                        const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     dint_t sid = 0;
-    decv_chk((uint_t *)&sid, pos, end, c, FRM_RST);
+    decv_chk((uint_t *)&sid, pos, end, c, type);
 
     uint_t err_code;
-    decv_chk(&err_code, pos, end, c, FRM_RST);
+    decv_chk(&err_code, pos, end, c, type);
 
     uint_t off = 0;
-    decv_chk(&off, pos, end, c, FRM_RST);
+    decv_chk(&off, pos, end, c, type);
 
     warn(INF,
          FRAM_IN "RESET_STREAM" NRM " id=" FMT_SID " err=%s0x%" PRIx NRM
                  " off=%" PRIu,
          sid, err_code ? RED : NRM, err_code, off);
 
-    struct q_stream * const s = get_and_validate_strm(c, sid, FRM_RST, false);
+    struct q_stream * const s = get_and_validate_strm(c, sid, type, false);
     if (unlikely(s == 0))
         return true;
 
@@ -1088,13 +1117,14 @@ dec_reset_stream_frame(const uint8_t ** pos,
 
 
 static bool __attribute__((nonnull))
-dec_retire_cid_frame(const uint8_t ** pos,
+dec_retire_cid_frame(const uint8_t type,
+                     const uint8_t ** pos,
                      const uint8_t * const end,
                      const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     struct cid which = {.seq = 0};
-    decv_chk(&which.seq, pos, end, c, FRM_RTR);
+    decv_chk(&which.seq, pos, end, c, type);
 
     warn(INF, FRAM_IN "RETIRE_CONNECTION_ID" NRM " seq=%" PRIu, which.seq);
 
@@ -1109,7 +1139,7 @@ dec_retire_cid_frame(const uint8_t ** pos,
         struct cid * const next_scid =
             splay_next(cids_by_seq, &c->scids_by_seq, scid);
         if (unlikely(next_scid == 0))
-            err_close_return(c, ERR_INTERNAL, FRM_RTR, "no next scid");
+            err_close_return(c, ERR_INTERNAL, type, "no next scid");
         c->scid = next_scid;
     }
 
@@ -1124,24 +1154,25 @@ done:
 
 
 static bool __attribute__((nonnull))
-dec_new_token_frame(const uint8_t ** pos,
+dec_new_token_frame(const uint8_t type,
+                    const uint8_t ** pos,
                     const uint8_t * const end,
                     const struct pkt_meta * const m)
 {
     struct q_conn * const c = m->pn->c;
     uint_t tok_len = 0;
-    decv_chk(&tok_len, pos, end, c, FRM_TOK);
+    decv_chk(&tok_len, pos, end, c, type);
 
     const uint_t act_tok_len = MIN(tok_len, (uint_t)(end - *pos));
 
     uint8_t tok[MAX_TOK_LEN];
-    decb_chk(tok, pos, end, (uint16_t)act_tok_len, c, FRM_TOK);
+    decb_chk(tok, pos, end, (uint16_t)act_tok_len, c, type);
 
     warn(INF, FRAM_IN "NEW_TOKEN" NRM " len=%" PRIu " tok=%s", tok_len,
          tok_str(tok, tok_len));
 
     if (unlikely(tok_len != act_tok_len))
-        err_close_return(c, ERR_FRAME_ENC, FRM_TOK, "illegal tok len");
+        err_close_return(c, ERR_FRAME_ENC, type, "illegal tok len");
 
     // TODO: actually do something with the token
 
@@ -1149,6 +1180,33 @@ dec_new_token_frame(const uint8_t ** pos,
 }
 
 
+static bool __attribute__((nonnull))
+dec_ping_frame(const uint8_t type __attribute__((unused)),
+               const uint8_t ** pos __attribute__((unused)),
+               const uint8_t * const end __attribute__((unused)),
+               const struct pkt_meta * const m __attribute__((unused)))
+{
+    warn(INF, FRAM_IN "PING" NRM);
+    return true;
+}
+
+
+static bool __attribute__((nonnull))
+dec_hshk_done_frame(const uint8_t type __attribute__((unused)),
+                    const uint8_t ** pos __attribute__((unused)),
+                    const uint8_t * const end __attribute__((unused)),
+                    const struct pkt_meta * const m)
+{
+    struct q_conn * const c = m->pn->c;
+    warn(INF, FRAM_IN "HANDSHAKE_DONE" NRM);
+    if (unlikely(is_clnt(c) == false))
+        return false;
+    if (unlikely(c->pns[pn_hshk].abandoned == false))
+        abandon_pn(&c->pns[pn_hshk]);
+    return true;
+}
+
+
 #ifndef NDEBUG
 static void log_pad(const uint16_t len)
 {
@@ -1161,6 +1219,76 @@ static void log_pad(const uint16_t len)
 #endif
 
 
+/// Return the end of the run of PADDING frames starting at @p pos, checking a
+/// word at a time.
+///
+/// @param[in]  pos   Position of the first PADDING frame after the first.
+/// @param[in]  end   End of the packet.
+///
+/// @return     Position of the first non-PADDING byte, or @p end.
+///
+static const uint8_t * __attribute__((nonnull))
+skip_pad(const uint8_t * pos, const uint8_t * const end)
+{
+    while (pos + sizeof(uint64_t) <= end) {
+        uint64_t w;
+        memcpy(&w, pos, sizeof(w));
+        if (w)
+            break;
+        pos += sizeof(w);
+    }
+    while (pos < end && *pos == FRM_PAD)
+        pos++;
+    return pos;
+}
+
+
+#define EPS_ALL (1 << ep_init | 1 << ep_0rtt | 1 << ep_hshk | 1 << ep_data)
+#define EPS_CRY (1 << ep_init | 1 << ep_hshk | 1 << ep_data)
+#define EPS_APP (1 << ep_0rtt | 1 << ep_data)
+
+/// Bitmask of the epochs whose packets may carry a frame, by frame type.
+static const uint8_t frm_eps[FRM_MAX] = {
+    [FRM_PAD] = EPS_ALL,    [FRM_PNG] = EPS_ALL,    [FRM_ACK] = EPS_CRY,
+    [FRM_ACE] = EPS_CRY,    [FRM_RST] = EPS_APP,    [FRM_STP] = EPS_APP,
+    [FRM_CRY] = EPS_CRY,    [FRM_TOK] = EPS_APP,    [FRM_STR] = EPS_APP,
+    [FRM_STR_09] = EPS_APP, [FRM_STR_0a] = EPS_APP, [FRM_STR_0b] = EPS_APP,
+    [FRM_STR_0c] = EPS_APP, [FRM_STR_0d] = EPS_APP, [FRM_STR_0e] = EPS_APP,
+    [FRM_STR_0f] = EPS_APP, [FRM_MCD] = EPS_APP,    [FRM_MSD] = EPS_APP,
+    [FRM_MSB] = EPS_APP,    [FRM_MSU] = EPS_APP,    [FRM_CDB] = EPS_APP,
+    [FRM_SDB] = EPS_APP,    [FRM_SBB] = EPS_APP,    [FRM_SBU] = EPS_APP,
+    [FRM_CID] = EPS_APP,    [FRM_RTR] = EPS_APP,    [FRM_PCL] = EPS_APP,
+    [FRM_PRP] = EPS_APP,    [FRM_CLQ] = EPS_CRY,    [FRM_CLA] = EPS_CRY,
+    [FRM_HSD] = 1 << ep_data};
+
+typedef bool (*frm_dec_t)(const uint8_t type,
+                          const uint8_t ** pos,
+                          const uint8_t * const end,
+                          const struct pkt_meta * const m);
+
+/// Decoders of the frame types that dec_frames() does not handle inline.
+static const frm_dec_t frm_dec[FRM_MAX] = {
+    [FRM_PNG] = dec_ping_frame,
+    [FRM_RST] = dec_reset_stream_frame,
+    [FRM_STP] = dec_stop_sending_frame,
+    [FRM_TOK] = dec_new_token_frame,
+    [FRM_MCD] = dec_max_data_frame,
+    [FRM_MSD] = dec_max_strm_data_frame,
+    [FRM_MSB] = dec_max_strms_frame,
+    [FRM_MSU] = dec_max_strms_frame,
+    [FRM_CDB] = dec_data_blocked_frame,
+    [FRM_SDB] = dec_strm_data_blocked_frame,
+    [FRM_SBB] = dec_streams_blocked_frame,
+    [FRM_SBU] = dec_streams_blocked_frame,
+    [FRM_CID] = dec_new_cid_frame,
+    [FRM_RTR] = dec_retire_cid_frame,
+    [FRM_PCL] = dec_path_challenge_frame,
+    [FRM_PRP] = dec_path_response_frame,
+    [FRM_CLQ] = dec_close_frame,
+    [FRM_CLA] = dec_close_frame,
+    [FRM_HSD] = dec_hshk_done_frame};
+
+
 bool dec_frames(struct q_conn * const c,
                 struct w_iov ** vv,
                 struct pkt_meta ** mm)
@@ -1170,12 +1298,13 @@ bool dec_frames(struct q_conn * const c,
 #else
     void * const ci = 0;
 #endif
-    struct w_iov * v = *vv;
-    struct pkt_meta * m = *mm;
+    struct w_iov * const v_pkt = *vv;
+    struct pkt_meta * const m_pkt = *mm;
+    struct w_iov * v = v_pkt;
+    struct pkt_meta * m = m_pkt;
     const uint8_t * pos = v->buf + m->hdr.hdr_len;
     const uint8_t * start = v->buf;
     const uint8_t * end = v->buf + v->len;
-    const uint8_t * pad_start = 0;
 
 #if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
     // when called from the fuzzer, v->wv_af is zero
@@ -1183,84 +1312,60 @@ bool dec_frames(struct q_conn * const c,
         write_to_corpus(corpus_frm_dir, pos, (size_t)(end - pos));
 #endif
 
+    if (unlikely(m->pn == 0))
+        return false;
+
+    // the epoch of the packet determines which frames it may carry
+    const uint8_t ep = (uint8_t)(1 << epoch_for_pkt_type(m->hdr.type));
+
     while (likely(pos < end)) {
         uint8_t type = *(pos++); // dec1_chk not needed here, pos is < len
 
-        // special-case for optimized parsing of padding ranges
+        // fast path for runs of padding, which often fill the packet
         if (type == FRM_PAD) {
-            if (unlikely(pad_start == 0))
-                pad_start = pos;
-            continue;
-        }
-        if (pad_start) {
-            const uint16_t pad_len = (uint16_t)(pos - pad_start + 1);
+            const uint8_t * const pad_end = skip_pad(pos, end);
+            const uint16_t pad_len = (uint16_t)(pad_end - pos + 1);
             track_frame(m, ci, FRM_PAD, pad_len);
             log_pad(pad_len);
-            pad_start = 0;
+            pos = pad_end;
+            continue;
         }
 
+        if (unlikely(type >= FRM_MAX))
+            err_close_return(c, ERR_FRAME_ENC, type,
+                             "unknown 0x%02x frame at pos %u", type,
+                             (uint16_t)(pos - v->buf));
+
         // check that frame type is allowed in this pkt type
-        static const struct frames frame_ok[] = {
-            [ep_init] = bitset_t_initializer(
-                1 << FRM_PAD | 1 << FRM_PNG | 1 << FRM_CRY | 1 << FRM_CLQ |
-                1 << FRM_CLA | 1 << FRM_ACK | 1 << FRM_ACE),
-            [ep_0rtt] = bitset_t_initializer(
-                1 << FRM_PAD | 1 << FRM_PNG | 1 << FRM_RST | 1 << FRM_STP |
-                1 << FRM_TOK | 1 << FRM_STR | 1 << FRM_STR_09 |
-                1 << FRM_STR_0a | 1 << FRM_STR_0b | 1 << FRM_STR_0c |
-                1 << FRM_STR_0d | 1 << FRM_STR_0e | 1 << FRM_STR_0f |
-                1 << FRM_MCD | 1 << FRM_MSD | 1 << FRM_MSB | 1 << FRM_MSU |
-                1 << FRM_CDB | 1 << FRM_SDB | 1 << FRM_SBB | 1 << FRM_SBU |
-                1 << FRM_CID | 1 << FRM_RTR | 1 << FRM_PCL | 1 << FRM_PRP),
-            [ep_hshk] = bitset_t_initializer(
-                1 << FRM_PAD | 1 << FRM_PNG | 1 << FRM_CRY | 1 << FRM_CLQ |
-                1 << FRM_CLA | 1 << FRM_ACK | 1 << FRM_ACE),
-            [ep_data] = bitset_t_initializer(
-                1 << FRM_PAD | 1 << FRM_PNG | 1 << FRM_CRY | 1 << FRM_CLQ |
-                1 << FRM_CLA | 1 << FRM_ACK | 1 << FRM_ACE | 1 << FRM_RST |
-                1 << FRM_STP | 1 << FRM_TOK | 1 << FRM_STR | 1 << FRM_STR_09 |
-                1 << FRM_STR_0a | 1 << FRM_STR_0b | 1 << FRM_STR_0c |
-                1 << FRM_STR_0d | 1 << FRM_STR_0e | 1 << FRM_STR_0f |
-                1 << FRM_MCD | 1 << FRM_MSD | 1 << FRM_MSB | 1 << FRM_MSU |
-                1 << FRM_CDB | 1 << FRM_SDB | 1 << FRM_SBB | 1 << FRM_SBU |
-                1 << FRM_CID | 1 << FRM_RTR | 1 << FRM_PCL | 1 << FRM_PRP |
-                1 << FRM_HSD)};
-        if (likely(type < FRM_MAX) &&
-            unlikely(bit_isset(FRM_MAX, type,
-                               &frame_ok[epoch_for_pkt_type(m->hdr.type)]) ==
-                     false))
+        if (unlikely((frm_eps[type] & ep) == 0))
             err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
                              "0x%02x frame not OK in %s pkt", type,
                              pkt_type_str(m->hdr.flags, &m->hdr.vers));
 
+        // STREAM, CRYPTO and ACK frames dominate, so decode them inline
         bool ok;
-        switch (type) {
-        case FRM_CRY:
-        case FRM_STR:
-        case FRM_STR_09:
-        case FRM_STR_0a:
-        case FRM_STR_0b:
-        case FRM_STR_0c:
-        case FRM_STR_0d:
-        case FRM_STR_0e:
-        case FRM_STR_0f:;
+        if (likely(type >= FRM_STR && type <= FRM_STR_0f) ||
+            unlikely(type == FRM_CRY)) {
             static const struct frames cry_or_str =
                 bitset_t_initializer(1 << FRM_CRY | 1 << FRM_STR);
             if (unlikely(bit_overlap(FRM_MAX, &m->frms, &cry_or_str)) &&
                 m->strm) {
                 // already had at least one stream or crypto frame in this
-                // packet with non-duplicate data, so generate (another) copy
+                // packet with non-duplicate data, so reference the rest of
+                // the packet from another w_iov (without copying it)
 #ifdef DEBUG_EXTRA
-                warn(DBG, "addtl stream or crypto frame, copy");
+                warn(DBG, "addtl stream or crypto frame, ref");
 #endif
                 const uint16_t off = (uint16_t)(pos - v->buf - 1);
                 struct pkt_meta * mdup;
-                struct w_iov * const vdup = dup_iov(v, &mdup, off);
+                struct w_iov * const vdup = ref_iov(v, m, &mdup, off);
+                if (unlikely(vdup == 0))
+                    return false;
                 pm_cpy(mdup, m, false);
                 // adjust w_iov start and len to stream frame data
                 v->buf += m->strm_data_pos;
                 v->len = m->strm_data_len;
-                // continue parsing in the copied w_iov
+                // continue parsing in the referencing w_iov
                 v = *vv = vdup;
                 m = *mm = mdup;
                 pos = v->buf + 1;
@@ -1269,90 +1374,13 @@ bool dec_frames(struct q_conn * const c,
             }
             ok = dec_stream_or_crypto_frame(type, &pos, end, m, v);
             type = type == FRM_CRY ? FRM_CRY : FRM_STR;
-            break;
 
-        case FRM_ACE:
-        case FRM_ACK:
+        } else if (likely(type == FRM_ACK || type == FRM_ACE)) {
             ok = dec_ack_frame(type, &pos, start, end, m);
             type = FRM_ACK; // only enc FRM_ACK in bitstr_t
-            break;
-
-        case FRM_RST:
-            ok = dec_reset_stream_frame(&pos, end, m);
-            break;
 
-        case FRM_CLQ:
-        case FRM_CLA:
-            ok = dec_close_frame(type, &pos, end, m);
-            break;
-
-        case FRM_PNG:
-            warn(INF, FRAM_IN "PING" NRM);
-            ok = true;
-            break;
-
-        case FRM_HSD:
-            warn(INF, FRAM_IN "HANDSHAKE_DONE" NRM);
-            ok = is_clnt(c);
-            if (likely(ok) && unlikely(c->pns[pn_hshk].abandoned == false))
-                abandon_pn(&c->pns[pn_hshk]);
-            break;
-
-        case FRM_MSD:
-            ok = dec_max_strm_data_frame(&pos, end, m);
-            break;
-
-        case FRM_MSB:
-        case FRM_MSU:
-            ok = dec_max_strms_frame(type, &pos, end, m);
-            break;
-
-        case FRM_MCD:
-            ok = dec_max_data_frame(&pos, end, m);
-            break;
-
-        case FRM_SDB:
-            ok = dec_strm_data_blocked_frame(&pos, end, m);
-            break;
-
-        case FRM_CDB:
-            ok = dec_data_blocked_frame(&pos, end, m);
-            break;
-
-        case FRM_SBB:
-        case FRM_SBU:
-            ok = dec_streams_blocked_frame(type, &pos, end, m);
-            break;
-
-        case FRM_STP:
-            ok = dec_stop_sending_frame(&pos, end, m);
-            break;
-
-        case FRM_PCL:
-            ok = dec_path_challenge_frame(&pos, end, m);
-            break;
-
-        case FRM_PRP:
-            ok = dec_path_response_frame(&pos, end, m);
-            break;
-
-        case FRM_CID:
-            ok = dec_new_cid_frame(&pos, end, m);
-            break;
-
-        case FRM_TOK:
-            ok = dec_new_token_frame(&pos, end, m);
-            break;
-
-        case FRM_RTR:
-            ok = dec_retire_cid_frame(&pos, end, m);
-            break;
-
-        default:
-            err_close_return(c, ERR_FRAME_ENC, type,
-                             "unknown 0x%02x frame at pos %u", type,
-                             (uint16_t)(pos - v->buf));
-        }
+        } else
+            ok = frm_dec[type](type, &pos, end, m);
 
         if (unlikely(ok == false))
             // there was an error parsing a frame
@@ -1364,12 +1392,6 @@ bool dec_frames(struct q_conn * const c,
         track_frame(m, ci, type, 1);
     }
 
-    if (pad_start) {
-        const uint16_t pad_len = (uint16_t)(pos - pad_start + 1);
-        track_frame(m, ci, FRM_PAD, pad_len);
-        log_pad(pad_len);
-    }
-
     if (m->strm_data_pos) {
         // adjust w_iov start and len to stream frame data
         v->buf += m->strm_data_pos;
@@ -1380,6 +1402,13 @@ bool dec_frames(struct q_conn * const c,
     struct pn_space * const pn = pn_for_pkt_type(c, m->hdr.type);
     bit_or(FRM_MAX, &pn->rx_frames, &m->frms);
 
+    if (unlikely(v != v_pkt) && m->strm == 0) {
+        // the last reference into this packet was not placed in any stream
+        free_iov(v, m);
+        *vv = v_pkt;
+        *mm = m_pkt;
+    }
+
     return true;
 }
 
@@ -1414,8 +1443,8 @@ uint16_t max_frame_len(const uint8_t type)
         // case FRM_CRY:
 
     case FRM_TOK:
-        // only true on TX; update when make_rtry_tok() changes
-        len += sizeof(uint_t) + PTLS_MAX_DIGEST_SIZE + CID_LEN_MAX;
+        // only true on TX
+        len += sizeof(uint_t) + RTRY_TOK_LEN_MAX;
         break;
 
     case FRM_MCD:
@@ -1831,10 +1860,10 @@ void enc_path_challenge_frame(struct q_conn_info * const ci,
 {
     const struct q_conn * const c = m->pn->c;
     enc1(pos, end, FRM_PCL);
-    encb(pos, end, c->path_chlg_out, sizeof(c->path_chlg_out));
+    encb(pos, end, c->migr->path_chlg_out, sizeof(c->migr->path_chlg_out));
 
     warn(INF, FRAM_OUT "PATH_CHALLENGE" NRM " data=%s",
-         pcr_str(c->path_chlg_out));
+         pcr_str(c->migr->path_chlg_out));
 
     // FIXME: suspend TX until path is verified
 
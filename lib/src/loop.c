@@ -32,6 +32,7 @@
 
 #include "conn.h"
 #include "loop.h"
+#include "netsim.h"
 #include "quic.h"
 
 
@@ -72,6 +73,18 @@ uint64_t loop_now(void)
 }
 
 
+static inline uint64_t clock_now(void)
+{
+#ifndef NO_NETSIM
+    if (unlikely(netsim_on))
+        return netsim_now();
+    return w_now() + netsim_skew;
+#else
+    return w_now();
+#endif
+}
+
+
 void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
                                           const func_ptr f,
                                           struct q_conn * const c,
@@ -84,7 +97,7 @@ void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
     break_loop = false;
 
     while (likely(break_loop == false)) {
-        now = w_now();
+        now = clock_now();
         timeouts_update(ped(w)->wheel, now);
 
         struct timeout * t;
@@ -97,14 +110,23 @@ void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
         const uint64_t next = timeouts_timeout(ped(w)->wheel);
         ensure(next, "next is null"); // FIXME: remove eventually
 
-        if (w_nic_rx(w, (int64_t)next) == false)
-            continue;
-
         struct w_sock_slist sl = w_sock_slist_initializer(sl);
-        if (w_rx_ready(w, &sl) == 0)
-            continue;
+#ifndef NO_NETSIM
+        if (unlikely(netsim_on)) {
+            // advance the virtual clock to the next timer or packet arrival
+            if (netsim_rx_ready(next, &sl) == 0)
+                continue;
+        } else
+#endif
+        {
+            if (w_nic_rx(w, (int64_t)next) == false)
+                continue;
+
+            if (w_rx_ready(w, &sl) == 0)
+                continue;
+        }
 
-        now = w_now();
+        now = clock_now();
         timeouts_update(ped(w)->wheel, now);
 
         struct w_sock * ws;
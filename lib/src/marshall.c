@@ -41,9 +41,52 @@
 // #define VARINT_MAX VARINT8_MAX
 
 #define VARINT_MASK UINT64_C(0xc000000000000000)
-#define VARINT_MASK8 UINT64_C(0x3fffffffc0000000)
-#define VARINT_MASK4 UINT64_C(0x000000003fffc000)
-#define VARINT_MASK2 UINT64_C(0x0000000000003fc0)
+
+
+// The tables below are indexed by the two-bit length prefix of a varint.
+
+/// Length of a varint in bytes.
+static const uint8_t varint_len[] = {1, 2, 4, 8};
+
+/// Shift that aligns a varint with the top of a 64-bit big-endian word.
+static const uint8_t varint_shift[] = {56, 48, 32, 0};
+
+/// Mask that removes the length prefix from a decoded varint.
+static const uint64_t varint_mask[] = {UINT64_C(0x3f), UINT64_C(0x3fff),
+                                       UINT64_C(0x3fffffff),
+                                       UINT64_C(0x3fffffffffffffff)};
+
+
+/// Computes the two-bit length prefix needed to encode @p val as a varint,
+/// without branching on each length class.
+///
+/// @param[in]  val   Value to check.
+///
+/// @return     Length prefix (0, 1, 2 or 3).
+///
+static inline uint8_t __attribute__((const)) varint_pfx(const uint64_t val)
+{
+    return (uint8_t)((val > 0x3f) + (val > 0x3fff) + (val > 0x3fffffff));
+}
+
+
+/// Decodes the varint at @p pos, which must be followed by at least eight
+/// readable bytes, with a single unaligned big-endian load.
+///
+/// @param[out] val   Decoded value.
+/// @param[in]  pos   Position of the varint.
+///
+/// @return     Length of the varint in bytes.
+///
+static inline uint8_t __attribute__((nonnull))
+decv_unchecked(uint64_t * const val, const uint8_t * const pos)
+{
+    const uint8_t pfx = *pos >> 6;
+    uint64_t v;
+    memcpy(&v, pos, sizeof(v));
+    *val = (bswap64(v) >> varint_shift[pfx]) & varint_mask[pfx];
+    return varint_len[pfx];
+}
 
 
 /// Computes number of bytes need to enccode @p v in QUIC varint encoding.
@@ -55,14 +98,7 @@
 uint8_t varint_size(const uint64_t val)
 {
     ensure((val & VARINT_MASK) == 0, "value overflow: %" PRIu64, val);
-
-    if ((val & VARINT_MASK8) != 0)
-        return 8;
-    if ((val & VARINT_MASK4) != 0)
-        return 4;
-    if ((val & VARINT_MASK2) != 0)
-        return 2;
-    return 1;
+    return varint_len[varint_pfx(val)];
 }
 
 
@@ -119,45 +155,16 @@ void encv(uint8_t ** pos, const uint8_t * const end, const uint64_t val)
 {
     ensure((val & VARINT_MASK) == 0, "value overflow: %" PRIu64, val);
 
-    if ((val & VARINT_MASK8) != 0) {
-        ensure(*pos + 8 <= end, "buffer overflow: %lu",
-               (unsigned long)(end - *pos));
-        *(*pos + 0) = ((val >> 56) & 0x3f) + 0xc0;
-        *(*pos + 1) = (val >> 48) & 0xff;
-        *(*pos + 2) = (val >> 40) & 0xff;
-        *(*pos + 3) = (val >> 32) & 0xff;
-        *(*pos + 4) = (val >> 24) & 0xff;
-        *(*pos + 5) = (val >> 16) & 0xff;
-        *(*pos + 6) = (val >> 8) & 0xff;
-        *(*pos + 7) = val & 0xff;
-        *pos += 8;
-        return;
-    }
-
-    if ((val & VARINT_MASK4) != 0) {
-        ensure(*pos + 4 <= end, "buffer overflow: %lu",
-               (unsigned long)(end - *pos));
-        *(*pos + 0) = ((val >> 24) & 0x3f) + 0x80;
-        *(*pos + 1) = (val >> 16) & 0xff;
-        *(*pos + 2) = (val >> 8) & 0xff;
-        *(*pos + 3) = val & 0xff;
-        *pos += 4;
-        return;
-    }
-
-    if ((val & VARINT_MASK2) != 0) {
-        ensure(*pos + 2 <= end, "buffer overflow: %lu",
-               (unsigned long)(end - *pos));
-        *(*pos + 0) = ((val >> 8) & 0x3f) + 0x40;
-        *(*pos + 1) = val & 0xff;
-        *pos += 2;
-        return;
-    }
-
-    ensure(*pos + 1 <= end, "buffer overflow: %lu",
+    const uint8_t pfx = varint_pfx(val);
+    const uint8_t len = varint_len[pfx];
+    ensure(*pos + len <= end, "buffer overflow: %lu",
            (unsigned long)(end - *pos));
-    **pos = val & 0x3f;
-    *pos += 1;
+
+    // place prefix and value in the top len bytes of a big-endian word
+    const uint64_t v =
+        bswap64(((uint64_t)pfx << 62) | (val << varint_shift[pfx]));
+    memcpy(*pos, &v, len);
+    *pos += len;
 }
 
 
@@ -277,47 +284,56 @@ bool decv(uint64_t * const val,
           const uint8_t ** const pos,
           const uint8_t * const end)
 {
-    switch (**pos & 0xc0) {
-    case 0xc0:
-        if (unlikely(*pos + 8 > end))
-            return false;
+    if (unlikely(*pos >= end))
+        return false;
+
+    const uint8_t pfx = **pos >> 6;
+    const uint8_t len = varint_len[pfx];
+    if (unlikely(*pos + len > end))
+        return false;
 #if !HAVE_64BIT
+    if (unlikely(len == 8))
         return false;
-#else
-        *val =
-            ((uint64_t)(*(*pos + 0) & 0x3f) << 56) +
-            ((uint64_t)(*(*pos + 1)) << 48) + ((uint64_t)(*(*pos + 1)) << 48) +
-            ((uint64_t)(*(*pos + 2)) << 40) + ((uint64_t)(*(*pos + 3)) << 32) +
-            ((uint64_t)(*(*pos + 4)) << 24) + ((uint64_t)(*(*pos + 5)) << 16) +
-            ((uint64_t)(*(*pos + 6)) << 8) + ((uint64_t)(*(*pos + 7)) << 0);
-        *pos += 8;
-        return true;
 #endif
-    case 0x80:
-        if (unlikely(*pos + 4 > end))
-            return false;
-        *val = ((uint64_t)(*(*pos + 0) & 0x3f) << 24) +
-               ((uint64_t)(*(*pos + 1)) << 16) +
-               ((uint64_t)(*(*pos + 2)) << 8) + ((uint64_t)(*(*pos + 3)) << 0);
-        *pos += 4;
-        return true;
 
-    case 0x40:
-        if (unlikely(*pos + 2 > end))
-            return false;
-        *val = ((uint64_t)(*(*pos + 0) & 0x3f) << 8) + (uint64_t)(*(*pos + 1));
-        *pos += 2;
+    if (likely(*pos + sizeof(uint64_t) <= end)) {
+        *pos += decv_unchecked(val, *pos);
         return true;
+    }
+
+    // close to end, so only load the varint itself
+    uint64_t v = 0;
+    memcpy(&v, *pos, len);
+    *val = (bswap64(v) >> varint_shift[pfx]) & varint_mask[pfx];
+    *pos += len;
+    return true;
+}
+
 
-    case 0x00:
-        if (unlikely(*pos + 1 > end))
-            return false;
-        *val = (**pos) & 0x3f;
-        *pos += 1;
+/// Decodes two consecutive varints, e.g., an ACK gap and the length of the
+/// next ACK range, with a single bounds check when they are not near @p end.
+///
+/// @param[out] val1  First decoded value.
+/// @param[out] val2  Second decoded value.
+/// @param      pos   Position of the first varint; advanced past the second.
+/// @param[in]  end   End of the buffer.
+///
+/// @return     True on success, false if the varints are truncated.
+///
+bool decv2(uint64_t * const val1,
+           uint64_t * const val2,
+           const uint8_t ** const pos,
+           const uint8_t * const end)
+{
+#if HAVE_64BIT
+    if (likely(*pos + 2 * sizeof(uint64_t) <= end)) {
+        // both varints are in bounds, one check covers them
+        *pos += decv_unchecked(val1, *pos);
+        *pos += decv_unchecked(val2, *pos);
         return true;
     }
-
-    return false;
+#endif
+    return decv(val1, pos, end) && decv(val2, pos, end);
 }
 
 
@@ -93,6 +93,12 @@ decv(uint64_t * const val,
      const uint8_t ** const pos,
      const uint8_t * const end);
 
+extern bool __attribute__((nonnull, no_instrument_function))
+decv2(uint64_t * const val1,
+      uint64_t * const val2,
+      const uint8_t ** const pos,
+      const uint8_t * const end);
+
 extern bool __attribute__((nonnull, no_instrument_function))
 decb(uint8_t * const val,
      const uint8_t ** const pos,
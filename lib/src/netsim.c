@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "netsim.h"
+
+#ifndef NO_NETSIM
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "kvec.h"
+
+
+/// A simulated socket.
+struct ns_sock {
+    struct w_sock * ws;     ///< The warpcore socket this simulates.
+    struct w_iov_sq rxq;    ///< Packets that have arrived, but not been read.
+    struct w_sockaddr name; ///< Address under which peers reach this socket.
+    uint64_t busy;          ///< Time when the socket's bottleneck is idle.
+};
+
+
+/// A packet in flight.
+struct ns_pkt {
+    uint64_t t;           ///< Arrival time.
+    uint64_t seq;         ///< Insertion order, to break ties in @p t.
+    struct w_iov * v;     ///< Packet copy.
+    struct w_sock * dst;  ///< Destination socket.
+    struct w_sockaddr to; ///< Destination address used by the sender.
+};
+
+
+bool netsim_on = false;
+uint64_t netsim_skew = 0;
+
+static struct w_engine * ns_w;
+static struct netsim_conf ns_conf;
+static struct netsim_stats ns_stats;
+static uint64_t ns_now;
+static uint64_t ns_seq;
+static uint64_t ns_rand_state;
+static kvec_t(struct ns_sock *) ns_socks;
+static kvec_t(struct ns_pkt) ns_heap; ///< Binary min-heap by (t, seq).
+
+
+/// A xorshift64* PRNG, so that simulations do not depend on (and do not
+/// perturb) the random number generator used by the protocol.
+///
+/// @return     Uniformly distributed value in [0, 1000000).
+///
+static uint32_t ns_rand_ppm(void)
+{
+    ns_rand_state ^= ns_rand_state >> 12;
+    ns_rand_state ^= ns_rand_state << 25;
+    ns_rand_state ^= ns_rand_state >> 27;
+    return (uint32_t)((ns_rand_state * UINT64_C(0x2545F4914F6CDD1D)) >> 32) %
+           1000000;
+}
+
+
+static bool __attribute__((nonnull))
+pkt_before(const struct ns_pkt * const a, const struct ns_pkt * const b)
+{
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+
+static void __attribute__((nonnull)) heap_push(const struct ns_pkt * const p)
+{
+    kv_push(struct ns_pkt, ns_heap, *p);
+    size_t i = kv_size(ns_heap) - 1;
+    while (i) {
+        const size_t up = (i - 1) / 2;
+        if (pkt_before(&kv_A(ns_heap, up), &kv_A(ns_heap, i)))
+            break;
+        const struct ns_pkt tmp = kv_A(ns_heap, up);
+        kv_A(ns_heap, up) = kv_A(ns_heap, i);
+        kv_A(ns_heap, i) = tmp;
+        i = up;
+    }
+}
+
+
+static void sift_down(size_t i)
+{
+    const size_t n = kv_size(ns_heap);
+    for (;;) {
+        const size_t l = 2 * i + 1;
+        const size_t r = l + 1;
+        size_t min = i;
+        if (l < n && pkt_before(&kv_A(ns_heap, l), &kv_A(ns_heap, min)))
+            min = l;
+        if (r < n && pkt_before(&kv_A(ns_heap, r), &kv_A(ns_heap, min)))
+            min = r;
+        if (min == i)
+            break;
+        const struct ns_pkt tmp = kv_A(ns_heap, min);
+        kv_A(ns_heap, min) = kv_A(ns_heap, i);
+        kv_A(ns_heap, i) = tmp;
+        i = min;
+    }
+}
+
+
+static struct ns_pkt heap_pop(void)
+{
+    const struct ns_pkt top = kv_A(ns_heap, 0);
+    const struct ns_pkt last = kv_pop(ns_heap);
+    if (kv_size(ns_heap)) {
+        kv_A(ns_heap, 0) = last;
+        sift_down(0);
+    }
+    return top;
+}
+
+
+static struct ns_sock * __attribute__((nonnull))
+get_sock(const struct w_sock * const ws)
+{
+    for (size_t i = 0; i < kv_size(ns_socks); i++)
+        if (kv_A(ns_socks, i)->ws == ws)
+            return kv_A(ns_socks, i);
+    return 0;
+}
+
+
+static struct ns_sock * __attribute__((nonnull))
+get_sock_by_port(const struct w_sockaddr * const dst)
+{
+    // we only look at the port, so that the same socket can be reached via any
+    // of the addresses of the interface (and via the wildcard address)
+    for (size_t i = 0; i < kv_size(ns_socks); i++) {
+        struct ns_sock * const s = kv_A(ns_socks, i);
+        if (s->ws->ws_lport == dst->port && s->ws->ws_af == dst->addr.af)
+            return s;
+    }
+    return 0;
+}
+
+
+void netsim_init(struct w_engine * const w,
+                 const struct netsim_conf * const conf)
+{
+    ensure(netsim_on == false, "netsim already active");
+    ns_w = w;
+    ns_conf = *conf;
+    memset(&ns_stats, 0, sizeof(ns_stats));
+    ns_rand_state = conf->seed ? conf->seed : 1;
+    ns_seq = 0;
+    kv_init(ns_socks);
+    kv_init(ns_heap);
+
+    // the timer wheel cannot go back in time, so start the virtual clock now
+    ns_now = w_now() + netsim_skew;
+    netsim_on = true;
+}
+
+
+void netsim_cleanup(void)
+{
+    if (netsim_on == false)
+        return;
+
+    while (kv_size(ns_heap))
+        w_free_iov(heap_pop().v);
+    for (size_t i = 0; i < kv_size(ns_socks); i++) {
+        w_free(&kv_A(ns_socks, i)->rxq);
+        free(kv_A(ns_socks, i));
+    }
+    kv_destroy(ns_heap);
+    kv_destroy(ns_socks);
+    netsim_on = false;
+
+    // the virtual clock is usually ahead of the real one, keep it that way
+    const uint64_t real = w_now();
+    if (ns_now > real)
+        netsim_skew = ns_now - real;
+}
+
+
+void netsim_get_stats(struct netsim_stats * const s)
+{
+    *s = ns_stats;
+}
+
+
+uint64_t netsim_now(void)
+{
+    return ns_now;
+}
+
+
+void netsim_bind(struct w_sock * const ws)
+{
+    if (get_sock(ws))
+        return;
+
+    // the rxq head is self-referential, so the vector holds pointers
+    struct ns_sock * const s = calloc(1, sizeof(*s));
+    ensure(s, "could not calloc");
+    s->ws = ws;
+    s->name = ws->ws_loc;
+    sq_init(&s->rxq);
+    kv_push(struct ns_sock *, ns_socks, s);
+}
+
+
+void netsim_close(struct w_sock * const ws)
+{
+    struct ns_sock * const s = get_sock(ws);
+    if (s == 0)
+        return;
+    w_free(&s->rxq);
+
+    // drop the packets in flight to the socket
+    for (size_t i = 0; i < kv_size(ns_heap);) {
+        if (kv_A(ns_heap, i).dst == ws) {
+            w_free_iov(kv_A(ns_heap, i).v);
+            kv_A(ns_heap, i) = kv_pop(ns_heap);
+        } else
+            i++;
+    }
+
+    // the heap order is gone, rebuild it
+    for (size_t i = kv_size(ns_heap) / 2; i > 0; i--)
+        sift_down(i - 1);
+
+    for (size_t i = 0; i < kv_size(ns_socks); i++)
+        if (kv_A(ns_socks, i) == s) {
+            kv_A(ns_socks, i) = kv_pop(ns_socks);
+            break;
+        }
+    free(s);
+}
+
+
+void netsim_tx(struct w_sock * const ws, struct w_iov_sq * const q)
+{
+    netsim_bind(ws);
+    struct ns_sock * const src = get_sock(ws);
+    struct w_iov * v;
+    sq_foreach (v, q, next) {
+        ns_stats.tx++;
+
+        // like the kernel, send to the peer of a connected socket, since
+        // quant does not set the destination of its datagrams then
+        const struct w_sockaddr * const to =
+            w_connected(ws) ? &ws->ws_rem : &v->saddr;
+        const struct ns_sock * const dst = get_sock_by_port(to);
+        if (unlikely(dst == 0)) {
+            ns_stats.unreach++;
+            continue;
+        }
+
+        // the link silently drops packets larger than its MTU
+        if (ns_conf.mtu && v->len > ns_conf.mtu) {
+            ns_stats.toobig++;
+            continue;
+        }
+
+        // queue the packet at the bottleneck, unless its buffer is full
+        const uint64_t start = MAX(ns_now, src->busy);
+        if (ns_conf.bw && ns_conf.queue &&
+            (double)(start - ns_now) * (double)ns_conf.bw / (8 * NS_PER_S) >
+                ns_conf.queue) {
+            ns_stats.qdrop++;
+            continue;
+        }
+        src->busy = start + (ns_conf.bw ? (uint64_t)v->len * 8 * NS_PER_S /
+                                              ns_conf.bw
+                                        : 0);
+
+        // a lost packet still occupied the bottleneck
+        if (ns_conf.loss && ns_rand_ppm() < ns_conf.loss) {
+            ns_stats.lost++;
+            continue;
+        }
+
+        struct ns_pkt p = {.t = src->busy + ns_conf.rtt / 2,
+                           .seq = ns_seq++,
+                           .dst = dst->ws,
+                           .to = *to};
+        if (ns_conf.reorder && ns_rand_ppm() < ns_conf.reorder) {
+            p.t += ns_conf.jitter;
+            ns_stats.reordered++;
+        }
+
+        p.v = w_alloc_iov(ns_w, v->wv_af, 0, 0);
+        if (unlikely(p.v == 0)) {
+            ns_stats.qdrop++;
+            continue;
+        }
+        memcpy(p.v->buf, v->buf, v->len);
+        p.v->len = v->len;
+        p.v->flags = v->flags;
+        p.v->ttl = v->ttl;
+        p.v->saddr = src->name;
+        heap_push(&p);
+    }
+}
+
+
+void netsim_rx(struct w_sock * const ws, struct w_iov_sq * const i)
+{
+    struct ns_sock * const s = get_sock(ws);
+    if (s == 0)
+        return;
+
+    while (!sq_empty(&s->rxq)) {
+        struct w_iov * const v = sq_first(&s->rxq);
+        sq_remove_head(&s->rxq, next);
+        sq_insert_tail(i, v, next);
+    }
+}
+
+
+uint32_t netsim_rx_ready(const uint64_t nsec, struct w_sock_slist * const sl)
+{
+    const uint64_t deadline =
+        nsec > UINT64_MAX - ns_now ? UINT64_MAX : ns_now + nsec;
+
+    if (kv_size(ns_heap) == 0 || kv_A(ns_heap, 0).t > deadline) {
+        // nothing arrives before the next timer fires
+        ensure(deadline != UINT64_MAX, "simulation has no pending events");
+        ns_now = deadline;
+        return 0;
+    }
+
+    // deliver everything that arrives at the next arrival time
+    ns_now = kv_A(ns_heap, 0).t;
+    while (kv_size(ns_heap) && kv_A(ns_heap, 0).t <= ns_now) {
+        const struct ns_pkt p = heap_pop();
+        struct ns_sock * const s = get_sock(p.dst);
+        // remember how the sender addressed this socket, for replies
+        s->name = p.to;
+        ns_stats.rx++;
+        ns_stats.bytes += p.v->len;
+        sq_insert_tail(&s->rxq, p.v, next);
+    }
+
+    uint32_t n = 0;
+    for (size_t i = 0; i < kv_size(ns_socks); i++) {
+        struct ns_sock * const s = kv_A(ns_socks, i);
+        if (!sq_empty(&s->rxq)) {
+            sl_insert_head(sl, s->ws, next);
+            n++;
+        }
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#if defined(PARTICLE) || defined(RIOT_VERSION)
+#define NO_NETSIM
+#endif
+
+#ifndef NO_NETSIM
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <warpcore/warpcore.h>
+
+
+/// A deterministic, in-process simulation of the network below warpcore, for
+/// reproducible tests and benchmarks. While it is active, packets handed to
+/// warpcore for TX are instead copied into the simulator, which delays, drops
+/// and reorders them according to a netsim_conf and later delivers them to the
+/// simulated socket bound to their destination port. No packets touch a real
+/// socket.
+///
+/// The event loop then runs on a virtual clock that jumps directly to the next
+/// timer expiry or packet arrival, so simulated time is independent of the
+/// wall clock and the speed of the host. All random decisions are drawn from
+/// a private PRNG, so a given configuration reproduces the same loss and
+/// reordering pattern for the same sequence of packets.
+
+
+/// Link parameters. They apply independently to each sending socket, i.e.,
+/// each direction of a connection has its own bottleneck.
+///
+struct netsim_conf {
+    uint64_t bw;      ///< Bottleneck bandwidth in bit/s (0 = unlimited).
+    uint64_t rtt;     ///< Round-trip propagation delay in ns.
+    uint64_t jitter;  ///< Additional delay of reordered packets in ns.
+    uint32_t queue;   ///< Bottleneck buffer in bytes (0 = unlimited).
+    uint32_t loss;    ///< Random loss probability in parts per million.
+    uint32_t reorder; ///< Reordering probability in parts per million.
+    uint32_t seed;    ///< PRNG seed.
+    uint32_t mtu;     ///< Largest UDP payload in bytes (0 = unlimited).
+    uint8_t _unused[4];
+};
+
+
+/// Simulator counters.
+///
+struct netsim_stats {
+    uint64_t tx;        ///< Packets handed to the simulator.
+    uint64_t rx;        ///< Packets delivered to a socket.
+    uint64_t bytes;     ///< UDP payload bytes delivered.
+    uint64_t lost;      ///< Packets dropped by random loss.
+    uint64_t qdrop;     ///< Packets dropped by a full bottleneck buffer.
+    uint64_t unreach;   ///< Packets without a simulated destination socket.
+    uint64_t reordered; ///< Packets delayed by netsim_conf::jitter.
+    uint64_t toobig;    ///< Packets dropped for exceeding netsim_conf::mtu.
+};
+
+
+extern bool netsim_on;
+
+/// Offset of the virtual clock from w_now() after a simulation has ended, so
+/// that the event loop never sees time go backwards.
+extern uint64_t netsim_skew;
+
+
+extern void __attribute__((nonnull))
+netsim_init(struct w_engine * const w, const struct netsim_conf * const conf);
+
+extern void netsim_cleanup(void);
+
+extern void __attribute__((nonnull))
+netsim_get_stats(struct netsim_stats * const s);
+
+extern uint64_t netsim_now(void);
+
+extern void __attribute__((nonnull)) netsim_bind(struct w_sock * const ws);
+
+extern void __attribute__((nonnull)) netsim_close(struct w_sock * const ws);
+
+extern void __attribute__((nonnull))
+netsim_tx(struct w_sock * const ws, struct w_iov_sq * const q);
+
+extern void __attribute__((nonnull))
+netsim_rx(struct w_sock * const ws, struct w_iov_sq * const i);
+
+extern uint32_t __attribute__((nonnull))
+netsim_rx_ready(const uint64_t nsec, struct w_sock_slist * const sl);
+
+#endif
@@ -182,7 +182,7 @@ void log_pkt(const char * const dir,
 
 void validate_pmtu(struct q_conn * const c)
 {
-    c->rec.max_pkt_size =
+    c->rec.max_pkt_size = c->rec.pmtud_lo =
         MIN(w_max_udp_payload(c->sock), (uint16_t)c->tp_peer.max_pkt);
     warn(NTE, "PMTU %u validated", c->rec.max_pkt_size);
     c->pmtud_pkt = UINT16_MAX;
@@ -198,80 +198,54 @@ can_coalesce_pkt_types(const uint8_t a, const uint8_t b)
 }
 
 
-uint16_t coalesce(struct w_iov_sq * const q,
-                  const uint16_t max_pkt_size,
-                  const bool do_pmtud)
+/// Returns the last datagram in the txq of connection @p c, if a pkt with meta
+/// data @p m and @p len bytes of ciphertext can be coalesced behind it. The
+/// long-header pkt types must be in a sensible order, the datagram must not
+/// exceed the max. pkt size (or the PMTU when the flight will carry a PMTUD
+/// probe), and 1-RTT pkts are not coalesced while PMTUD is still needed.
+///
+/// @param      c     Connection.
+/// @param      m     Meta-data of the pkt to be coalesced.
+/// @param[in]  len   Length of the pkt after encryption.
+///
+/// @return     The datagram to coalesce into, or zero.
+///
+static struct w_iov * __attribute__((nonnull))
+coal_tail(struct q_conn * const c,
+          const struct pkt_meta * const m,
+          const uint16_t len)
 {
-    uint16_t pmtud_pkt = UINT16_MAX;
-    struct w_iov * v = sq_first(q);
-    while (v) {
-        uint8_t skipped_types = 0;
-        struct w_iov * next = sq_next(v, next);
-        struct w_iov * prev = v;
-        uint8_t inner_flags = *v->buf;
-#ifndef NDEBUG
-        const char * inner_type_str = pkt_type_str(*v->buf, v->buf + 1);
-        const char * const outer_type_str = inner_type_str;
-#endif
-        while (next) {
-#ifndef NDEBUG
-            const char * const next_type_str =
-                pkt_type_str(*next->buf, next->buf + 1);
-#endif
-            struct w_iov * const next_next = sq_next(next, next);
-            // do we have space? do the packet types make sense to coalesce?
-            if (v->len + next->len > max_pkt_size) {
-                warn(DBG,
-                     "cannot coalesce %u-byte %s pkt behind %u-byte %s pkt, "
-                     "limit %u",
-                     next->len, next_type_str, v->len, outer_type_str,
-                     max_pkt_size);
-                skipped_types |= pkt_type(*next->buf);
-                prev = next;
-            } else if (can_coalesce_pkt_types(pkt_type(inner_flags),
-                                              pkt_type(*next->buf)) == false) {
-                warn(DBG, "cannot coalesce %u-byte %s pkt behind inner %s pkt",
-                     next->len, next_type_str, inner_type_str);
-                prev = next;
-            } else if (skipped_types & pkt_type(*next->buf)) {
-                warn(DBG,
-                     "cannot coalesce %u-byte %s pkt behind inner %s pkt, "
-                     "skipped one already",
-                     next->len, next_type_str, inner_type_str);
-                prev = next;
-            } else if (skipped_types && skipped_types < pkt_type(*next->buf)) {
-                warn(DBG,
-                     "cannot coalesce %u-byte %s pkt behind inner %s pkt, "
-                     "skipped 0x%02x already",
-                     next->len, next_type_str, inner_type_str, skipped_types);
-                prev = next;
-            } else if (pkt_type(*next->buf) == SH && do_pmtud) {
-                warn(DBG,
-                     "won't coalesce %u-byte %s pkt behind inner %s pkt, "
-                     "need to do PMTUD",
-                     next->len, next_type_str, inner_type_str);
-                prev = next;
-            } else {
-                // we can coalesce
-                warn(INF,
-                     "coalescing %u-byte %s pkt behind inner %u-byte %s pkt "
-                     "(outermost %s)",
-                     next->len, next_type_str, v->len, inner_type_str,
-                     outer_type_str);
-                inner_flags = *next->buf;
-#ifndef NDEBUG
-                inner_type_str = next_type_str;
+#ifndef NO_MIGRATION
+    if (unlikely(c->tx_path_chlg))
+        return 0;
 #endif
-                memcpy(v->buf + v->len, next->buf, next->len);
-                v->len += next->len;
-                sq_remove_after(q, prev, next);
-                sq_next(next, next) = 0; // must unlink
-                w_free_iov(next);
-            }
-            next = next_next;
-        }
+    if (likely(c->tx_tail == 0) ||
+        can_coalesce_pkt_types(c->tx_tail & LH_TYPE_MASK, m->hdr.type) ==
+            false)
+        return 0;
+
+    // cppcheck-suppress nullPointer
+    struct w_iov * const tail = sq_last(&c->txq, w_iov, next);
+    if (unlikely(tail == 0))
+        return 0;
+
+    const uint16_t pmtu =
+        MIN(w_max_udp_payload(c->sock), (uint16_t)c->tp_peer.max_pkt);
+    const bool do_pmtud =
+        c->rec.max_pkt_size == MIN_INI_LEN && pmtu > MIN_INI_LEN;
+    if (tail->len + len > (do_pmtud ? pmtu : c->rec.max_pkt_size) ||
+        (m->hdr.type == SH && do_pmtud))
+        return 0;
+    return tail;
+}
+
 
-        if (do_pmtud && pmtud_pkt == UINT16_MAX && v->len < max_pkt_size) {
+uint16_t pad_pmtud_probe(struct w_iov_sq * const q,
+                         const uint16_t max_pkt_size)
+{
+    struct w_iov * v;
+    sq_foreach (v, q, next)
+        if (v->len < max_pkt_size) {
             warn(NTE,
                  "testing PMTU %u with %s pkt %u using %u bytes rand padding",
                  max_pkt_size, pkt_type_str(*v->buf, v->buf + 1),
@@ -279,15 +253,9 @@ uint16_t coalesce(struct w_iov_sq * const q,
             rand_bytes(v->buf + v->len, max_pkt_size - v->len);
             *(v->buf + v->len) &= ~LH;
             v->len = max_pkt_size;
-            pmtud_pkt = v->user_data;
+            return v->user_data;
         }
-
-        v = sq_next(v, next);
-        if (v)
-            warn(DBG, "coalescing txq next");
-    }
-
-    return pmtud_pkt;
+    return UINT16_MAX;
 }
 
 
@@ -422,6 +390,25 @@ enc_other_frames(
 }
 
 
+/// Rebuild the cached 1-RTT header template of connection @p c, i.e., the
+/// flags byte without the packet number length bits, followed by the DCID.
+/// The template must be invalidated (by zeroing q_conn::sh_hdr_len) whenever
+/// the DCID, the outbound key phase or the spin bit changes.
+///
+/// @param      c     Connection.
+///
+static void __attribute__((nonnull)) mk_sh_hdr(struct q_conn * const c)
+{
+    c->sh_hdr[0] = SH;
+    if (c->pns[pn_data].data.out_kyph)
+        c->sh_hdr[0] |= SH_KYPH;
+    if (c->spin_enabled && c->spin)
+        c->sh_hdr[0] |= SH_SPIN;
+    memcpy(&c->sh_hdr[1], c->dcid->id, c->dcid->len);
+    c->sh_hdr_len = (uint8_t)(1 + c->dcid->len);
+}
+
+
 bool enc_pkt(struct q_stream * const s,
              const bool rtx,
              const bool enc_data,
@@ -430,11 +417,27 @@ bool enc_pkt(struct q_stream * const s,
              struct w_iov * const v,
              struct pkt_meta * const m)
 {
+    struct q_conn * const c = s->c;
+
+    // alloc directly from warpcore for crypto TX - no need for metadata alloc;
+    // do this first, so we can back out cleanly if the pool is exhausted;
+    // tx_stream() may have reserved buffers for the whole burst already
+    struct w_iov * xv = sq_first(&c->tx_bat);
+    if (likely(xv)) {
+        sq_remove_head(&c->tx_bat, next);
+        sq_next(xv, next) = 0;
+    } else
+        xv = w_alloc_iov(c->w, q_conn_af(c), 0, 0);
+    if (unlikely(xv == 0)) {
+        warn(ERR, "buffer pool exhausted, delaying TX on %s conn %s",
+             conn_type(c), cid_str(c->scid));
+        return false;
+    }
+
     if (likely(enc_data))
         // prepend the header by adjusting the buffer offset
         adj_iov_to_start(v, m);
 
-    struct q_conn * const c = s->c;
     uint8_t * len_pos = 0;
 #ifndef NO_QINFO
     struct q_conn_info * const ci = &c->i;
@@ -442,16 +445,12 @@ bool enc_pkt(struct q_stream * const s,
     void * const ci = 0;
 #endif
 
-    const epoch_t epoch = unlikely(pmtud) ? ep_hshk : strm_epoch(s);
+    const epoch_t epoch = strm_epoch(s);
     struct pn_space * const pn = m->pn = pn_for_epoch(c, epoch);
 
     m->txed = true;
-#ifndef NO_SERVER
-    if (unlikely(c->tx_rtry))
-        m->hdr.nr = 0;
-    else
-#endif
-        if (unlikely(pn->lg_sent == UINT_T_MAX))
+    m->is_pmtud = pmtud;
+    if (unlikely(pn->lg_sent == UINT_T_MAX))
         // next pkt nr
         m->hdr.nr = pn->lg_sent = 0;
     else
@@ -459,17 +458,8 @@ bool enc_pkt(struct q_stream * const s,
 
     switch (epoch) {
     case ep_init:
-#ifndef NO_SERVER
-        if (unlikely(c->tx_rtry))
-            m->hdr.type = LH_RTRY;
-        else
-#endif
-            m->hdr.type = LH_INIT;
+        m->hdr.type = LH_INIT;
         m->hdr.flags = LH | m->hdr.type;
-#ifndef NO_SERVER
-        if (unlikely(c->tx_rtry))
-            m->hdr.flags |= (uint8_t)w_rand_uniform32(0x0f);
-#endif
         break;
     case ep_0rtt:
         if (is_clnt(c)) {
@@ -483,10 +473,10 @@ bool enc_pkt(struct q_stream * const s,
         m->hdr.flags = LH | m->hdr.type;
         break;
     case ep_data:
-        m->hdr.type = m->hdr.flags = SH;
-        m->hdr.flags |= pn->data.out_kyph ? SH_KYPH : 0;
-        if (c->spin_enabled && c->spin)
-            m->hdr.flags |= SH_SPIN;
+        if (unlikely(c->sh_hdr_len == 0))
+            mk_sh_hdr(c);
+        m->hdr.type = SH;
+        m->hdr.flags = c->sh_hdr[0];
         break;
     }
 
@@ -508,45 +498,45 @@ bool enc_pkt(struct q_stream * const s,
         if (m->hdr.type == LH_INIT)
             encv(&pos, end, is_clnt(c) ? c->tok_len : 0);
 
-        if (((is_clnt(c) && m->hdr.type == LH_INIT) ||
-             m->hdr.type == LH_RTRY) &&
-            c->tok_len)
+        if (is_clnt(c) && m->hdr.type == LH_INIT && c->tok_len)
             encb(&pos, end, c->tok, c->tok_len);
 
-        if (m->hdr.type != LH_RTRY) {
-            // leave space for length field (2 bytes is enough)
-            len_pos = pos;
-            pos += 2;
-        }
+        // leave space for length field (2 bytes is enough)
+        len_pos = pos;
+        pos += 2;
 
+    } else if (likely(c->sh_hdr_len)) {
+        // flags are encoded above, copy the DCID from the template
+        encb(&pos, end, &c->sh_hdr[1], (uint16_t)(c->sh_hdr_len - 1));
+#ifndef NDEBUG
+        // only log_pkt() needs the dcid in the meta-data
+        cid_cpy(&m->hdr.dcid, c->dcid);
+#endif
     } else {
         cid_cpy(&m->hdr.dcid, c->dcid);
         encb(&pos, end, m->hdr.dcid.id, m->hdr.dcid.len);
     }
 
-    uint8_t * pkt_nr_pos = 0;
-    if (likely(m->hdr.type != LH_RTRY)) {
-        pkt_nr_pos = pos;
-        switch ((pnl - 1) & HEAD_PNRL_MASK) {
-        case 0:
-            enc1(&pos, end, m->hdr.nr & UINT64_C(0xff));
-            break;
-        case 1:
-            enc2(&pos, end, m->hdr.nr & UINT64_C(0xffff));
-            break;
-        case 2:
-            enc3(&pos, end, m->hdr.nr & UINT64_C(0xffffff));
-            break;
-        case 3:
-            enc4(&pos, end, m->hdr.nr & UINT64_C(0xffffffff));
-            break;
-        }
+    uint8_t * const pkt_nr_pos = pos;
+    switch ((pnl - 1) & HEAD_PNRL_MASK) {
+    case 0:
+        enc1(&pos, end, m->hdr.nr & UINT64_C(0xff));
+        break;
+    case 1:
+        enc2(&pos, end, m->hdr.nr & UINT64_C(0xffff));
+        break;
+    case 2:
+        enc3(&pos, end, m->hdr.nr & UINT64_C(0xffffff));
+        break;
+    case 3:
+        enc4(&pos, end, m->hdr.nr & UINT64_C(0xffffffff));
+        break;
     }
 
     m->hdr.hdr_len = (uint16_t)(pos - v->buf);
     v->saddr =
 #ifndef NO_MIGRATION
-        unlikely(c->tx_path_chlg) ? c->migr_peer :
+        unlikely(c->tx_path_chlg) ? c->migr->peer :
 #endif
                                   c->peer;
 
@@ -556,19 +546,11 @@ bool enc_pkt(struct q_stream * const s,
                  DATA_OFFSET + (is_lh(m->hdr.flags) ? c->tok_len + 16 : 0))) {
         warn(ERR, "pkt header %u >= offset %u", m->hdr.hdr_len,
              DATA_OFFSET + (is_lh(m->hdr.flags) ? c->tok_len + 16 : 0));
+        w_free_iov(xv);
         return false;
     }
 #endif
 
-    if (unlikely(m->hdr.type == LH_RTRY)) {
-        uint8_t rit[RIT_LEN];
-        make_rit(c, m->hdr.flags, &m->hdr.dcid, &m->hdr.scid, c->tok,
-                 c->tok_len, rit);
-        encb(&pos, end, rit, RIT_LEN);
-        log_pkt("TX", v, &v->saddr, c->tok, c->tok_len, rit);
-        goto tx;
-    }
-
     log_pkt("TX", v, &v->saddr, c->tok, c->tok_len, 0);
 
     if (unlikely(pmtud)) {
@@ -577,18 +559,23 @@ bool enc_pkt(struct q_stream * const s,
         goto tx;
     }
 
-    if (needs_ack(pn) != no_ack &&
-        unlikely(enc_ack_frame(ci, &pos, v->buf, end, m, pn) == false)) {
-        // couldn't encode (all of) the ACK, schedule pure ACK TX
-        warn(DBG, "not enough space for ACK frame, scheduling ACK timeout");
-        timeouts_add(ped(c->w)->wheel, &c->ack_alarm, 0);
-    }
+    // only the first pkt of a burst carries ACK and control frames; no new
+    // ACKs can become due during a burst, and control frames raised by flow
+    // control during it are picked up after the stream frame or next time
+    if (c->tx_burst == false) {
+        if (needs_ack(pn) != no_ack &&
+            unlikely(enc_ack_frame(ci, &pos, v->buf, end, m, pn) == false)) {
+            // couldn't encode (all of) the ACK, schedule pure ACK TX
+            warn(DBG, "not enough space for ACK frame, scheduling ACK timeout");
+            timeouts_add(ped(c->w)->wheel, &c->ack_alarm, 0);
+        }
 
-    if (unlikely(c->state == conn_clsg))
-        enc_close_frame(ci, &pos, end, m);
-    else if (epoch == ep_data || (!is_clnt(c) && epoch == ep_0rtt))
-        // TODO calc stream hdr len and subtract
-        enc_other_frames(ci, &pos, end, m);
+        if (unlikely(c->state == conn_clsg))
+            enc_close_frame(ci, &pos, end, m);
+        else if (epoch == ep_data || (!is_clnt(c) && epoch == ep_0rtt))
+            // TODO calc stream hdr len and subtract
+            enc_other_frames(ci, &pos, end, m);
+    }
 
     if (unlikely(rtx)) {
         // this is a RTX, pad out until beginning of stream header
@@ -660,41 +647,57 @@ tx:;
 
     v->len = (uint16_t)(pos - v->buf);
 
-    // alloc directly from warpcore for crypto TX - no need for metadata alloc
-    struct w_iov * const xv = w_alloc_iov(c->w, q_conn_af(c), 0, 0);
-    ensure(xv, "w_alloc_iov failed");
+    // if this pkt can be coalesced, encrypt it straight into the free space
+    // behind the last datagram in the txq, instead of into its own buffer
+    struct w_iov * const tail = coal_tail(c, m, (uint16_t)(v->len + AEAD_LEN));
+    struct w_iov cv = {.buf = tail ? tail->buf + tail->len : 0};
+    struct w_iov * const ov = tail ? &cv : xv;
 
-    if (unlikely(m->hdr.type == LH_RTRY)) {
-        memcpy(xv->buf, v->buf, v->len); // copy data
-        xv->len = v->len;
-    } else {
-        const uint16_t ret =
-            enc_aead(v, m, xv, (uint16_t)(pkt_nr_pos - v->buf));
-        if (unlikely(ret == 0)) {
-            adj_iov_to_start(v, m);
-            return false;
-        }
+    const uint16_t ret = enc_aead(v, m, ov, (uint16_t)(pkt_nr_pos - v->buf));
+    if (unlikely(ret == 0)) {
+        adj_iov_to_start(v, m);
+        w_free_iov(xv);
+        return false;
     }
 
-    if (!is_clnt(c))
-        xv->saddr = v->saddr;
-
     // track the flags manually, since warpcore sets them on the xv and it'd
     // require another loop to copy them over
-    xv->flags = v->flags |= likely(c->sockopt.enable_ecn) ? IPTOS_ECN_ECT0 : 0;
+    v->flags |= likely(c->sockopt.enable_ecn) ? IPTOS_ECN_ECT0 : 0;
+
+    if (tail) {
+        warn(DBG, "coalesced %u-byte %s pkt into %u-byte datagram", ov->len,
+             pkt_type_str(m->hdr.flags, &m->hdr.vers), tail->len);
+        tail->len += ov->len;
+        c->tx_coal++;
+#ifndef NO_QINFO
+        // do_tx_txq() counts datagrams, so count the coalesced pkt here
+        ci->pkts_out++;
+#endif
+        c->tx_tail = is_lh(m->hdr.flags) ? (uint8_t)(LH | m->hdr.type) : 0;
+        w_free_iov(xv);
+    } else {
+        if (!is_clnt(c) || !c->holds_sock)
+            // unconnected (server or shared client) socket, set destination
+            xv->saddr = v->saddr;
+        xv->flags = v->flags;
 
-    // encode the pn space id and pkt nr to identify PMTUD pkts;
-    // this only works for packets numbered below 0x3fff, but that is plenty
-    xv->user_data = (uint16_t)((m->pn->type << 14) | MIN(0x3fff, m->hdr.nr));
+        // encode the pn space id and pkt nr to identify PMTUD pkts;
+        // this only works for packets numbered below 0x3fff, but that is plenty
+        xv->user_data =
+            (uint16_t)((m->pn->type << 14) | MIN(0x3fff, m->hdr.nr));
 
 #ifndef NO_MIGRATION
-    if (unlikely(c->tx_path_chlg))
-        sq_insert_tail(&c->migr_txq, xv, next);
-    else
+        if (unlikely(c->tx_path_chlg))
+            sq_insert_tail(&c->migr->txq, xv, next);
+        else
 #endif
-        sq_insert_tail(&c->txq, xv, next);
+        {
+            sq_insert_tail(&c->txq, xv, next);
+            c->tx_tail = is_lh(m->hdr.flags) ? (uint8_t)(LH | m->hdr.type) : 0;
+        }
+    }
 
-    m->udp_len = xv->len;
+    m->udp_len = ov->len;
     c->out_data += m->udp_len;
 
     if (unlikely(m->hdr.type == LH_INIT && is_clnt(c) && m->strm_data_len))
@@ -1079,9 +1082,14 @@ bool dec_pkt_hdr_remainder(struct w_iov * const xv,
         if (unlikely(v_kyph != pnd->in_kyph))
             pnd->in_kyph = v_kyph;
 
-        if (c->spin_enabled && m->hdr.nr > diet_max(&pn->recv_all))
+        if (c->spin_enabled && m->hdr.nr > diet_max(&pn->recv_all)) {
             // short header, spin the bit
-            c->spin = (is_set(SH_SPIN, m->hdr.flags) == !is_clnt(c));
+            const bool spin = is_set(SH_SPIN, m->hdr.flags) == !is_clnt(c);
+            if (c->spin != spin) {
+                c->spin = spin;
+                c->sh_hdr_len = 0;
+            }
+        }
     }
 
     v->len = xv->len - AEAD_LEN;
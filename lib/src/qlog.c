@@ -32,7 +32,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include <quant/quant.h>
 
@@ -93,7 +95,11 @@ void qlog_init(struct q_conn * const c)
         c->qlog = 0;
     }
 
-    snprintf(c->qlog_file, sizeof(c->qlog_file), "%s/%s.%s.qlog",
+    if (c->qlog_file == 0) {
+        c->qlog_file = malloc(MAXPATHLEN);
+        ensure(c->qlog_file, "could not malloc");
+    }
+    snprintf(c->qlog_file, MAXPATHLEN, "%s/%s.%s.qlog",
              ped(c->w)->conf.qlog_dir,
              is_clnt(c) ? hex2str(c->odcid.id, c->odcid.len,
                                   (char[hex_str_len(CID_LEN_MAX)]){""},
@@ -129,7 +135,10 @@ void qlog_close(struct q_conn * const c)
     if (c->qlog) {
         fputs("]}]}", c->qlog);
         fclose(c->qlog);
+        c->qlog = 0;
     }
+    free(c->qlog_file);
+    c->qlog_file = 0;
 }
 
 
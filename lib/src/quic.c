@@ -54,10 +54,14 @@
 
 #ifdef PARTICLE
 #include <arpa/inet.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #include "conn.h"
 #include "loop.h"
+#include "netsim.h"
 #include "pkt.h"
 #include "pn.h"
 #include "quic.h"
@@ -144,12 +148,109 @@ void free_iov(struct w_iov * const v, struct pkt_meta * const m)
         }
     }
 
+    const uint32_t base = m->rx_base;
+    const uint32_t refs = m->rx_refs;
     memset(m, 0, sizeof(*m));
+    if (unlikely(refs > 1)) {
+        // other w_iovs still reference our data, the last one frees us
+        m->rx_refs = refs - 1;
+        return;
+    }
     ASAN_POISON_MEMORY_REGION(m, sizeof(*m));
     w_free_iov(v);
+
+    if (unlikely(base)) {
+        // drop our reference to the w_iov holding our data
+        struct w_iov * const b = w_iov(v->w, base - 1);
+        struct pkt_meta * const mb = &meta(b);
+        if (--mb->rx_refs == 0) {
+            ASAN_POISON_MEMORY_REGION(mb, sizeof(*mb));
+            w_free_iov(b);
+        }
+    }
 }
 
 
+/// Allocate @p len bytes of zeroed memory for per-buffer meta-data. If @p huge
+/// is set, try to back the memory with 2 MB hugepages, falling back to
+/// transparent hugepages. The memory is pre-faulted, so that first-touch
+/// placement puts it on the NUMA node of the calling (serving) thread.
+///
+/// @param      len   Length of the allocation.
+/// @param      huge  Whether to use hugepages.
+///
+/// @return     Pointer to the allocated memory.
+///
+void * alloc_meta(const size_t len, const bool huge)
+{
+#ifndef PARTICLE
+    if (huge) {
+        const size_t hlen = (len + HUGE_PAGE_LEN - 1) & ~(HUGE_PAGE_LEN - 1);
+        void * p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        p = mmap(0, hlen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            warn(NTE, "no hugepages reserved, trying transparent hugepages");
+            p = mmap(0, hlen, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            ensure(p != MAP_FAILED, "mmap failed");
+#ifdef MADV_HUGEPAGE
+            madvise(p, hlen, MADV_HUGEPAGE);
+#endif
+        }
+        memset(p, 0, hlen);
+        return p;
+    }
+#endif
+    void * const p = calloc(1, len);
+    ensure(p, "could not calloc");
+    return p;
+}
+
+
+void free_meta(void * const p, const size_t len, const bool huge)
+{
+#ifndef PARTICLE
+    if (huge) {
+        munmap(p, (len + HUGE_PAGE_LEN - 1) & ~(HUGE_PAGE_LEN - 1));
+        return;
+    }
+#else
+    (void)len;
+    (void)huge;
+#endif
+    free(p);
+}
+
+
+#ifdef MADV_HUGEPAGE
+/// Ask the kernel to back the warpcore buffers with transparent hugepages.
+/// Warpcore does not expose its buffer region, so derive it from the iovs.
+///
+/// @param      w     Warpcore engine.
+///
+static void __attribute__((nonnull)) advise_bufs(struct w_engine * const w)
+{
+    uintptr_t lo = UINTPTR_MAX;
+    uintptr_t hi = 0;
+    const struct w_iov * v;
+    sq_foreach (v, &w->iov, next) {
+        lo = MIN(lo, (uintptr_t)v->buf);
+        hi = MAX(hi, (uintptr_t)v->buf + w->mtu);
+    }
+    if (lo >= hi)
+        return;
+
+    const uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+    lo &= ~(pg - 1);
+    if (madvise((void *)lo, hi - lo, MADV_HUGEPAGE) != 0)
+        warn(NTE, "cannot use hugepages for buffers");
+}
+#endif
+
+
 struct w_iov * alloc_iov(struct w_engine * const w,
                          const int af,
                          const uint16_t len,
@@ -157,7 +258,10 @@ struct w_iov * alloc_iov(struct w_engine * const w,
                          struct pkt_meta ** const m)
 {
     struct w_iov * const v = w_alloc_iov(w, af, len, off);
-    ensure(v, "w_alloc_iov failed");
+    if (unlikely(v == 0)) {
+        warn(ERR, "buffer pool exhausted");
+        return 0;
+    }
     *m = &meta(v);
     ASAN_UNPOISON_MEMORY_REGION(*m, sizeof(**m));
     (*m)->strm_data_pos = off;
@@ -183,6 +287,43 @@ struct w_iov * dup_iov(const struct w_iov * const v,
 }
 
 
+/// Return a w_iov whose data is that of @p v from offset @p off onwards. The
+/// data is not copied; the returned w_iov only references it. The buffer of
+/// the w_iov that holds the data is returned to the pool after it and all
+/// w_iovs referencing it have been freed. The referenced data is read-only.
+///
+/// @param      v     The w_iov to reference.
+/// @param      m     The pkt_meta of @p v.
+/// @param      mref  The pkt_meta of the returned w_iov.
+/// @param      off   Offset into @p v of the referenced data.
+///
+/// @return     The referencing w_iov, or zero if the buffer pool is empty.
+///
+struct w_iov * ref_iov(struct w_iov * const v,
+                       const struct pkt_meta * const m,
+                       struct pkt_meta ** const mref,
+                       const uint16_t off)
+{
+    struct w_iov * const vref = alloc_iov(v->w, v->wv_af, 0, 0, mref);
+    if (unlikely(vref == 0))
+        return 0;
+
+    // v may itself reference the data of another w_iov
+    const uint32_t base = m->rx_base ? m->rx_base : (uint32_t)w_iov_idx(v) + 1;
+    struct pkt_meta * const mb = &meta(w_iov(v->w, base - 1));
+    // on the first reference, also count the w_iov holding the data
+    mb->rx_refs += mb->rx_refs ? 1 : 2;
+    (*mref)->rx_base = base;
+
+    vref->buf = v->buf + off;
+    vref->len = v->len - off;
+    memcpy(&vref->saddr, &v->saddr, sizeof(v->saddr));
+    vref->flags = v->flags;
+    vref->ttl = v->ttl;
+    return vref;
+}
+
+
 void q_alloc(struct w_engine * const w,
              struct w_iov_sq * const q,
              const struct q_conn * const c,
@@ -190,7 +331,16 @@ void q_alloc(struct w_engine * const w,
              const size_t len)
 {
     ensure(len <= UINT32_MAX, "len %zu too long", len);
-    alloc_off(w, q, c, af, (uint32_t)len, DATA_OFFSET);
+
+    // don't dip into the buffer reserve; the caller sees the short allocation
+    const uint_t pld = (c && c->rec.max_pkt_size ? c->rec.max_pkt_size
+                                                 : default_max_pkt_len(af)) -
+                       AEAD_LEN - DATA_OFFSET;
+    const uint_t max = app_bufs_left(w) * pld;
+    if (unlikely(len > max))
+        warn(WRN, "buffer pool low, allocating only %" PRIu " of %zu bytes",
+             max, len);
+    alloc_off(w, q, c, af, (uint32_t)MIN(len, max), DATA_OFFSET);
 }
 
 
@@ -268,7 +418,9 @@ struct q_conn * q_connect(struct w_engine * const w,
          plural(early_data ? w_iov_sq_len(early_data) : 0));
 
     restart_idle_alarm(c);
-    w_connect(c->sock, peer);
+    if (c->holds_sock)
+        // shared client sockets stay unconnected
+        w_connect(c->sock, peer);
 
     // start TLS handshake
     tls_io(c->cstrms[ep_init], 0);
@@ -316,11 +468,9 @@ struct q_conn * q_connect(struct w_engine * const w,
 }
 
 
-bool q_write(struct q_stream * const s,
-             struct w_iov_sq * const q,
-             const bool fin)
+static bool __attribute__((nonnull)) can_write(const struct q_stream * const s)
 {
-    struct q_conn * const c = s->c;
+    const struct q_conn * const c = s->c;
     if (unlikely(c->state == conn_qlse || c->state == conn_drng ||
                  c->state == conn_clsd)) {
         warn(ERR, "%s conn %s is in state %s, can't write", conn_type(c),
@@ -333,8 +483,99 @@ bool q_write(struct q_stream * const s,
              conn_type(c), cid_str(c->scid), s->id, strm_state_str[s->state]);
         return false;
     }
+    return true;
+}
+
+
+/// Queue a reference to shared payload @p sh on stream @p s.
+///
+/// @param      s     Stream.
+/// @param      sh    Shared payload.
+/// @param[in]  fin   Whether to send a FIN after the payload.
+///
+static void __attribute__((nonnull))
+add_ref(struct q_stream * const s, struct q_shared * const sh, const bool fin)
+{
+    struct strm_ref * const r = calloc(1, sizeof(*r));
+    ensure(r, "could not calloc");
+    r->sh = sh;
+    r->v = sq_first(&sh->data);
+    r->left = sh->len;
+    r->fin = fin;
+    sh->refs++;
+    sq_insert_tail(&s->out_refs, r, next);
+}
+
+
+/// Replace any RX buffers in @p q that share their packet with other w_iovs
+/// (see ref_iov()) by copies. TX writes headers in front of and a tag behind
+/// the data, which would clobber the other frames of the packet.
+///
+/// @param      c     Connection.
+/// @param      q     Buffers to be written.
+///
+/// @return     True on success, false if the buffer pool ran dry. @p q then
+///             still holds all data, some of it possibly already copied.
+///
+static bool __attribute__((nonnull))
+copy_rx_refs(struct q_conn * const c, struct w_iov_sq * const q)
+{
+    struct w_iov_sq cpy = w_iov_sq_initializer(cpy);
+    while (!sq_empty(q)) {
+        struct w_iov * v = sq_first(q);
+        sq_remove_head(q, next);
+        sq_next(v, next) = 0;
+        struct pkt_meta * const m = &meta(v);
+        if (unlikely(m->rx_base || m->rx_refs)) {
+            struct pkt_meta * mc;
+            struct w_iov * const vc =
+                alloc_iov(c->w, q_conn_af(c), v->len, DATA_OFFSET, &mc);
+            if (unlikely(vc == 0)) {
+                // put everything back in order
+                sq_insert_head(q, v, next);
+                sq_concat(&cpy, q);
+                sq_concat(q, &cpy);
+                return false;
+            }
+            memcpy(vc->buf, v->buf, v->len);
+            free_iov(v, m);
+            v = vc;
+        }
+        sq_insert_tail(&cpy, v, next);
+    }
+    sq_concat(q, &cpy);
+    return true;
+}
+
+
+bool q_write(struct q_stream * const s,
+             struct w_iov_sq * const q,
+             const bool fin)
+{
+    struct q_conn * const c = s->c;
+    if (unlikely(can_write(s) == false))
+        return false;
+
+    warn(WRN,
+         "writing %" PRIu " byte%s %sin %" PRIu
+         " buf%s on %s conn %s strm " FMT_SID,
+         w_iov_sq_len(q), plural(w_iov_sq_len(q)), fin ? "(and FIN) " : "",
+         w_iov_sq_cnt(q), plural(w_iov_sq_cnt(q)), conn_type(c),
+         cid_str(c->scid), s->id);
+
+    if (unlikely(!sq_empty(&s->out_refs))) {
+        // keep stream order, by queueing the data behind the pending shared
+        // data, from where fill_out() copies it into packets in turn
+        struct q_shared * const sh = q_shared_new(q);
+        add_ref(s, sh, fin);
+        // the stream holds the only reference
+        shared_unref(sh);
+        goto done;
+    }
 
     // add to stream
+    if (unlikely(copy_rx_refs(c, q) == false))
+        return false;
     if (fin) {
         if (sq_empty(q)) {
             alloc_off(c->w, q, s->c, q_conn_af(s->c), 1, DATA_OFFSET);
@@ -345,22 +586,125 @@ bool q_write(struct q_stream * const s,
         }
         mark_fin(q);
     }
+    concat_out(s, q);
+
+done:
+    // kick TX watcher
+    timeouts_add(ped(c->w)->wheel, &c->tx_w, 0);
+    return true;
+}
+
 
+struct q_shared * q_shared_new(struct w_iov_sq * const q)
+{
+    struct q_shared * const sh = calloc(1, sizeof(*sh));
+    ensure(sh, "could not calloc");
+    sq_init(&sh->data);
+    sq_concat(&sh->data, q);
+    sh->len = w_iov_sq_len(&sh->data);
+    sh->refs = 1;
+    return sh;
+}
+
+
+struct q_shared * q_shared_new_buf(uint8_t * const buf, const size_t len)
+{
+    struct q_shared * const sh = calloc(1, sizeof(*sh));
+    ensure(sh, "could not calloc");
+    sq_init(&sh->data);
+    sh->buf = buf;
+    sh->len = (uint_t)len;
+    sh->refs = 1;
+    return sh;
+}
+
+
+void q_shared_free(struct q_shared * const sh)
+{
+    shared_unref(sh);
+}
+
+
+bool q_write_shared(struct q_stream * const s,
+                    struct q_shared * const sh,
+                    const bool fin)
+{
+    if (unlikely(can_write(s) == false))
+        return false;
+
+    add_ref(s, sh, fin);
+
+    struct q_conn * const c = s->c;
     warn(WRN,
-         "writing %" PRIu " byte%s %sin %" PRIu
-         " buf%s on %s conn %s strm " FMT_SID,
-         w_iov_sq_len(q), plural(w_iov_sq_len(q)), fin ? "(and FIN) " : "",
-         w_iov_sq_cnt(q), plural(w_iov_sq_cnt(q)), conn_type(c),
+         "writing %" PRIu " shared byte%s %son %s conn %s strm " FMT_SID,
+         sh->len, plural(sh->len), fin ? "(and FIN) " : "", conn_type(c),
          cid_str(c->scid), s->id);
 
-    concat_out(s, q);
-
     // kick TX watcher
     timeouts_add(ped(c->w)->wheel, &c->tx_w, 0);
     return true;
 }
 
 
+// Like q_write(), but only enqueue as much of q as fits into the stream and
+// connection send buffers. Returns false and leaves the rest in q if not
+// everything fit; a Q_EV_WRITABLE event signals when to try again.
+bool q_write_some(struct q_stream * const s,
+                  struct w_iov_sq * const q,
+                  const bool fin)
+{
+    if (unlikely(can_write(s) == false))
+        return false;
+
+    if (likely(w_iov_sq_len(q) <= out_room(s)))
+        return q_write(s, q, fin);
+
+    // move the buffers that fit into the send buffers to their own queue
+    struct q_conn * const c = s->c;
+    struct w_iov_sq fits = w_iov_sq_initializer(fits);
+    uint_t s_out = s->out_unacked;
+    uint_t c_out = c->out_unacked;
+    while (!sq_empty(q)) {
+        struct w_iov * const v = sq_first(q);
+        const bool s_ok = c->max_strm_out == 0 || s_out == 0 ||
+                          s_out + v->len <= c->max_strm_out;
+        const bool c_ok =
+            c->max_out == 0 || c_out == 0 || c_out + v->len <= c->max_out;
+        if (s_ok == false || c_ok == false)
+            break;
+        sq_remove_head(q, next);
+        sq_next(v, next) = 0;
+        sq_insert_tail(&fits, v, next);
+        s_out += v->len;
+        c_out += v->len;
+    }
+
+    if (sq_empty(&fits) == false &&
+        unlikely(q_write(s, &fits, fin && sq_empty(q)) == false)) {
+        // nothing was written, so hand all buffers back in order
+        sq_concat(&fits, q);
+        sq_concat(q, &fits);
+        return false;
+    }
+
+    if (sq_empty(q))
+        return true;
+
+    // the app needs to wait for Q_EV_WRITABLE before writing the rest
+    warn(INF,
+         "send buffer full, %" PRIu " byte%s left unwritten on %s conn %s "
+         "strm " FMT_SID,
+         w_iov_sq_len(q), plural(w_iov_sq_len(q)), conn_type(c),
+         cid_str(c->scid), s->id);
+    const uint_t len = sq_first(q)->len;
+    if (c->max_strm_out && s->out_unacked + len > c->max_strm_out)
+        s->out_full = true;
+    if (c->max_out && c->out_unacked + len > c->max_out)
+        c->out_full = true;
+    return false;
+}
+
+
 struct q_stream *
 q_read(struct q_conn * const c, struct w_iov_sq * const q, const bool all)
 {
@@ -587,10 +931,14 @@ struct w_engine * q_init(const char * const ifname,
     ensure(w->data, "could not calloc");
     ped(w)->scratch_len = w->mtu;
 
-    ped(w)->pkt_meta = calloc(num_bufs, sizeof(*ped(w)->pkt_meta));
-    ensure(ped(w)->pkt_meta, "could not calloc");
+    const bool huge = conf && conf->use_hugepages;
+    ped(w)->pkt_meta = alloc_meta(num_bufs * sizeof(*ped(w)->pkt_meta), huge);
     ASAN_POISON_MEMORY_REGION(ped(w)->pkt_meta,
                               num_bufs * sizeof(*ped(w)->pkt_meta));
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        advise_bufs(w);
+#endif
 
     if (conf)
         memcpy(&ped(w)->conf, conf, sizeof(*conf));
@@ -603,6 +951,18 @@ struct w_engine * q_init(const char * const ifname,
             MIN(ped(w)->conf.server_cid_len, CID_LEN_MAX);
     else
         ped(w)->conf.server_cid_len = 4; // could be another value
+    if (ped(w)->conf.clnt_socks) {
+#ifndef NO_MIGRATION
+        if (ped(w)->conf.client_cid_len == 0) {
+            // shared sockets demux by CID, so zero-len CIDs can't work
+            warn(WRN, "shared client sockets need CIDs, using 4-byte CIDs");
+            ped(w)->conf.client_cid_len = 4;
+        }
+#else
+        warn(WRN, "shared client sockets need NO_MIGRATION to be unset");
+        ped(w)->conf.clnt_socks = 0;
+#endif
+    }
 
     ped(w)->default_conn_conf =
         (struct q_conn_conf){.idle_timeout = 10,
@@ -626,6 +986,10 @@ struct w_engine * q_init(const char * const ifname,
             get_conf_uncond(w, conf->conn_conf, idle_timeout);
         ped(w)->default_conn_conf.tls_key_update_frequency =
             get_conf(w, conf->conn_conf, tls_key_update_frequency);
+        ped(w)->default_conn_conf.max_strm_out =
+            get_conf(w, conf->conn_conf, max_strm_out);
+        ped(w)->default_conn_conf.max_conn_out =
+            get_conf(w, conf->conn_conf, max_conn_out);
         ped(w)->default_conn_conf.enable_spinbit =
             get_conf_uncond(w, conf->conn_conf, enable_spinbit);
         ped(w)->default_conn_conf.enable_udp_zero_checksums =
@@ -793,34 +1157,35 @@ done:
     } while (0)
 #endif
 
+        const struct q_conn_info * const ci = &c->i;
         qinfo_log("%s conn %s stats:", conn_type(c), cid_str(c->scid));
         qinfo_log("pkts_in_valid = %s%" PRIu NRM,
-                  c->i.pkts_in_valid ? NRM : BLD RED, c->i.pkts_in_valid);
+                  ci->pkts_in_valid ? NRM : BLD RED, ci->pkts_in_valid);
         qinfo_log("pkts_in_invalid = %s%" PRIu NRM,
-                  c->i.pkts_in_invalid ? BLD RED : NRM, c->i.pkts_in_invalid);
-        qinfo_log("pkts_out = %" PRIu, c->i.pkts_out);
-        qinfo_log("pkts_out_lost = %" PRIu, c->i.pkts_out_lost);
-        qinfo_log("pkts_out_rtx = %" PRIu, c->i.pkts_out_rtx);
+                  ci->pkts_in_invalid ? BLD RED : NRM, ci->pkts_in_invalid);
+        qinfo_log("pkts_out = %" PRIu, ci->pkts_out);
+        qinfo_log("dgrams_out = %" PRIu, ci->dgrams_out);
+        qinfo_log("pkts_out_lost = %" PRIu, ci->pkts_out_lost);
+        qinfo_log("pkts_out_rtx = %" PRIu, ci->pkts_out_rtx);
         qinfo_log("rtt = %.3f (min = %.3f, max = %.3f, var = %.3f)",
-                  (double)c->i.rtt, (double)c->i.min_rtt, (double)c->i.max_rtt,
-                  (double)c->i.rttvar);
-        qinfo_log("cwnd = %" PRIu " (max = %" PRIu ")", c->i.cwnd,
-                  c->i.max_cwnd);
+                  (double)ci->rtt, (double)ci->min_rtt, (double)ci->max_rtt,
+                  (double)ci->rttvar);
+        qinfo_log("cwnd = %" PRIu " (max = %" PRIu ")", ci->cwnd, ci->max_cwnd);
         qinfo_log("ssthresh = %" PRIu,
-                  c->i.ssthresh == UINT_T_MAX ? 0 : c->i.ssthresh);
-        qinfo_log("pto_cnt = %" PRIu, c->i.pto_cnt);
+                  ci->ssthresh == UINT_T_MAX ? 0 : ci->ssthresh);
+        qinfo_log("pto_cnt = %" PRIu, ci->pto_cnt);
         qinfo_log("%-22s %s %10s %10s", "frame", "code", "out", "in");
         for (size_t i = 0;
-             i < sizeof(c->i.frm_cnt[0]) / sizeof(c->i.frm_cnt[0][0]); i++) {
-            if (c->i.frm_cnt[0][i] || c->i.frm_cnt[1][i])
+             i < sizeof(ci->frm_cnt[0]) / sizeof(ci->frm_cnt[0][0]); i++) {
+            if (ci->frm_cnt[0][i] || ci->frm_cnt[1][i])
                 qinfo_log("%-22s 0x%02lx %10" PRIu " %10" PRIu, frm_typ_str[i],
-                          (unsigned long)i, c->i.frm_cnt[0][i],
-                          c->i.frm_cnt[1][i]);
+                          (unsigned long)i, ci->frm_cnt[0][i],
+                          ci->frm_cnt[1][i]);
         }
-        qinfo_log("strm_frms_in_seq = %" PRIu, c->i.strm_frms_in_seq);
-        qinfo_log("strm_frms_in_ooo = %" PRIu, c->i.strm_frms_in_ooo);
-        qinfo_log("strm_frms_in_dup = %" PRIu, c->i.strm_frms_in_dup);
-        qinfo_log("strm_frms_in_ign = %" PRIu, c->i.strm_frms_in_ign);
+        qinfo_log("strm_frms_in_seq = %" PRIu, ci->strm_frms_in_seq);
+        qinfo_log("strm_frms_in_ooo = %" PRIu, ci->strm_frms_in_ooo);
+        qinfo_log("strm_frms_in_dup = %" PRIu, ci->strm_frms_in_dup);
+        qinfo_log("strm_frms_in_ign = %" PRIu, ci->strm_frms_in_ign);
     }
 #endif
 
@@ -857,6 +1222,18 @@ void q_cleanup(struct w_engine * const w)
         q_close(c, 0, 0);
 #endif
 
+#ifndef NO_MIGRATION
+    // close the shared client sockets
+    for (size_t i = 0; i < kv_size(ped(w)->clnt_socks); i++) {
+#ifndef NO_NETSIM
+        if (unlikely(netsim_on))
+            netsim_close(kv_A(ped(w)->clnt_socks, i));
+#endif
+        w_close(kv_A(ped(w)->clnt_socks, i));
+    }
+    kv_destroy(ped(w)->clnt_socks);
+#endif
+
     // stop the event loop
     timeouts_close(ped(w)->wheel);
 
@@ -894,7 +1271,9 @@ void q_cleanup(struct w_engine * const w)
 #endif
 
     free_tls_ctx(ped(w));
-    free(ped(w)->pkt_meta);
+    free_meta(ped(w)->pkt_meta,
+              ped(w)->conf.num_bufs * sizeof(*ped(w)->pkt_meta),
+              ped(w)->conf.use_hugepages);
     free(w->data);
     w_cleanup(w);
 
@@ -1009,6 +1388,44 @@ done:
 }
 
 
+// Events are coalesced per stream and connection, and returned grouped by
+// connection, with connection events first. Stream events pending when a
+// connection closes are dropped, so they never refer to freed streams.
+uint32_t q_poll(struct w_engine * const w,
+                struct q_event * const ev,
+                const uint32_t n,
+                const uint64_t nsec)
+{
+    if (sq_empty(&c_ev)) {
+        if (nsec)
+            restart_api_alarm(w, nsec);
+        loop_run(w, (func_ptr)q_poll, 0, 0);
+    }
+
+    uint32_t i = 0;
+    while (i < n && !sq_empty(&c_ev)) {
+        struct q_conn * const c = sq_first(&c_ev);
+        if (c->ev) {
+            ev[i++] = (struct q_event){.c = c, .ev = c->ev};
+            c->ev = 0;
+        }
+
+        while (i < n && !sq_empty(&c->ev_strms)) {
+            struct q_stream * const s = sq_first(&c->ev_strms);
+            sq_remove_head(&c->ev_strms, node_ev);
+            ev[i++] = (struct q_event){.c = c, .s = s, .ev = s->ev};
+            s->ev = 0;
+        }
+
+        if (sq_empty(&c->ev_strms)) {
+            sq_remove_head(&c_ev, node_ev);
+            c->in_c_ev = false;
+        }
+    }
+    return i;
+}
+
+
 bool q_is_new_serv_conn(const struct q_conn * const c
 #ifdef NO_SERVER
                         __attribute__((unused))
@@ -1062,15 +1479,16 @@ void q_migrate(struct q_conn * const c,
             idx = other_idx;
             if (alt_peer) {
                 w_to_waddr(&c->peer.addr, alt_peer);
-            } else if ((c->w->ifaddr[other_idx].addr.af == AF_INET &&
-                        memcmp(&c->tp_peer.pref_addr.addr4.addr.ip4,
-                               &(char[IP4_LEN]){0}, IP4_LEN) != 0) ||
-                       (c->w->ifaddr[other_idx].addr.af == AF_INET6 &&
-                        memcmp(&c->tp_peer.pref_addr.addr6.addr.ip4,
-                               &(char[IP6_LEN]){0}, IP6_LEN) != 0)) {
+            } else if (c->pref_addr &&
+                       ((c->w->ifaddr[other_idx].addr.af == AF_INET &&
+                         memcmp(&c->pref_addr->addr4.addr.ip4,
+                                &(char[IP4_LEN]){0}, IP4_LEN) != 0) ||
+                        (c->w->ifaddr[other_idx].addr.af == AF_INET6 &&
+                         memcmp(&c->pref_addr->addr6.addr.ip4,
+                                &(char[IP6_LEN]){0}, IP6_LEN) != 0))) {
                 c->peer = c->w->ifaddr[other_idx].addr.af == AF_INET
-                              ? c->tp_peer.pref_addr.addr4
-                              : c->tp_peer.pref_addr.addr6;
+                              ? c->pref_addr->addr4
+                              : c->pref_addr->addr6;
             } else
                 goto fail;
         }
@@ -1092,9 +1510,18 @@ void q_migrate(struct q_conn * const c,
         return;
     }
 
-    // close the current w_sock
-    w_close(c->sock);
+    // close the current w_sock, unless it is shared with other conns
+#ifndef NO_NETSIM
+    if (unlikely(netsim_on)) {
+        if (c->holds_sock)
+            netsim_close(c->sock);
+        netsim_bind(new_sock);
+    }
+#endif
+    if (c->holds_sock)
+        w_close(c->sock);
     c->sock = new_sock;
+    c->holds_sock = true;
 
     struct sockaddr_storage ss = {.ss_family = c->peer.addr.af};
     if (c->peer.addr.af == AF_INET) {
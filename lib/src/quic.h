@@ -46,8 +46,11 @@
 #include "frame.h"
 #include "tree.h" // IWYU pragma: keep
 
-#ifndef NO_SERVER
+#if !defined(NO_SERVER) || !defined(NO_MIGRATION)
 #include "kvec.h"
+#endif
+
+#ifndef NO_SERVER
 #include "tls.h"
 #endif
 
@@ -68,6 +71,12 @@ struct q_conn; // IWYU pragma: no_forward_declare q_conn
 #define AEAD_LEN 16
 #define RIT_LEN 16 ///< Length of Retry integrity tag.
 
+/// Maximum length of the tokens we generate: key ID, type, nonce, timestamp,
+/// original DCID and AEAD tag.
+#define RTRY_TOK_LEN_MAX                                                       \
+    (sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t) + \
+     CID_LEN_MAX + AEAD_LEN)
+
 // Maximum reordering in packets before packet threshold loss detection
 // considers a packet lost. The RECOMMENDED value is 3.
 #define kPacketThreshold 3
@@ -153,6 +162,9 @@ struct pkt_meta {
     sl_entry(pkt_meta) rtx_next;
     sl_head(pm_sl, pkt_meta) rtx; ///< List of pkt_meta structs of previous TXs.
 
+    uint32_t rx_base; ///< On RX, 1 + index of the w_iov holding our data.
+    uint32_t rx_refs; ///< On RX, w_iovs referencing our data (incl. us).
+
     // pm_cpy(true) starts copying from here:
     struct frames frms;     ///< Frames present in pkt.
     struct q_stream * strm; ///< Stream this data was written on.
@@ -192,8 +204,40 @@ struct pkt_meta {
     uint8_t lost : 1;  ///< Have we marked this packet as lost?
     uint8_t txed : 1;  ///< Did we TX this pkt?
 
-    uint8_t _unused2[5];
+    uint8_t is_shared : 1; ///< Data was copied from a shared payload.
+    uint8_t is_pmtud : 1;  ///< This pkt is a DPLPMTUD probe.
+    uint8_t : 6;
+
+    uint8_t _unused2[4];
+};
+
+
+#ifndef NO_SERVER
+#define TCKT_KEYS 3 ///< Number of session ticket keys accepted for decryption.
+
+
+/// A session ticket encryption key. The key ID is included in each ticket.
+///
+struct tckt_key {
+    struct cipher_ctx enc; ///< Ticket encryption context.
+    struct cipher_ctx dec; ///< Ticket decryption context.
+    uint64_t t;            ///< Creation time, in seconds since the epoch.
+    uint32_t id;           ///< Key ID.
+    uint8_t _unused[4];
+};
+
+
+/// Session ticket statistics, to judge resumption and 0-RTT hit rates.
+///
+struct tckt_stats {
+    uint_t hshks;     ///< Server handshakes started.
+    uint_t issued;    ///< Tickets issued.
+    uint_t presented; ///< Tickets presented by clients.
+    uint_t resumed;   ///< Tickets successfully decrypted (resumptions).
+    uint_t unk_key;   ///< Tickets with a key ID not (or no longer) known.
+    uint_t zero_rtt;  ///< Handshakes that accepted 0-RTT data.
 };
+#endif
 
 
 struct per_engine_data {
@@ -209,6 +253,10 @@ struct per_engine_data {
 
     ptls_context_t tls_ctx;
     ptls_aead_context_t * rid_ctx;
+    ptls_aead_context_t * tok_enc;    ///< Current token key.
+    ptls_aead_context_t * tok_dec[2]; ///< Current and previous token keys.
+    uint64_t tok_rot; ///< Time of next token key rotation (epoch seconds).
+    uint8_t tok_secret[PTLS_SHA256_DIGEST_SIZE]; ///< Token keys derive from it.
 
 #ifdef WITH_OPENSSL
     ptls_openssl_sign_certificate_t sign_cert;
@@ -216,16 +264,34 @@ struct per_engine_data {
 #endif
 
 #ifndef NO_SERVER
-    struct cipher_ctx dec_tckt;
-    struct cipher_ctx enc_tckt;
+    struct tckt_key tckt[TCKT_KEYS]; ///< Ticket key ring, newest key first.
+    uint64_t tckt_rot;  ///< Time of next ticket key rotation (epoch seconds).
+    uint64_t tckt_load; ///< Time the ticket key file was last read.
+    struct tckt_stats tckt_stats;
     kvec_t(struct w_sock *) serv_socks;
+
+    uint_t half_open; ///< Server connections still in the handshake.
+    uint_t ini_cnt;   ///< New server connections in current rate interval.
+    uint_t ini_rate;  ///< New server connections per second.
+    uint64_t ini_t;   ///< Start of current rate interval.
+    uint64_t rtry_t;  ///< Time a Retry was last sent.
 #endif
 
 #ifdef NO_MIGRATION
     sl_head(conn_head, q_conn) conns;
+#else
+    kvec_t(struct w_sock *) clnt_socks; ///< Client sockets shared by conns.
+    uint_t clnt_socks_rr;               ///< Round-robin index into clnt_socks.
 #endif
 
-    uint8_t _unused2[4];
+    uint8_t tok_kid; ///< ID of the current token key.
+#ifndef NO_SERVER
+    uint8_t rtry_on : 1; ///< Is adaptive Retry engaged?
+    uint8_t : 7;
+#else
+    uint8_t _unused_rtry_on;
+#endif
+    uint8_t _unused2[2];
     uint32_t scratch_len;
     uint8_t scratch[]; // packet-sized scratch space to avoid stack alloc
 };
@@ -267,6 +333,13 @@ dup_iov(const struct w_iov * const v,
         const uint16_t off);
 
 
+extern struct w_iov * __attribute__((nonnull))
+ref_iov(struct w_iov * const v,
+        const struct pkt_meta * const m,
+        struct pkt_meta ** const mref,
+        const uint16_t off);
+
+
 #if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
 extern int corpus_pkt_dir, corpus_frm_dir;
 
@@ -285,6 +358,35 @@ write_to_corpus(const int dir, const void * const data, const size_t len);
 #define is_set(f, v) (((v) & (f)) == (f))
 
 
+#define HUGE_PAGE_LEN ((size_t)2 * 1024 * 1024)
+
+
+extern void * alloc_meta(const size_t len, const bool huge);
+
+extern void free_meta(void * const p, const size_t len, const bool huge);
+
+
+/// Fraction of the buffer pool that is reserved for ACKs, retransmissions and
+/// packet encryption, i.e., that the application cannot allocate.
+#define BUF_RSV_DIV 16
+
+
+/// Return the number of buffers the application can still allocate without
+/// cutting into the reserve for ACKs, retransmissions and packet encryption.
+///
+/// @param      w     Warpcore engine.
+///
+/// @return     Number of buffers.
+///
+static inline uint_t __attribute__((nonnull))
+app_bufs_left(struct w_engine * const w)
+{
+    const uint_t bufs_free = w_iov_sq_cnt(&w->iov);
+    const uint_t rsv = ped(w)->conf.num_bufs / BUF_RSV_DIV;
+    return bufs_free > rsv ? bufs_free - rsv : 0;
+}
+
+
 /// Return the pkt_meta entry for a given w_iov.
 ///
 /// @param      v     Pointer to a w_iov.
@@ -258,6 +258,64 @@ static void remove_from_in_flight(const struct pkt_meta * const m)
 }
 
 
+/// DPLPMTUD reaction to the loss of @p m: after #PMTUD_MAX_PROBES lost probes
+/// of a size, that size is considered too large. After #PMTUD_BH_LOSSES lost
+/// pkts larger than the base size without any of them getting ACK'ed, the path
+/// is assumed to black-hole them, so fall back to the base size and restart the
+/// search.
+///
+/// @param      c     Connection.
+/// @param      m     Lost packet.
+///
+static void __attribute__((nonnull))
+on_pmtud_lost(struct q_conn * const c, const struct pkt_meta * const m)
+{
+    struct recovery * const r = &c->rec;
+    if (unlikely(m->is_pmtud)) {
+        r->pmtud_probe = 0;
+        if (++r->pmtud_fail < PMTUD_MAX_PROBES)
+            return;
+        warn(NTE, "PMTU probe of %u bytes failed %u times", m->udp_len,
+             r->pmtud_fail);
+        r->pmtud_hi = m->udp_len;
+        r->pmtud_fail = 0;
+        return;
+    }
+
+    const uint16_t base = default_max_pkt_len(c->sock->ws_af);
+    if (likely(m->udp_len <= base) || ++r->pmtud_bh < PMTUD_BH_LOSSES)
+        return;
+
+    warn(NTE, RED "lost %u pkts > %u bytes, PMTU black hole? using %u" NRM,
+         r->pmtud_bh, base, base);
+    r->max_pkt_size = r->pmtud_lo = base;
+    r->pmtud_hi = 0;
+    r->pmtud_bh = 0;
+    r->pmtud_raise_t = 0;
+}
+
+
+/// DPLPMTUD reaction to the ACK of @p m: an ACK'ed probe validates its size,
+/// and any ACK'ed large pkt shows that the path does not black-hole them.
+///
+/// @param      c     Connection.
+/// @param      m     ACK'ed packet.
+///
+static void __attribute__((nonnull))
+on_pmtud_acked(struct q_conn * const c, const struct pkt_meta * const m)
+{
+    struct recovery * const r = &c->rec;
+    if (unlikely(m->is_pmtud)) {
+        r->max_pkt_size = r->pmtud_lo = m->udp_len;
+        r->pmtud_probe = 0;
+        r->pmtud_fail = 0;
+        warn(NTE, "PMTU %u validated", r->max_pkt_size);
+    }
+    if (m->udp_len > default_max_pkt_len(c->sock->ws_af))
+        r->pmtud_bh = 0;
+}
+
+
 void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
 {
     struct pn_space * const pn = m->pn;
@@ -268,12 +326,16 @@ void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
 
     // rest of function is not from pseudo code
 
-    if (unlikely(c->pmtud_pkt != UINT16_MAX &&
-                 m->hdr.nr == (c->pmtud_pkt & 0x3fff) &&
-                 m->hdr.type == (c->pmtud_pkt >> 14))) {
-        c->rec.max_pkt_size = default_max_pkt_len(c->sock->ws_af);
-        warn(NTE, RED "PMTU %u not validated, using %u" NRM,
-             MIN(w_max_udp_payload(c->sock), (uint16_t)c->tp_peer.max_pkt),
+    const bool hshk_probe = c->pmtud_pkt != UINT16_MAX &&
+                            m->hdr.nr == (c->pmtud_pkt & 0x3fff) &&
+                            m->hdr.type == (c->pmtud_pkt >> 14);
+    if (unlikely(hshk_probe)) {
+        // the handshake probe was lost, search below its size after that
+        c->rec.pmtud_hi =
+            MIN(w_max_udp_payload(c->sock), (uint16_t)c->tp_peer.max_pkt);
+        c->rec.max_pkt_size = c->rec.pmtud_lo =
+            default_max_pkt_len(c->sock->ws_af);
+        warn(NTE, RED "PMTU %u not validated, using %u" NRM, c->rec.pmtud_hi,
              c->rec.max_pkt_size);
         c->pmtud_pkt = UINT16_MAX;
     }
@@ -284,6 +346,10 @@ void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
     if (is_lost == false)
         return;
 
+    // only actual losses count against a PMTU, not pkts that are just freed
+    if (likely(hshk_probe == false))
+        on_pmtud_lost(c, m);
+
     // if we lost connection or stream control frames, possibly RTX them
     qlog_recovery(rec_pl, "unknown", c, m);
 
@@ -393,7 +459,8 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
         if (m->t <= lost_send_t ||
             pn->lg_acked >= m->hdr.nr + kPacketThreshold) {
             m->lost = true;
-            in_flight_lost |= m->in_flight;
+            // lost DPLPMTUD probes are no congestion signal
+            in_flight_lost |= m->in_flight && m->is_pmtud == false;
             incr_out_lost;
             if (unlikely(lg_lost == UINT_T_MAX) || m->hdr.nr > lg_lost) {
                 lg_lost = m->hdr.nr;
@@ -590,8 +657,9 @@ update_rtt(struct q_conn * const c, uint_t ack_del)
 
 #ifndef NO_QINFO
     const float latest_rtt = c->rec.cur.latest_rtt / (float)US_PER_S;
-    c->i.min_rtt = MIN(c->i.min_rtt, latest_rtt);
-    c->i.max_rtt = MAX(c->i.max_rtt, latest_rtt);
+    struct q_conn_info * const ci = &c->i;
+    ci->min_rtt = MIN(ci->min_rtt, latest_rtt);
+    ci->max_rtt = MAX(ci->max_rtt, latest_rtt);
 #endif
 }
 
@@ -643,7 +711,8 @@ on_pkt_acked_cc(const struct pkt_meta * const m)
             (c->rec.max_pkt_size * (uint_t)m->udp_len) / c->rec.cur.cwnd;
 
 #ifndef NO_QINFO
-    c->i.max_cwnd = MAX(c->i.max_cwnd, c->rec.cur.cwnd);
+    struct q_conn_info * const ci = &c->i;
+    ci->max_cwnd = MAX(ci->max_cwnd, c->rec.cur.cwnd);
 #endif
 }
 
@@ -668,6 +737,8 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
                  m->hdr.nr == (c->pmtud_pkt & 0x3fff) &&
                  m->hdr.type == (c->pmtud_pkt >> 14)))
         validate_pmtu(c);
+    else
+        on_pmtud_acked(c, m);
 
     // stop ACK'ing packets contained in the ACK frame of this packet
     if (has_frm(m->frms, FRM_ACK))
@@ -710,14 +781,20 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
 
     struct q_stream * const s = m->strm;
     if (s && m->has_rtx == false) {
+        // m may be freed below, if it is a copy of shared data
+        const bool is_fin = m->is_fin;
+
         // if this ACKs its stream's out_una, move that forward
         struct w_iov * tmp;
         sq_foreach_from_safe (s->out_una, &s->out, next, tmp) {
             struct pkt_meta * const mou = &meta(s->out_una);
             if (mou->acked == false)
                 break;
-            // if this ACKs a crypto packet, we can free it
-            if (unlikely(s->id < 0 && mou->lost == false)) {
+            if (likely(s->id >= 0))
+                track_bytes_acked(s, mou->strm_data_len);
+            // if this ACKs a crypto packet or a copy of shared data, we can
+            // free it
+            if (unlikely((s->id < 0 || mou->is_shared) && mou->lost == false)) {
                 sq_remove(&s->out, s->out_una, w_iov, next);
                 sq_next(s->out_una, next) = 0;
                 free_iov(s->out_una, mou);
@@ -725,7 +802,7 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
         }
 
         if (s->id >= 0 && s->out_una == 0) {
-            if (unlikely(m->is_fin || c->did_0rtt)) {
+            if (unlikely(is_fin || c->did_0rtt)) {
                 // this ACKs a FIN
                 c->have_new_data = true;
                 strm_to_state(s, s->state == strm_hcrm ? strm_clsd : strm_hclo);
@@ -739,11 +816,49 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
 }
 
 
+/// Returns the size of the DPLPMTUD probe to send next. This binary-searches
+/// between the largest validated and the smallest failed size, until they are
+/// within #PMTUD_STEP bytes. The search restarts upwards every
+/// #PMTUD_RAISE_INTVL seconds, in case the path MTU has grown.
+///
+/// @param      c     Connection.
+///
+/// @return     Probe size, or zero if no probe should be sent now.
+///
+uint16_t pmtud_probe_size(struct q_conn * const c)
+{
+    struct recovery * const r = &c->rec;
+    if (r->pmtud_probe || c->pmtud_pkt != UINT16_MAX)
+        // a probe is outstanding
+        return 0;
+
+    const uint16_t max =
+        MIN(w_max_udp_payload(c->sock), (uint16_t)c->tp_peer.max_pkt);
+    if (r->pmtud_hi == 0 || r->pmtud_hi > max + 1)
+        r->pmtud_hi = (uint16_t)(max + 1);
+
+    if (r->pmtud_hi > r->pmtud_lo + PMTUD_STEP)
+        return (uint16_t)(r->pmtud_lo + (r->pmtud_hi - r->pmtud_lo) / 2);
+
+    const uint32_t now = (uint32_t)(loop_now() / NS_PER_S);
+    if (r->pmtud_raise_t == 0)
+        r->pmtud_raise_t = now + PMTUD_RAISE_INTVL;
+    else if (now >= r->pmtud_raise_t) {
+        r->pmtud_raise_t = 0;
+        r->pmtud_hi = 0;
+    }
+    return 0;
+}
+
+
 void init_rec(struct q_conn * const c)
 {
     timeout_del(&c->rec.ld_alarm);
     c->rec.pto_cnt = 0;
-    c->rec.max_pkt_size = MIN_INI_LEN;
+    c->rec.max_pkt_size = c->rec.pmtud_lo = MIN_INI_LEN;
+    c->rec.pmtud_hi = c->rec.pmtud_probe = 0;
+    c->rec.pmtud_fail = c->rec.pmtud_bh = 0;
+    c->rec.pmtud_raise_t = 0;
     c->rec.cur = (struct cc_state){.cwnd = kInitialWindow(c->rec.max_pkt_size),
                                    .ssthresh = UINT_T_MAX,
                                    .min_rtt = UINT_T_MAX};
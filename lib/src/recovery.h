@@ -41,6 +41,12 @@ struct q_conn;   // IWYU pragma: no_forward_declare q_conn
 // IWYU pragma: no_include "quic.h"
 
 
+#define PMTUD_STEP 16         ///< DPLPMTUD search stops at this granularity.
+#define PMTUD_MAX_PROBES 3    ///< Lost probes before a size counts as failed.
+#define PMTUD_BH_LOSSES 6     ///< Lost large pkts before assuming black hole.
+#define PMTUD_RAISE_INTVL 600 ///< Seconds until re-probing a finished search.
+
+
 struct cc_state {
     // these are kept in usec:
     uint_t latest_rtt; // latest_rtt
@@ -76,9 +82,13 @@ struct recovery {
     uint16_t pto_cnt;      // pto_count
     uint16_t max_pkt_size; // max_datagram_size
 
-#if HAVE_64BIT
-    uint8_t _unused[4];
-#endif
+    // DPLPMTUD state
+    uint16_t pmtud_lo;      ///< Largest validated pkt size.
+    uint16_t pmtud_hi;      ///< Smallest failed size, zero for the path max.
+    uint16_t pmtud_probe;   ///< Size of the outstanding probe, or zero.
+    uint8_t pmtud_fail;     ///< Lost probes at the current probe size.
+    uint8_t pmtud_bh;       ///< Lost large pkts since one was ACK'ed.
+    uint32_t pmtud_raise_t; ///< When to re-probe (sec), zero if unscheduled.
 };
 
 
@@ -90,6 +100,9 @@ extern void __attribute__((nonnull)) log_cc(struct q_conn * const c);
 
 extern void __attribute__((nonnull)) init_rec(struct q_conn * const c);
 
+extern uint16_t __attribute__((nonnull))
+pmtud_probe_size(struct q_conn * const c);
+
 extern void __attribute__((nonnull)) on_pkt_sent(struct pkt_meta * const m);
 
 extern void __attribute__((nonnull))
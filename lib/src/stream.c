@@ -93,11 +93,23 @@ void apply_stream_limits(struct q_stream * const s)
 }
 
 
+static void __attribute__((nonnull)) drop_refs(struct q_stream * const s)
+{
+    while (!sq_empty(&s->out_refs)) {
+        struct strm_ref * const r = sq_first(&s->out_refs);
+        sq_remove_head(&s->out_refs, next);
+        shared_unref(r->sh);
+        free(r);
+    }
+}
+
+
 struct q_stream * new_stream(struct q_conn * const c, const dint_t id)
 {
     struct q_stream * const s = calloc(1, sizeof(*s));
     ensure(s, "could not calloc q_stream");
     sq_init(&s->out);
+    sq_init(&s->out_refs);
     sq_init(&s->in);
     s->c = c;
     s->id = id;
@@ -157,6 +169,11 @@ void free_stream(struct q_stream * const s)
     if (s->in_ctrl)
         sl_remove(&c->need_ctrl, s, q_stream, node_ctrl);
 
+    if (s->ev)
+        sq_remove(&c->ev_strms, s, q_stream, node_ev);
+
+    drop_refs(s);
+    c->out_unacked -= s->out_unacked;
     q_free(&s->out);
     q_free(&s->in);
     free(s);
@@ -181,6 +198,40 @@ void track_bytes_out(struct q_stream * const s, const uint_t n)
 }
 
 
+void track_bytes_acked(struct q_stream * const s, const uint_t n)
+{
+    struct q_conn * const c = s->c;
+    s->out_unacked -= n;
+    c->out_unacked -= n;
+
+    // signal the app once the send buffers have drained to half their limit
+    if (unlikely(s->out_full) && s->out_unacked <= c->max_strm_out / 2) {
+        s->out_full = false;
+        post_ev(c, s, Q_EV_WRITABLE);
+    }
+    if (unlikely(c->out_full) && c->out_unacked <= c->max_out / 2) {
+        c->out_full = false;
+        post_ev(c, 0, Q_EV_WRITABLE);
+    }
+}
+
+
+uint_t out_room(const struct q_stream * const s)
+{
+    const struct q_conn * const c = s->c;
+    uint_t room = UINT_T_MAX;
+    if (c->max_strm_out)
+        room = c->max_strm_out > s->out_unacked
+                   ? c->max_strm_out - s->out_unacked
+                   : 0;
+    if (c->max_out)
+        room = MIN(room, c->max_out > c->out_unacked
+                             ? c->max_out - c->out_unacked
+                             : 0);
+    return room;
+}
+
+
 void reset_stream(struct q_stream * const s, const bool forget)
 {
 #ifdef DEBUG_STREAMS
@@ -192,6 +243,9 @@ void reset_stream(struct q_stream * const s, const bool forget)
     s->lost_cnt = s->in_data_off = s->in_data = s->out_data = 0;
 
     if (forget) {
+        drop_refs(s);
+        s->c->out_unacked -= s->out_unacked;
+        s->out_unacked = 0;
         s->out_una = 0;
         q_free(&s->out);
         q_free(&s->in);
@@ -279,10 +333,172 @@ void concat_out(struct q_stream * const s, struct w_iov_sq * const q)
     if (s->out_una == 0)
         s->out_una = sq_first(q);
 
+    if (likely(s->id >= 0)) {
+        // crypto "streams" don't count
+        struct q_conn * const c = s->c;
+        const uint_t len = w_iov_sq_len(q);
+        s->out_unacked += len;
+        c->out_unacked += len;
+        if (c->max_strm_out && s->out_unacked >= c->max_strm_out)
+            s->out_full = true;
+        if (c->max_out && c->out_unacked >= c->max_out)
+            c->out_full = true;
+    }
+
     sq_concat(&s->out, q);
 }
 
 
+void shared_unref(struct q_shared * const sh)
+{
+    if (--sh->refs)
+        return;
+    q_free(&sh->data);
+    free(sh->buf);
+    free(sh);
+}
+
+
+/// Copy up to @p len bytes of the shared payloads referenced by stream @p s
+/// into freshly allocated packet buffers, and append those to the stream.
+///
+/// @param      s     Stream.
+/// @param      len   Maximum number of bytes to copy.
+///
+void fill_out(struct q_stream * const s, const uint_t len)
+{
+    struct q_conn * const c = s->c;
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    // don't dip into the buffer reserve
+    uint_t todo = MIN(len, app_bufs_left(c->w) * (c->rec.max_pkt_size -
+                                                  AEAD_LEN - DATA_OFFSET));
+
+    while (!sq_empty(&s->out_refs)) {
+        struct strm_ref * const r = sq_first(&s->out_refs);
+        const uint_t n = MIN(todo, r->left);
+        if (n == 0 && r->left)
+            break;
+
+        struct w_iov_sq o = w_iov_sq_initializer(o);
+        if (n)
+            alloc_off(c->w, &o, c, q_conn_af(c), (uint32_t)n, DATA_OFFSET);
+        else if (r->fin) {
+            // this is a pure FIN
+            alloc_off(c->w, &o, c, q_conn_af(c), 1, DATA_OFFSET);
+            if (unlikely(sq_empty(&o))) {
+                // keep the ref, so the FIN goes out on a later TX
+                warn(WRN, "out of bufs for FIN on strm " FMT_SID, s->id);
+                break;
+            }
+            sq_first(&o)->len = 0;
+        }
+        if (unlikely(w_iov_sq_len(&o) != n)) {
+            warn(WRN, "out of bufs for shared data on strm " FMT_SID, s->id);
+            q_free(&o);
+            break;
+        }
+
+        struct w_iov * v;
+        uint_t pos = r->sh->len - r->left;
+        sq_foreach (v, &o, next) {
+            meta(v).is_shared = true;
+            if (r->sh->buf) {
+                memcpy(v->buf, &r->sh->buf[pos], v->len);
+                pos += v->len;
+                continue;
+            }
+            uint16_t off = 0;
+            while (off < v->len) {
+                const uint16_t k =
+                    (uint16_t)MIN(v->len - off, r->v->len - r->off);
+                memcpy(&v->buf[off], &r->v->buf[r->off], k);
+                off += k;
+                r->off += k;
+                if (r->off == r->v->len) {
+                    r->v = sq_next(r->v, next);
+                    r->off = 0;
+                }
+            }
+        }
+
+        r->left -= n;
+        todo -= n;
+        if (r->left == 0) {
+            if (r->fin && !sq_empty(&o))
+                // cppcheck-suppress nullPointer
+                meta(sq_last(&o, w_iov, next)).is_fin = true;
+            sq_remove_head(&s->out_refs, next);
+            shared_unref(r->sh);
+            free(r);
+        }
+        sq_concat(&q, &o);
+    }
+
+    if (!sq_empty(&q))
+        concat_out(s, &q);
+}
+
+
+/// Re-chunk the unsent data in buffer @p v of stream @p s to the current
+/// maximum packet size. Data was chunked for the max_pkt_size in effect when it
+/// was queued, so after a PMTU increase this pulls data forward from the next
+/// unsent buffer(s), and after a decrease it splits off the excess into a new
+/// buffer.
+///
+/// @param      s     Stream.
+/// @param      v     Unsent buffer of @p s that is about to be sent.
+///
+void rechunk_out(struct q_stream * const s, struct w_iov * const v)
+{
+    struct q_conn * const c = s->c;
+    struct pkt_meta * const m = &meta(v);
+    const uint16_t pld =
+        (uint16_t)(c->rec.max_pkt_size - AEAD_LEN - DATA_OFFSET);
+
+    if (unlikely(v->len > pld)) {
+        struct pkt_meta * nm;
+        struct w_iov * const nv = alloc_iov(c->w, q_conn_af(c),
+                                            v->len - pld, DATA_OFFSET, &nm);
+        if (unlikely(nv == 0))
+            return;
+        memcpy(nv->buf, &v->buf[pld], nv->len);
+        v->len = pld;
+        nm->is_fin = m->is_fin;
+        nm->is_shared = m->is_shared;
+        m->is_fin = false;
+        sq_insert_after(&s->out, v, nv, next);
+        return;
+    }
+
+    while (v->len < pld && m->is_fin == false) {
+        struct w_iov * const nv = sq_next(v, next);
+        if (nv == 0)
+            break;
+
+        struct pkt_meta * const nm = &meta(nv);
+        if (nm->txed || nm->acked)
+            // only pull data from unsent buffers, the rest has pkt numbers
+            break;
+
+        const uint16_t k = (uint16_t)MIN(pld - v->len, nv->len);
+        memcpy(&v->buf[v->len], nv->buf, k);
+        v->len += k;
+        if (k < nv->len) {
+            // leave the rest at the start of nv
+            nv->len -= k;
+            memmove(nv->buf, &nv->buf[k], nv->len);
+            break;
+        }
+
+        // nv is now empty, so drop it (but keep its FIN)
+        m->is_fin = nm->is_fin;
+        sq_remove_after(&s->out, v, next);
+        sq_next(nv, next) = 0;
+        free_iov(nv, nm);
+    }
+}
+
+
 bool q_is_uni_stream(const struct q_stream * const s)
 {
     return is_uni(s->id);
@@ -72,13 +72,46 @@ SPLAY_PROTOTYPE(ooo_by_off, pkt_meta, off_node, ooo_by_off_cmp)
 #endif
 
 
+/// An immutable payload that can be written to any number of streams. Data is
+/// copied into per-stream packet buffers only right before it is sent.
+struct q_shared {
+    struct w_iov_sq data; ///< Payload chunks.
+    uint8_t * buf;        ///< Heap payload (instead of data), or zero.
+    uint_t len;           ///< Total payload length.
+    uint_t refs;          ///< Number of references (streams plus owner).
+};
+
+
+/// A reference to (the unsent remainder of) a shared payload.
+struct strm_ref {
+    sq_entry(strm_ref) next;
+    struct q_shared * sh; ///< Shared payload.
+    struct w_iov * v;     ///< Next chunk of the payload to send.
+    uint_t left;          ///< Payload bytes left to send.
+    uint16_t off;         ///< Offset into v.
+    uint8_t fin : 1;      ///< Send a FIN after the payload.
+    uint8_t : 7;
+
+#if HAVE_64BIT
+    uint8_t _unused[5];
+#else
+    uint8_t _unused[1];
+#endif
+};
+
+
+sq_head(strm_refs, strm_ref);
+
+
 struct q_stream {
     sl_entry(q_stream) node_ctrl;
+    sq_entry(q_stream) node_ev; ///< For the connection's event queue.
 
     struct q_conn * c; ///< Connection this stream is a part of.
 
-    struct w_iov_sq out;    ///< Tail queue containing outbound data.
-    struct w_iov * out_una; ///< Lowest un-ACK'ed data chunk.
+    struct w_iov_sq out;       ///< Tail queue containing outbound data.
+    struct w_iov * out_una;    ///< Lowest un-ACK'ed data chunk.
+    struct strm_refs out_refs; ///< Shared payloads not yet copied into out.
 
     struct w_iov_sq in; ///< Tail queue containing inbound data.
 #ifndef NO_OOO_DATA
@@ -89,6 +122,7 @@ struct q_stream {
 
     uint_t out_data;     ///< Current outbound stream offset (= data sent).
     uint_t out_data_max; ///< Outbound max_strm_data.
+    uint_t out_unacked;  ///< Bytes in out that are not yet ACK'ed.
 
     uint_t in_data_max; ///< Inbound max_strm_data.
     uint_t in_data;     ///< In-order stream data received (total).
@@ -100,12 +134,15 @@ struct q_stream {
     uint8_t in_ctrl : 1; ///< Stream is in connections "needs ctrl" list.
     uint8_t tx_max_strm_data : 1; ///< We need to open the receive window.
     uint8_t blocked : 1;          ///< We are receive-window-blocked.
-    uint8_t : 5;
+    uint8_t out_full : 1;         ///< Send buffer limit was hit.
+    uint8_t : 4;
+
+    uint8_t ev; ///< Pending Q_EV_* stream events.
 
 #if HAVE_64BIT
-    uint8_t _unused[3];
+    uint8_t _unused[2];
 #else
-    uint8_t _unused[7];
+    uint8_t _unused[6];
 #endif
 };
 
@@ -125,14 +162,20 @@ struct q_stream {
                 is_srv_ini((s)->id) ? "serv" : "clnt",                         \
                 strm_state_str[(s)->state], strm_state_str[(new_state)]);      \
         }                                                                      \
-        if (likely((s)->state != strm_clsd))                                   \
+        if (likely((s)->state != strm_clsd)) {                                 \
             (s)->state = (new_state);                                          \
+            if ((new_state) == strm_clsd && (s)->id >= 0)                      \
+                post_ev((s)->c, (s), Q_EV_STRM_CLOSED);                        \
+        }                                                                      \
     } while (0)
 #else
 #define strm_to_state(s, new_state)                                            \
     do {                                                                       \
-        if (likely((s)->state != strm_clsd))                                   \
+        if (likely((s)->state != strm_clsd)) {                                 \
             (s)->state = (new_state);                                          \
+            if ((new_state) == strm_clsd && (s)->id >= 0)                      \
+                post_ev((s)->c, (s), Q_EV_STRM_CLOSED);                        \
+        }                                                                      \
     } while (0)
 #endif
 
@@ -219,6 +262,9 @@ track_bytes_in(struct q_stream * const s, const uint_t n);
 extern void __attribute__((nonnull))
 track_bytes_out(struct q_stream * const s, const uint_t n);
 
+extern void __attribute__((nonnull))
+track_bytes_acked(struct q_stream * const s, const uint_t n);
+
 extern void __attribute__((nonnull))
 reset_stream(struct q_stream * const s, const bool forget);
 
@@ -236,5 +282,16 @@ extern void __attribute__((nonnull)) do_stream_id_fc(struct q_conn * const c,
 extern void __attribute__((nonnull))
 concat_out(struct q_stream * const s, struct w_iov_sq * const q);
 
+extern void __attribute__((nonnull))
+fill_out(struct q_stream * const s, const uint_t len);
+
+extern void __attribute__((nonnull))
+rechunk_out(struct q_stream * const s, struct w_iov * const v);
+
+extern void __attribute__((nonnull)) shared_unref(struct q_shared * const sh);
+
+extern uint_t __attribute__((nonnull))
+out_room(const struct q_stream * const s);
+
 extern dint_t __attribute__((nonnull))
 max_sid(const dint_t sid, const struct q_conn * const c);
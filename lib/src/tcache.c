@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "tcache.h"
+
+
+#define TCACHE_MAGIC 0x71746302 ///< "qtc" followed by format version.
+#define TCACHE_ALIGN 8
+
+#define align(x) (((x) + TCACHE_ALIGN - 1) / TCACHE_ALIGN * TCACHE_ALIGN)
+
+
+/// Header of the ticket cache file. All fields following @p hash_len are only
+/// accessed atomically, since they are shared with other processes.
+///
+struct tcache_hdr {
+    uint32_t magic;    ///< TCACHE_MAGIC.
+    uint32_t hash_len; ///< Length of the quant commit hash in @p hash.
+    uint8_t hash[64];  ///< Commit hash of the quant that wrote this file.
+
+    uint32_t tail;  ///< Offset of the first unused byte.
+    uint32_t live;  ///< Number of bytes held by live (indexed) records.
+    uint32_t moved; ///< Non-zero if the file was (or is being) compacted.
+    uint32_t _unused;
+
+    uint32_t idx[TCACHE_BUCKETS]; ///< Record offsets, zero if slot is unused.
+};
+
+
+/// A ticket record. Followed by NUL-terminated SNI and ALPN strings, and the
+/// ticket itself.
+///
+struct tcache_rec {
+    uint32_t len;        ///< Total length of the record, including padding.
+    uint32_t key;        ///< Hash over SNI and ALPN.
+    uint32_t vers;       ///< QUIC version.
+    uint16_t ticket_len; ///< Length of the ticket.
+    uint8_t sni_len;     ///< Length of the SNI, including the NUL.
+    uint8_t alpn_len;    ///< Length of the ALPN, including the NUL.
+    struct transport_params tp;
+    uint8_t data[];
+};
+
+
+#define DATA_START ((uint32_t)align(sizeof(struct tcache_hdr)))
+
+
+static uint32_t __attribute__((nonnull))
+key_of(const char * const sni, const char * const alpn)
+{
+    // FNV-1a over SNI, NUL and ALPN
+    uint32_t h = 0x811c9dc5;
+    for (const char * p = sni;; p++) {
+        h = (h ^ (uint8_t)*p) * 0x01000193;
+        if (*p == 0)
+            break;
+    }
+    for (const char * p = alpn; *p; p++)
+        h = (h ^ (uint8_t)*p) * 0x01000193;
+    return h;
+}
+
+
+static inline struct tcache_rec * __attribute__((nonnull))
+rec_at(const struct tcache_hdr * const hdr, const uint32_t off)
+{
+    // the file is shared, so don't trust offsets read from it
+    if (unlikely(off < DATA_START ||
+                 off > TCACHE_SIZE - sizeof(struct tcache_rec)))
+        return 0;
+    struct tcache_rec * const r = (struct tcache_rec *)((uintptr_t)hdr + off);
+    if (unlikely(r->len > TCACHE_SIZE - off ||
+                 r->len < sizeof(*r) + r->sni_len + r->alpn_len +
+                              r->ticket_len ||
+                 r->sni_len == 0 || r->alpn_len == 0))
+        return 0;
+    return r;
+}
+
+
+static inline bool __attribute__((nonnull))
+rec_matches(const struct tcache_rec * const r,
+            const uint32_t key,
+            const char * const sni,
+            const char * const alpn)
+{
+    // the file is shared, so don't trust that its strings are terminated
+    const char * const r_sni = (const char *)r->data;
+    const char * const r_alpn = r_sni + r->sni_len;
+    return r->key == key && r_sni[r->sni_len - 1] == 0 &&
+           r_alpn[r->alpn_len - 1] == 0 && strcmp(r_sni, sni) == 0 &&
+           strcmp(r_alpn, alpn) == 0;
+}
+
+
+static struct tcache_hdr * __attribute__((nonnull))
+mk_file(const char * const path)
+{
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        warn(WRN, "could not create TLS ticket cache %s: %s", path,
+             strerror(errno));
+        return 0;
+    }
+
+    struct tcache_hdr * hdr = MAP_FAILED;
+    if (ftruncate(fd, TCACHE_SIZE) == 0)
+        hdr = mmap(0, TCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        warn(WRN, "could not map TLS ticket cache %s: %s", path,
+             strerror(errno));
+        unlink(path);
+        return 0;
+    }
+
+    // the file is not visible to others yet, so no need for atomics
+    hdr->magic = TCACHE_MAGIC;
+    hdr->hash_len = (uint32_t)MIN(quant_commit_hash_len, sizeof(hdr->hash));
+    memcpy(hdr->hash, quant_commit_hash, hdr->hash_len);
+    hdr->tail = DATA_START;
+    return hdr;
+}
+
+
+static bool __attribute__((nonnull))
+tmp_path(char * const tmp, const size_t len, const char * const path)
+{
+    const int n = snprintf(tmp, len, "%s.%d", path, getpid());
+    return n > 0 && (size_t)n < len;
+}
+
+
+static struct tcache_hdr * __attribute__((nonnull))
+map_file(const char * const path)
+{
+    for (uint_t tries = 0; tries < 3; tries++) {
+        const int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0 && errno != ENOENT) {
+            warn(WRN, "could not open TLS ticket cache %s: %s", path,
+                 strerror(errno));
+            return 0;
+        }
+
+        struct stat st;
+        struct tcache_hdr * hdr = MAP_FAILED;
+        if (fd >= 0) {
+            if (fstat(fd, &st) == 0 && st.st_size == TCACHE_SIZE)
+                hdr = mmap(0, TCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           fd, 0);
+            close(fd);
+        }
+
+        if (hdr != MAP_FAILED) {
+            if (likely(hdr->magic == TCACHE_MAGIC &&
+                       hdr->hash_len == MIN(quant_commit_hash_len,
+                                            sizeof(hdr->hash)) &&
+                       memcmp(hdr->hash, quant_commit_hash, hdr->hash_len) ==
+                           0)) {
+                if (likely(__atomic_load_n(&hdr->moved, __ATOMIC_ACQUIRE) ==
+                           0))
+                    return hdr;
+                // we raced against a compaction, retry
+                munmap(hdr, TCACHE_SIZE);
+                continue;
+            }
+            munmap(hdr, TCACHE_SIZE);
+            warn(WRN,
+                 "TLS tickets were stored by different %s version, replacing",
+                 quant_name);
+        }
+
+        // initialize a new file and atomically move it into place
+        char tmp[MAXPATHLEN];
+        if (tmp_path(tmp, sizeof(tmp), path) == false)
+            return 0;
+        hdr = mk_file(tmp);
+        if (hdr == 0)
+            return 0;
+        munmap(hdr, TCACHE_SIZE);
+        if (fd < 0) {
+            // don't clobber a file that another process created meanwhile
+            if (link(tmp, path) != 0 && errno != EEXIST)
+                warn(WRN, "could not link %s: %s", path, strerror(errno));
+            unlink(tmp);
+        } else if (rename(tmp, path) != 0) {
+            warn(WRN, "could not rename %s: %s", tmp, strerror(errno));
+            unlink(tmp);
+        }
+    }
+
+    return 0;
+}
+
+
+bool tcache_open(struct tcache * const tc, const char * const path)
+{
+    tc->path = strdup(path);
+    ensure(tc->path, "strdup");
+    tc->hdr = map_file(path);
+    if (tc->hdr == 0) {
+        free(tc->path);
+        tc->path = 0;
+        return false;
+    }
+
+    warn(INF, "mapped TLS ticket cache %s, %" PRIu32 " of %u bytes used",
+         path, __atomic_load_n(&tc->hdr->tail, __ATOMIC_RELAXED), TCACHE_SIZE);
+    return true;
+}
+
+
+void tcache_close(struct tcache * const tc)
+{
+    if (tc->hdr)
+        munmap(tc->hdr, TCACHE_SIZE);
+    free(tc->path);
+    tc->hdr = 0;
+    tc->path = 0;
+}
+
+
+static void __attribute__((nonnull)) retire(struct tcache * const tc)
+{
+    // callers copy what they need out of tcache_ent, so this can go right away
+    munmap(tc->hdr, TCACHE_SIZE);
+    tc->hdr = 0;
+}
+
+
+static void __attribute__((nonnull)) remap_if_moved(struct tcache * const tc)
+{
+    if (likely(tc->hdr == 0 ||
+               __atomic_load_n(&tc->hdr->moved, __ATOMIC_ACQUIRE) == 0))
+        return;
+
+    // another process compacted the cache
+    struct tcache_hdr * const hdr = map_file(tc->path);
+    if (hdr) {
+        retire(tc);
+        tc->hdr = hdr;
+    }
+    // else keep using the old mapping for lookups until the next try
+}
+
+
+static uint32_t __attribute__((nonnull))
+find_slot(const struct tcache_hdr * const hdr,
+          const uint32_t key,
+          const char * const sni,
+          const char * const alpn)
+{
+    for (uint32_t i = 0; i < TCACHE_BUCKETS; i++) {
+        const uint32_t slot = (key + i) & (TCACHE_BUCKETS - 1);
+        const uint32_t off =
+            __atomic_load_n(&hdr->idx[slot], __ATOMIC_ACQUIRE);
+        if (off == 0)
+            break;
+        const struct tcache_rec * const r = rec_at(hdr, off);
+        if (r && rec_matches(r, key, sni, alpn))
+            return off;
+    }
+    return 0;
+}
+
+
+bool tcache_find(struct tcache * const tc,
+                 const char * const sni,
+                 const char * const alpn,
+                 struct tcache_ent * const e)
+{
+    remap_if_moved(tc);
+    if (unlikely(tc->hdr == 0))
+        return false;
+
+    const uint32_t off = find_slot(tc->hdr, key_of(sni, alpn), sni, alpn);
+    if (off == 0)
+        return false;
+
+    const struct tcache_rec * const r = rec_at(tc->hdr, off);
+    e->sni = (const char *)r->data;
+    e->alpn = (const char *)r->data + r->sni_len;
+    e->tp = &r->tp;
+    e->ticket = r->data + r->sni_len + r->alpn_len;
+    e->ticket_len = r->ticket_len;
+    e->vers = r->vers;
+    return true;
+}
+
+
+static uint32_t __attribute__((nonnull))
+append(struct tcache_hdr * const hdr,
+       const uint32_t key,
+       const char * const sni,
+       const size_t sni_len,
+       const char * const alpn,
+       const size_t alpn_len,
+       const struct transport_params * const tp,
+       const uint32_t vers,
+       const uint8_t * const ticket,
+       const uint16_t ticket_len)
+{
+    const uint32_t len = (uint32_t)align(sizeof(struct tcache_rec) + sni_len +
+                                         alpn_len + ticket_len);
+
+    // reserve space; once the file is full, tail keeps growing past its end
+    // until compaction, which is harmless
+    const uint32_t off =
+        __atomic_fetch_add(&hdr->tail, len, __ATOMIC_ACQ_REL);
+    if (unlikely(off > TCACHE_SIZE - len))
+        return 0;
+
+    struct tcache_rec * const r = (struct tcache_rec *)((uintptr_t)hdr + off);
+    r->len = len;
+    r->key = key;
+    r->vers = vers;
+    r->ticket_len = ticket_len;
+    r->sni_len = (uint8_t)sni_len;
+    r->alpn_len = (uint8_t)alpn_len;
+    memcpy(&r->tp, tp, sizeof(r->tp));
+    memcpy(r->data, sni, sni_len);
+    memcpy(r->data + sni_len, alpn, alpn_len);
+    memcpy(r->data + sni_len + alpn_len, ticket, ticket_len);
+    return off;
+}
+
+
+static bool __attribute__((nonnull))
+publish(struct tcache_hdr * const hdr,
+        const uint32_t key,
+        const char * const sni,
+        const char * const alpn,
+        const uint32_t off)
+{
+    const uint32_t len = ((struct tcache_rec *)((uintptr_t)hdr + off))->len;
+    for (uint32_t i = 0; i < TCACHE_BUCKETS; i++) {
+        const uint32_t slot = (key + i) & (TCACHE_BUCKETS - 1);
+        uint32_t cur = __atomic_load_n(&hdr->idx[slot], __ATOMIC_ACQUIRE);
+        for (;;) {
+            const struct tcache_rec * const r = cur ? rec_at(hdr, cur) : 0;
+            if (cur && (r == 0 || rec_matches(r, key, sni, alpn) == false))
+                // slot is taken by another peer
+                break;
+            // slot is empty or holds an older ticket for this peer
+            if (__atomic_compare_exchange_n(&hdr->idx[slot], &cur, off, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_add_fetch(&hdr->live, len, __ATOMIC_RELAXED);
+                if (r)
+                    __atomic_sub_fetch(&hdr->live, r->len, __ATOMIC_RELAXED);
+                return true;
+            }
+            // lost a race, cur now holds the winner's offset
+        }
+    }
+    return false;
+}
+
+
+static bool __attribute__((nonnull))
+put(struct tcache_hdr * const hdr,
+    const char * const sni,
+    const char * const alpn,
+    const struct transport_params * const tp,
+    const uint32_t vers,
+    const uint8_t * const ticket,
+    const uint16_t ticket_len)
+{
+    const size_t sni_len = strlen(sni) + 1;
+    const size_t alpn_len = strlen(alpn) + 1;
+    if (unlikely(sni_len > UINT8_MAX || alpn_len > UINT8_MAX)) {
+        warn(WRN, "SNI or ALPN too long, not caching TLS ticket");
+        return true;
+    }
+
+    const uint32_t key = key_of(sni, alpn);
+    const uint32_t off = append(hdr, key, sni, sni_len, alpn, alpn_len, tp,
+                                vers, ticket, ticket_len);
+    return off && publish(hdr, key, sni, alpn, off);
+}
+
+
+void tcache_compact(struct tcache * const tc)
+{
+    struct tcache_hdr * const old = tc->hdr;
+    if (old == 0 || __atomic_exchange_n(&old->moved, 1, __ATOMIC_ACQ_REL)) {
+        // someone else is compacting
+        remap_if_moved(tc);
+        return;
+    }
+
+    char tmp[MAXPATHLEN];
+    if (tmp_path(tmp, sizeof(tmp), tc->path) == false)
+        goto fail;
+    struct tcache_hdr * const hdr = mk_file(tmp);
+    if (hdr == 0)
+        goto fail;
+
+    uint_t n = 0;
+    for (uint32_t i = 0; i < TCACHE_BUCKETS; i++) {
+        const uint32_t off = __atomic_load_n(&old->idx[i], __ATOMIC_ACQUIRE);
+        const struct tcache_rec * const r = off ? rec_at(old, off) : 0;
+        if (r == 0)
+            continue;
+        const char * const sni = (const char *)r->data;
+        const char * const alpn = sni + r->sni_len;
+        if (sni[r->sni_len - 1] || alpn[r->alpn_len - 1])
+            // not NUL-terminated, skip
+            continue;
+        n += put(hdr, sni, alpn, &r->tp, r->vers,
+                 r->data + r->sni_len + r->alpn_len, r->ticket_len);
+    }
+
+    if (rename(tmp, tc->path) != 0) {
+        warn(WRN, "could not rename %s: %s", tmp, strerror(errno));
+        munmap(hdr, TCACHE_SIZE);
+        unlink(tmp);
+        goto fail;
+    }
+
+    warn(NTE, "compacted TLS ticket cache %s, %" PRIu " tickets, %" PRIu32
+              " of %u bytes used",
+         tc->path, n, hdr->tail, TCACHE_SIZE);
+    retire(tc);
+    tc->hdr = hdr;
+    return;
+
+fail:
+    // allow others (or us, later) to try again
+    __atomic_store_n(&old->moved, 0, __ATOMIC_RELEASE);
+}
+
+
+bool tcache_put(struct tcache * const tc,
+                const char * const sni,
+                const char * const alpn,
+                const struct transport_params * const tp,
+                const uint32_t vers,
+                const uint8_t * const ticket,
+                const uint16_t ticket_len)
+{
+    remap_if_moved(tc);
+    if (unlikely(tc->hdr == 0))
+        return false;
+
+    if (put(tc->hdr, sni, alpn, tp, vers, ticket, ticket_len) == false) {
+        // out of space or index slots
+        tcache_compact(tc);
+        if (put(tc->hdr, sni, alpn, tp, vers, ticket, ticket_len) == false) {
+            warn(WRN, "TLS ticket cache %s is full", tc->path);
+            return false;
+        }
+    }
+
+    // compact once more than half of the used space is garbage
+    const uint32_t used =
+        MIN(__atomic_load_n(&tc->hdr->tail, __ATOMIC_RELAXED), TCACHE_SIZE) -
+        DATA_START;
+    const uint32_t live = __atomic_load_n(&tc->hdr->live, __ATOMIC_RELAXED);
+    if (unlikely(used > (TCACHE_SIZE - DATA_START) / 2 && live < used / 2))
+        tcache_compact(tc);
+
+    return true;
+}
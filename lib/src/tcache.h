@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct transport_params; // IWYU pragma: no_forward_declare transport_params
+
+
+/// A TLS session ticket cache that lives in a memory-mapped, append-only file,
+/// so that several client processes on a host can share it. Records are never
+/// modified once they have been published; an open-addressing index in the
+/// file header maps the hash of (SNI, ALPN) to the offset of the most recent
+/// record for that peer. Readers never lock, and writers reserve space and
+/// publish with atomic operations only.
+///
+/// Replaced records are reclaimed by compaction, which copies all live records
+/// into a fresh file that then atomically replaces the old one. Processes that
+/// still map the old file notice this via its @p moved flag and remap.
+
+
+#define TCACHE_SIZE (1024 * 1024) ///< Size of the ticket cache file.
+#define TCACHE_BUCKETS 1024       ///< Index slots, must be a power of two.
+
+
+struct tcache_hdr; // IWYU pragma: no_forward_declare tcache_hdr
+
+
+/// Process-local handle to a shared ticket cache.
+///
+struct tcache {
+    struct tcache_hdr * hdr; ///< Current mapping of the cache file.
+    char * path;             ///< Path of the cache file.
+};
+
+
+/// A ticket cache entry. All pointers point into the shared mapping, and are
+/// only valid until the next call on the same tcache handle, which may remap.
+///
+struct tcache_ent {
+    const char * sni;                   ///< Server name.
+    const char * alpn;                  ///< Negotiated ALPN.
+    const struct transport_params * tp; ///< Server transport parameters.
+    const uint8_t * ticket;             ///< TLS session ticket.
+    uint16_t ticket_len;                ///< Length of @p ticket.
+    uint8_t _unused[2];
+    uint32_t vers; ///< QUIC version.
+};
+
+
+/// Open (and if needed, create) the ticket cache stored at @p path. A cache
+/// that was written by a different version of quant is replaced.
+///
+/// @param      tc    The ticket cache handle to initialize.
+/// @param[in]  path  The path of the cache file.
+///
+/// @return     True if the cache could be opened, false otherwise.
+///
+extern bool __attribute__((nonnull))
+tcache_open(struct tcache * const tc, const char * const path);
+
+
+/// Unmap the ticket cache and free all associated process-local memory. The
+/// cache file itself is kept.
+///
+/// @param      tc    The ticket cache handle.
+///
+extern void __attribute__((nonnull)) tcache_close(struct tcache * const tc);
+
+
+/// Look up the most recent ticket for the given @p sni and @p alpn.
+///
+/// @param      tc    The ticket cache handle.
+/// @param[in]  sni   The server name.
+/// @param[in]  alpn  The ALPN.
+/// @param[out] e     The cache entry, if one was found.
+///
+/// @return     True if an entry was found, false otherwise.
+///
+extern bool __attribute__((nonnull)) tcache_find(struct tcache * const tc,
+                                                 const char * const sni,
+                                                 const char * const alpn,
+                                                 struct tcache_ent * const e);
+
+
+/// Append a ticket to the cache, replacing any older ticket for the same @p
+/// sni and @p alpn. Compacts the cache file if it is full or mostly holds
+/// replaced entries.
+///
+/// @param      tc          The ticket cache handle.
+/// @param[in]  sni         The server name.
+/// @param[in]  alpn        The ALPN.
+/// @param[in]  tp          The server transport parameters.
+/// @param[in]  vers        The QUIC version.
+/// @param[in]  ticket      The TLS session ticket.
+/// @param[in]  ticket_len  The length of @p ticket.
+///
+/// @return     True if the ticket was stored, false otherwise.
+///
+extern bool __attribute__((nonnull))
+tcache_put(struct tcache * const tc,
+           const char * const sni,
+           const char * const alpn,
+           const struct transport_params * const tp,
+           const uint32_t vers,
+           const uint8_t * const ticket,
+           const uint16_t ticket_len);
+
+
+/// Copy all live entries into a fresh cache file and atomically replace the
+/// current one with it. Does nothing if another process is already compacting.
+///
+/// @param      tc    The ticket cache handle.
+///
+extern void __attribute__((nonnull)) tcache_compact(struct tcache * const tc);
@@ -40,7 +40,12 @@
 #endif
 
 #ifndef NO_SERVER
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <time.h>
 #endif
 
 #ifdef WITH_OPENSSL
@@ -106,6 +111,7 @@ static int uecc_rng(uint8_t * dest, unsigned size)
 #include "bitset.h"
 #include "conn.h"
 #include "frame.h"
+#include "loop.h"
 #include "marshall.h"
 #include "pkt.h"
 #include "pn.h"
@@ -113,48 +119,24 @@ static int uecc_rng(uint8_t * dest, unsigned size)
 #include "stream.h"
 #include "tls.h"
 
-
-struct tls_ticket {
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    splay_entry(tls_ticket) node;
+#include "tcache.h"
 #endif
+
+
+#if !defined(PARTICLE) && !defined(RIOT_VERSION)
+static struct tcache tickets;
+#else
+struct tls_ticket {
     char * sni;
     char * alpn;
     uint8_t * ticket;
     size_t ticket_len;
     struct transport_params tp;
     uint32_t vers;
-    uint8_t _unused[12];
-};
-
-
-struct tickets_by_peer {
-#if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    splay_head(, tls_ticket);
-#else
-    struct tls_ticket last_ticket;
-#endif
 };
 
-static struct tickets_by_peer tickets;
-
-
-#if !defined(PARTICLE) && !defined(RIOT_VERSION)
-static int __attribute__((nonnull))
-tls_ticket_cmp(const struct tls_ticket * const a,
-               const struct tls_ticket * const b)
-{
-    int diff = strcmp(a->sni, b->sni);
-    if (diff)
-        return diff;
-
-    diff = strcmp(a->alpn, b->alpn);
-    return diff;
-}
-
-
-SPLAY_PROTOTYPE(tickets_by_peer, tls_ticket, node, tls_ticket_cmp)
-SPLAY_GENERATE(tickets_by_peer, tls_ticket, node, tls_ticket_cmp)
+static struct tls_ticket last_ticket;
 #endif
 
 
@@ -432,6 +414,7 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
     bitset_define(tp_list, TP_MAX);
     struct tp_list tp_list = bitset_t_initializer(0);
 
+    struct cid orig_cid = {.len = 0};
     c->tp_peer.act_cid_lim = UINT_T_MAX;
     c->tp_peer.max_pkt = MAX_PKT_LEN;
     while (pos < end) {
@@ -566,12 +549,16 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
             uint64_t len;
             if (decv(&len, &pos, end) == false)
                 return 1;
+            if (len > CID_LEN_MAX) {
+                err_close(c, ERR_TRANSPORT_PARAMETER, FRM_CRY,
+                          "illegal original_connection_id len %" PRIu64, len);
+                return 1;
+            }
             if (len) {
-                decb(c->tp_peer.orig_cid.id, &pos, end, (uint16_t)len);
-                c->tp_peer.orig_cid.len = (uint8_t)len;
+                decb(orig_cid.id, &pos, end, (uint16_t)len);
+                orig_cid.len = (uint8_t)len;
             }
-            warn(INF, "\toriginal_connection_id = %s",
-                 cid_str(&c->tp_peer.orig_cid));
+            warn(INF, "\toriginal_connection_id = %s", cid_str(&orig_cid));
             break;
 
         case TP_DMIG:;
@@ -611,11 +598,16 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
             break;
 
         case TP_PRFA:
+            if (is_clnt(c) == false) {
+                err_close(c, ERR_TRANSPORT_PARAMETER, FRM_CRY,
+                          "rx preferred_address tp at serv");
+                return 1;
+            }
             if (decv(&l, &pos, end) == false)
                 return 1;
             const uint8_t * const e = pos + l;
 
-            struct pref_addr * const pa = &c->tp_peer.pref_addr;
+            struct pref_addr * const pa = conn_pref_addr(c);
             struct w_sockaddr * const pa4 = &pa->addr4;
             struct w_sockaddr * const pa6 = &pa->addr6;
 
@@ -662,13 +654,13 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
 
     // if we did a RETRY, check that we got orig_cid and it matches
     if (is_clnt(c) && c->tok_len) {
-        if (c->tp_peer.orig_cid.len == 0) {
+        if (orig_cid.len == 0) {
             err_close(c, ERR_TRANSPORT_PARAMETER, FRM_CRY,
                       "no original_connection_id tp received");
             return 1;
         }
 
-        if (cid_cmp(&c->tp_peer.orig_cid, &c->odcid)) {
+        if (cid_cmp(&orig_cid, &c->odcid)) {
             err_close(c, ERR_TRANSPORT_PARAMETER, FRM_CRY,
                       "cid/odcid mismatch");
             return 1;
@@ -783,7 +775,7 @@ void init_tp(struct q_conn * const c)
                 encb_tp(&pos, end, TP_OCID, c->odcid.id, c->odcid.len);
 #ifdef DEBUG_EXTRA
                 warn(INF, "\toriginal_connection_id = %s",
-                     cid_str(&c->tp_mine.orig_cid));
+                     cid_str(&c->odcid));
 #endif
             }
             break;
@@ -861,8 +853,8 @@ void init_tp(struct q_conn * const c)
             }
             break;
         case TP_PRFA:;
-            struct pref_addr * const pa = &c->tp_mine.pref_addr;
-            if (!is_clnt(c) && pa->cid.seq) {
+            struct pref_addr * const pa = c->pref_addr;
+            if (!is_clnt(c) && pa) {
                 struct w_sockaddr * const pa4 = &pa->addr4;
                 struct w_sockaddr * const pa6 = &pa->addr6;
 #ifndef NO_SRT_MATCHING
@@ -934,17 +926,239 @@ void init_tp(struct q_conn * const c)
 
 
 #ifndef NO_SERVER
-static void init_ticket_prot(struct per_engine_data * const ped)
+#define TCKT_ROT_DEF (12 * 60 * 60) ///< Half the ticket lifetime.
+#define TCKT_FILE_MAX (4 * TCKT_KEYS) ///< Max. records in a ticket key file.
+
+
+/// On-disk format of a session ticket key.
+///
+struct tckt_key_rec {
+    uint32_t id;
+    uint8_t _unused[4];
+    uint64_t t;
+    uint8_t secret[PTLS_SHA256_DIGEST_SIZE];
+};
+
+
+static uint64_t __attribute__((nonnull))
+tckt_rot_ival(const struct per_engine_data * const ped)
+{
+    if (ped->conf.tls_ticket_key_rotation)
+        return ped->conf.tls_ticket_key_rotation;
+    // w/o a key file, only rotate if asked to, since processes would diverge
+    return ped->conf.tls_ticket_keys ? TCKT_ROT_DEF : UINT64_MAX;
+}
+
+
+static struct tckt_key * __attribute__((nonnull))
+find_tckt_key(struct per_engine_data * const ped, const uint32_t id)
+{
+    for (uint_t i = 0; i < TCKT_KEYS; i++)
+        if (ped->tckt[i].enc.aead && ped->tckt[i].id == id)
+            return &ped->tckt[i];
+    return 0;
+}
+
+
+static void __attribute__((nonnull))
+install_tckt_key(struct per_engine_data * const ped,
+                 const struct tckt_key_rec * const r)
 {
+    if (find_tckt_key(ped, r->id) ||
+        (ped->tckt[0].enc.aead && r->id < ped->tckt[0].id))
+        // already have this key, or a newer one
+        return;
+
+    // drop the oldest key, and make the new one current
+    struct tckt_key * const k = &ped->tckt[TCKT_KEYS - 1];
+    dispose_cipher(&k->enc);
+    dispose_cipher(&k->dec);
+    memmove(&ped->tckt[1], &ped->tckt[0],
+            (TCKT_KEYS - 1) * sizeof(ped->tckt[0]));
+    ped->tckt[0] = (struct tckt_key){.t = r->t, .id = r->id};
+
     const ptls_cipher_suite_t * const cs = &aes128gcmsha256;
-    uint8_t output[PTLS_MAX_SECRET_SIZE] = {0};
-    memcpy(output, quant_commit_hash,
-           MIN(quant_commit_hash_len, sizeof(output)));
-    setup_cipher(&ped->dec_tckt.header_protection, &ped->dec_tckt.aead,
-                 cs->aead, cs->hash, 0, output);
-    setup_cipher(&ped->enc_tckt.header_protection, &ped->enc_tckt.aead,
-                 cs->aead, cs->hash, 1, output);
-    ptls_clear_memory(output, sizeof(output));
+    setup_cipher(0, &ped->tckt[0].dec.aead, cs->aead, cs->hash, 0, r->secret);
+    setup_cipher(0, &ped->tckt[0].enc.aead, cs->aead, cs->hash, 1, r->secret);
+    warn(INF, "using TLS ticket key %u", r->id);
+}
+
+
+static void __attribute__((nonnull))
+clear_tckt_keys(struct per_engine_data * const ped)
+{
+    for (uint_t i = 0; i < TCKT_KEYS; i++) {
+        dispose_cipher(&ped->tckt[i].enc);
+        dispose_cipher(&ped->tckt[i].dec);
+    }
+}
+
+
+static void __attribute__((nonnull))
+mk_tckt_key_rec(struct tckt_key_rec * const r,
+                const uint32_t id,
+                const uint64_t now)
+{
+    *r = (struct tckt_key_rec){.id = id, .t = now};
+    rand_bytes(r->secret, sizeof(r->secret));
+}
+
+
+static void __attribute__((nonnull))
+load_tckt_keys(struct per_engine_data * const ped, const bool may_rotate)
+{
+    const uint64_t now = (uint64_t)time(0);
+    const uint64_t ival = tckt_rot_ival(ped);
+    const char * const path = ped->conf.tls_ticket_keys;
+    ped->tckt_load = now;
+    struct tckt_key_rec r[TCKT_KEYS + 1];
+
+    if (path == 0)
+        goto mem;
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        warn(ERR, "could not open TLS ticket key file %s: %s", path,
+             strerror(errno));
+        goto mem;
+    }
+
+    // the file lock serializes key rotation between processes sharing the file
+    struct stat st;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+        warn(ERR, "could not lock or stat TLS ticket key file %s: %s", path,
+             strerror(errno));
+        flock(fd, LOCK_UN);
+        close(fd);
+        goto mem;
+    }
+
+    // read the newest keys
+    const size_t cnt = (size_t)st.st_size / sizeof(r[0]);
+    size_t n = MIN(cnt, TCKT_KEYS);
+    if (pread(fd, r, n * sizeof(r[0]), (off_t)((cnt - n) * sizeof(r[0]))) !=
+        (ssize_t)(n * sizeof(r[0]))) {
+        warn(ERR, "could not read TLS ticket keys from %s", path);
+        n = 0;
+    }
+
+    if (may_rotate && (n == 0 || now >= r[n - 1].t + ival)) {
+        mk_tckt_key_rec(&r[n], n ? r[n - 1].id + 1 : 1, now);
+        size_t pos = cnt;
+        bool ok = true;
+        if (cnt >= TCKT_FILE_MAX) {
+            // keep the file from growing without bounds
+            ok = ftruncate(fd, 0) == 0 &&
+                 (n == 0 || pwrite(fd, r, n * sizeof(r[0]), 0) ==
+                                (ssize_t)(n * sizeof(r[0])));
+            pos = n;
+        }
+        if (ok && pwrite(fd, &r[n], sizeof(r[n]),
+                         (off_t)(pos * sizeof(r[0]))) == sizeof(r[n]))
+            warn(NTE, "created TLS ticket key %u in %s", r[n].id, path);
+        else
+            // other processes won't know this key, but at least we rotate
+            warn(ERR, "could not write TLS ticket key to %s: %s, using it "
+                      "from memory only",
+                 path, strerror(errno));
+        n++;
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    // install_tckt_key() ignores keys older than ours, so if the file was
+    // deleted or recreated and restarted its key IDs, start over with its keys
+    if (n && ped->tckt[0].enc.aead &&
+        (r[n - 1].id < ped->tckt[0].id ||
+         (r[n - 1].id == ped->tckt[0].id && r[n - 1].t != ped->tckt[0].t))) {
+        warn(NTE, "TLS ticket key file %s was reset, reloading keys", path);
+        clear_tckt_keys(ped);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        install_tckt_key(ped, &r[i]);
+    goto done;
+
+mem:
+    if (may_rotate) {
+        mk_tckt_key_rec(r, ped->tckt[0].id + 1, now);
+        install_tckt_key(ped, r);
+    }
+
+done:
+    ptls_clear_memory(r, sizeof(r));
+    ped->tckt_rot =
+        ival == UINT64_MAX ? UINT64_MAX : MIN(ped->tckt[0].t, now) + ival;
+}
+
+
+static void init_ticket_prot(struct per_engine_data * const ped)
+{
+    if (ped->conf.tls_ticket_keys)
+        load_tckt_keys(ped, true);
+
+    if (ped->tckt[0].enc.aead == 0) {
+        // derive a key from the commit hash, so processes of a build share it
+        struct tckt_key_rec r = {.t = (uint64_t)time(0)};
+        memcpy(r.secret, quant_commit_hash,
+               MIN(quant_commit_hash_len, sizeof(r.secret)));
+        install_tckt_key(ped, &r);
+        ptls_clear_memory(&r, sizeof(r));
+        const uint64_t ival = tckt_rot_ival(ped);
+        ped->tckt_rot = ival == UINT64_MAX ? UINT64_MAX : r.t + ival;
+    }
+}
+
+
+static void free_ticket_prot(struct per_engine_data * const ped)
+{
+    const struct tckt_stats * const ts = &ped->tckt_stats;
+    if (ts->hshks)
+        warn(NTE,
+             "%" PRIu " hshks, %" PRIu " TLS tickets issued, %" PRIu
+             " presented, %" PRIu " resumed (%.1f%%), %" PRIu
+             " w/unknown key, %" PRIu " 0-RTT (%.1f%%)",
+             ts->hshks, ts->issued, ts->presented, ts->resumed,
+             100.0 * ts->resumed / ts->hshks, ts->unk_key, ts->zero_rtt,
+             100.0 * ts->zero_rtt / ts->hshks);
+
+    clear_tckt_keys(ped);
+}
+
+
+/// Return the current session ticket key, rotating it first if it is due.
+///
+/// @param      ped   Per-engine data.
+///
+/// @return     Current ticket key.
+///
+const struct tckt_key * cur_tckt_key(struct per_engine_data * const ped)
+{
+    if (unlikely((uint64_t)time(0) >= ped->tckt_rot))
+        load_tckt_keys(ped, true);
+    return &ped->tckt[0];
+}
+
+
+/// Return the session ticket key with ID @p id. If it is unknown, re-read the
+/// key file first, since another process may have rotated the keys.
+///
+/// @param      ped   Per-engine data.
+/// @param[in]  id    Key ID.
+///
+/// @return     Ticket key, or zero if @p id is unknown.
+///
+const struct tckt_key * get_tckt_key(struct per_engine_data * const ped,
+                                     const uint32_t id)
+{
+    const struct tckt_key * k = find_tckt_key(ped, id);
+    if (k == 0 && ped->conf.tls_ticket_keys &&
+        (uint64_t)time(0) > ped->tckt_load) {
+        load_tckt_keys(ped, false);
+        k = find_tckt_key(ped, id);
+    }
+    return k;
 }
 
 
@@ -956,34 +1170,40 @@ static int encrypt_ticket_cb(ptls_encrypt_ticket_t * self
                              ptls_iovec_t src)
 {
     struct q_conn * const c = *ptls_get_data_ptr(tls);
+    struct per_engine_data * const ped = ped(c->w);
+    const size_t tag_size = ped->tckt[0].enc.aead->algo->tag_size;
+    uint32_t id;
     uint64_t tid;
-    if (ptls_buffer_reserve(dst, src.len + quant_commit_hash_len + sizeof(tid) +
-                                     ped(c->w)->enc_tckt.aead->algo->tag_size))
+    if (ptls_buffer_reserve(dst, src.len + sizeof(id) + sizeof(tid) + tag_size))
         return -1;
 
     if (is_encrypt) {
-        warn(INF, "creating new 0-RTT session ticket for %s conn %s (%s %s)",
-             conn_type(c), cid_str(c->scid), ptls_get_server_name(tls),
+        const struct tckt_key * const k = cur_tckt_key(ped);
+
+        warn(INF,
+             "creating new 0-RTT session ticket w/key %u for %s conn %s (%s "
+             "%s)",
+             k->id, conn_type(c), cid_str(c->scid), ptls_get_server_name(tls),
              ptls_get_negotiated_protocol(tls));
 
-        // prepend git commit hash
-        memcpy(dst->base + dst->off, quant_commit_hash, quant_commit_hash_len);
-        dst->off += quant_commit_hash_len;
+        // prepend key id
+        id = k->id;
+        memcpy(dst->base + dst->off, &id, sizeof(id));
+        dst->off += sizeof(id);
 
         // prepend ticket id
         rand_bytes(&tid, sizeof(tid));
         memcpy(dst->base + dst->off, &tid, sizeof(tid));
         dst->off += sizeof(tid);
 
-        // now encrypt ticket
-        dst->off +=
-            ptls_aead_encrypt(ped(c->w)->enc_tckt.aead, dst->base + dst->off,
-                              src.base, src.len, tid, 0, 0);
+        // now encrypt ticket, authenticating the key id
+        dst->off += ptls_aead_encrypt(k->enc.aead, dst->base + dst->off,
+                                      src.base, src.len, tid, &id, sizeof(id));
+        ped->tckt_stats.issued++;
 
     } else {
-        if (src.len < quant_commit_hash_len + sizeof(tid) +
-                          ped(c->w)->dec_tckt.aead->algo->tag_size ||
-            memcmp(src.base, quant_commit_hash, quant_commit_hash_len) != 0) {
+        ped->tckt_stats.presented++;
+        if (src.len < sizeof(id) + sizeof(tid) + tag_size) {
             warn(WRN,
                  "could not verify 0-RTT session ticket for %s conn %s (%s "
                  "%s)",
@@ -992,16 +1212,32 @@ static int encrypt_ticket_cb(ptls_encrypt_ticket_t * self
             c->did_0rtt = false;
             return -1;
         }
-        uint8_t * src_base = src.base + quant_commit_hash_len;
-        size_t src_len = src.len - quant_commit_hash_len;
+        uint8_t * src_base = src.base;
+        size_t src_len = src.len;
+
+        memcpy(&id, src_base, sizeof(id));
+        src_base += sizeof(id);
+        src_len -= sizeof(id);
 
         memcpy(&tid, src_base, sizeof(tid));
         src_base += sizeof(tid);
         src_len -= sizeof(tid);
 
+        const struct tckt_key * const k = get_tckt_key(ped, id);
+        if (k == 0) {
+            warn(WRN,
+                 "unknown key %u for 0-RTT session ticket for %s conn %s (%s "
+                 "%s)",
+                 id, conn_type(c), cid_str(c->scid), ptls_get_server_name(tls),
+                 ptls_get_negotiated_protocol(tls));
+            ped->tckt_stats.unk_key++;
+            c->did_0rtt = false;
+            return -1;
+        }
+
         const size_t n =
-            ptls_aead_decrypt(ped(c->w)->dec_tckt.aead, dst->base + dst->off,
-                              src_base, src_len, tid, 0, 0);
+            ptls_aead_decrypt(k->dec.aead, dst->base + dst->off, src_base,
+                              src_len, tid, &id, sizeof(id));
 
         if (n > src_len) {
             warn(WRN,
@@ -1014,9 +1250,11 @@ static int encrypt_ticket_cb(ptls_encrypt_ticket_t * self
         }
         dst->off += n;
 
-        warn(INF, "verified 0-RTT session ticket for %s conn %s (%s %s)",
-             conn_type(c), cid_str(c->scid), ptls_get_server_name(tls),
+        warn(INF,
+             "verified 0-RTT session ticket w/key %u for %s conn %s (%s %s)",
+             id, conn_type(c), cid_str(c->scid), ptls_get_server_name(tls),
              ptls_get_negotiated_protocol(tls));
+        ped->tckt_stats.resumed++;
         c->did_0rtt = true;
     }
 
@@ -1030,85 +1268,35 @@ static int save_ticket_cb(ptls_save_ticket_t * self __attribute__((unused)),
                           ptls_iovec_t src)
 {
     struct q_conn * const c = *ptls_get_data_ptr(tls);
+    const char * const sni =
+        ptls_get_server_name(tls) ? ptls_get_server_name(tls) : "";
+    const char * const a = ptls_get_negotiated_protocol(tls)
+                               ? ptls_get_negotiated_protocol(tls)
+                               : "";
 
-#if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    const char * const ticket_store = ped(c->w)->conf.ticket_store;
-    warn(NTE, "saving TLS tickets to %s", ticket_store);
-    FILE * const fp = fopen(ticket_store, "wbe");
-    ensure(fp, "could not open ticket file %s", ticket_store);
-
-    // write git hash
-    ensure(fwrite(&quant_commit_hash_len, sizeof(quant_commit_hash_len), 1, fp),
-           "fwrite");
-    ensure(fwrite(quant_commit_hash, quant_commit_hash_len, 1, fp), "fwrite");
-#endif
+    warn(INF, "saving TLS ticket for %s conn %s (%s %s)", conn_type(c),
+         cid_str(c->scid), sni, a);
 
-    char * s = 0;
-    if (ptls_get_server_name(tls))
-        s = strdup(ptls_get_server_name(tls));
-    else
-        s = calloc(1, sizeof(char));
-    char * a = 0;
-    if (ptls_get_negotiated_protocol(tls))
-        a = strdup(ptls_get_negotiated_protocol(tls));
-    else
-        a = calloc(1, sizeof(char));
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    const struct tls_ticket which = {.sni = s, .alpn = a};
-    struct tls_ticket * t = splay_find(tickets_by_peer, &tickets, &which);
-    if (t == 0) {
-        // create new ticket
-        t = calloc(1, sizeof(*t));
-        ensure(t, "calloc");
-        t->sni = s;
-        t->alpn = a;
-        ensure(splay_insert(tickets_by_peer, &tickets, t) == 0, "inserted");
-    } else {
-        // update current ticket
-        free(t->ticket);
-        free(s);
-        free(a);
+    if (unlikely(src.len > UINT16_MAX)) {
+        warn(WRN, "TLS ticket len %lu too long, not saving", src.len);
+        return 0;
     }
+    tcache_put(&tickets, sni, a, &c->tp_peer, c->vers, src.base,
+               (uint16_t)src.len);
 #else
-    struct tls_ticket * const t = &tickets.last_ticket;
-    t->sni = s;
-    t->alpn = a;
-#endif
-
+    struct tls_ticket * const t = &last_ticket;
+    free(t->sni);
+    free(t->alpn);
+    free(t->ticket);
+    t->sni = strdup(sni);
+    t->alpn = strdup(a);
     memcpy(&t->tp, &c->tp_peer, sizeof(t->tp));
     t->vers = c->vers;
-
     t->ticket_len = src.len;
     t->ticket = calloc(1, t->ticket_len);
     ensure(t->ticket, "calloc");
     memcpy(t->ticket, src.base, src.len);
-
-    // write all tickets
-    // FIXME this currently dumps the entire cache to file on each connection!
-#if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    splay_foreach (t, tickets_by_peer, &tickets) {
-#endif
-        warn(INF, "writing TLS ticket for %s conn %s (%s %s)", conn_type(c),
-             cid_str(c->scid), t->sni, t->alpn);
-
-#if !defined(PARTICLE) && !defined(RIOT_VERSION)
-        size_t len = strlen(t->sni) + 1;
-        ensure(fwrite(&len, sizeof(len), 1, fp), "fwrite");
-        ensure(fwrite(t->sni, sizeof(*t->sni), len, fp), "fwrite");
-
-        len = strlen(t->alpn) + 1;
-        ensure(fwrite(&len, sizeof(len), 1, fp), "fwrite");
-        ensure(fwrite(t->alpn, sizeof(*t->alpn), len, fp), "fwrite");
-
-        ensure(fwrite(&t->tp, sizeof(t->tp), 1, fp), "fwrite");
-        ensure(fwrite(&t->vers, sizeof(t->vers), 1, fp), "fwrite");
-
-        ensure(fwrite(&t->ticket_len, sizeof(t->ticket_len), 1, fp), "fwrite");
-        ensure(fwrite(t->ticket, sizeof(*t->ticket), t->ticket_len, fp),
-               "fwrite");
-    }
-
-    fclose(fp);
 #endif
 
     return 0;
@@ -1143,8 +1331,10 @@ void init_tls(struct q_conn * const c,
     if (is_clnt(c))
         c->tls.t = ptls_client_new(&ped(c->w)->tls_ctx);
 #ifndef NO_SERVER
-    else
+    else {
         c->tls.t = ptls_server_new(&ped(c->w)->tls_ctx);
+        ped(c->w)->tckt_stats.hshks++;
+    }
 #endif
     ensure(c->tls.t, "ptls_new");
     *ptls_get_data_ptr(c->tls.t) = c;
@@ -1172,22 +1362,28 @@ void init_tls(struct q_conn * const c,
 
         // try to find an existing session ticket
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
-        struct tls_ticket which = {// this works, because of strdup() allocation
-                                   .sni = sni,
-                                   .alpn = (char *)c->tls.alpn.base};
-        struct tls_ticket * t = splay_find(tickets_by_peer, &tickets, &which);
-        if (t == 0) {
+        struct tcache_ent e;
+        const bool found =
+            tickets.hdr &&
             // if we couldn't find a ticket, try without an alpn
-            which.alpn = "";
-            t = splay_find(tickets_by_peer, &tickets, &which);
-        }
-#else
-        struct tls_ticket * const t = &tickets.last_ticket;
-#endif
+            (tcache_find(&tickets, sni, (char *)c->tls.alpn.base, &e) ||
+             tcache_find(&tickets, sni, "", &e));
+        const struct tcache_ent * const t = found ? &e : 0;
         if (t && t->vers != 0) {
+            // copy the ticket, since the cache may be remapped by compaction
+            c->tls.tckt = malloc(t->ticket_len);
+            ensure(c->tls.tckt, "malloc");
+            memcpy(c->tls.tckt, t->ticket, t->ticket_len);
+            hshk_prop->client.session_ticket =
+                ptls_iovec_init(c->tls.tckt, t->ticket_len);
+            memcpy(&c->tp_peer, t->tp, sizeof(c->tp_peer));
+#else
+        const struct tls_ticket * const t = &last_ticket;
+        if (t->vers != 0) {
             hshk_prop->client.session_ticket =
                 ptls_iovec_init(t->ticket, t->ticket_len);
             memcpy(&c->tp_peer, &t->tp, sizeof(t->tp));
+#endif
             c->vers_initial = c->vers = t->vers;
             c->try_0rtt = true;
         }
@@ -1226,6 +1422,9 @@ void free_tls(struct q_conn * const c, const bool keep_alpn)
         if (c->tls.tp_buf)
             free(c->tls.tp_buf);
     }
+    // a re-init after Retry or VNeg copies the ticket again
+    free(c->tls.tckt);
+    c->tls.tckt = 0;
 }
 
 
@@ -1323,93 +1522,13 @@ done:
 }
 
 
-#if !defined(PARTICLE) && !defined(RIOT_VERSION)
-static void __attribute__((nonnull)) free_ticket(struct tls_ticket * const t)
-{
-    if (t->sni)
-        free(t->sni);
-    if (t->alpn)
-        free(t->alpn);
-    if (t->ticket)
-        free(t->ticket);
-    free(t);
-}
-#endif
-
-
 static void read_tickets(const struct q_conf * const conf)
 {
     warn(INF, "reading TLS tickets from %s", conf->ticket_store);
 
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    FILE * const fp = fopen(conf->ticket_store, "rbe");
-    if (fp == 0) {
+    if (tickets.hdr == 0 && tcache_open(&tickets, conf->ticket_store) == false)
         warn(WRN, "could not read TLS tickets from %s", conf->ticket_store);
-        return;
-    }
-
-    // read and verify git hash
-    size_t hash_len;
-    if (fread(&hash_len, sizeof(quant_commit_hash_len), 1, fp) != 1)
-        goto done;
-    uint8_t buf[8192];
-    if (fread(buf, sizeof(uint8_t), hash_len, fp) != hash_len)
-        goto done;
-    if (hash_len != quant_commit_hash_len ||
-        memcmp(buf, quant_commit_hash, hash_len) != 0) {
-        warn(WRN, "TLS tickets were stored by different %s version, removing",
-             quant_name);
-        ensure(unlink(conf->ticket_store) == 0, "unlink");
-        goto done;
-    }
-
-    for (;;) {
-        // try and read the SNI len
-        size_t len;
-        if (fread(&len, sizeof(len), 1, fp) != 1)
-            // we read all the tickets
-            break;
-        ensure(len <= 256, "SNI len %lu too long", len);
-
-        struct tls_ticket * const t = calloc(1, sizeof(*t));
-        ensure(t, "calloc");
-        t->sni = calloc(1, len);
-        ensure(t->sni, "calloc");
-        if (fread(t->sni, sizeof(*t->sni), len, fp) != len)
-            goto abort;
-
-        if (fread(&len, sizeof(len), 1, fp) != 1)
-            goto abort;
-        ensure(len <= 256, "ALPN len %lu too long", len);
-        t->alpn = calloc(1, len);
-        ensure(t->alpn, "calloc");
-        if (fread(t->alpn, sizeof(*t->alpn), len, fp) != len)
-            goto abort;
-
-        if (fread(&t->tp, sizeof(t->tp), 1, fp) != 1)
-            goto abort;
-        if (fread(&t->vers, sizeof(t->vers), 1, fp) != 1)
-            goto abort;
-
-        if (fread(&len, sizeof(len), 1, fp) != 1)
-            goto abort;
-        ensure(len <= 8192, "ticket_len %lu too long", len);
-        t->ticket_len = len;
-        t->ticket = calloc(len, sizeof(*t->ticket));
-        ensure(t->ticket, "calloc");
-        if (fread(t->ticket, sizeof(*t->ticket), len, fp) != len)
-            goto abort;
-
-        ensure(splay_insert(tickets_by_peer, &tickets, t) == 0, "inserted");
-        warn(INF, "got TLS ticket %s %s", t->sni, t->alpn);
-        continue;
-    abort:
-        free_ticket(t);
-        break;
-    }
-
-done:
-    fclose(fp);
 #endif
 }
 
@@ -1460,6 +1579,11 @@ static int update_traffic_key_cb(ptls_update_traffic_key_t * const self
     switch (epoch) {
     case ep_0rtt:
         ctx = is_enc ? &pn->data.out_0rtt : &pn->data.in_0rtt;
+#ifndef NO_SERVER
+        if (is_enc == 0 && !is_clnt(c))
+            // the server only gets 0-RTT keys if it accepts early data
+            ped(c->w)->tckt_stats.zero_rtt++;
+#endif
         break;
 
     case ep_hshk:
@@ -1496,6 +1620,89 @@ static int update_traffic_key_cb(ptls_update_traffic_key_t * const self
 }
 
 
+#define TOK_KEY_ROT (60 * 60) ///< Token key lifetime, in seconds.
+#define RTRY_TOK_LIFE 10      ///< Retry token lifetime, in seconds.
+#define NEW_TOK_LIFE TOK_KEY_ROT ///< NEW_TOKEN token lifetime, in seconds.
+
+#define TOK_RTRY 0 ///< Token type of Retry tokens.
+#define TOK_NEW 1  ///< Token type of NEW_TOKEN tokens.
+
+
+/// Derive the token base secret. Servers using the same TLS private key, i.e.,
+/// the workers of a multi-process setup or a restarted server, derive the same
+/// secret and hence accept each other's tokens. Others use a random secret.
+///
+/// @param[in]  conf  The configuration.
+/// @param      ped   The per-engine data.
+///
+static void __attribute__((nonnull(2)))
+init_tok_secret(const struct q_conf * const conf,
+                struct per_engine_data * const ped)
+{
+    FILE * const fp = conf && conf->tls_key ? fopen(conf->tls_key, "rbe") : 0;
+    if (fp == 0) {
+        rand_bytes(ped->tok_secret, sizeof(ped->tok_secret));
+        return;
+    }
+
+    const ptls_cipher_suite_t * const cs = &aes128gcmsha256;
+    ptls_hash_context_t * const hc = cs->hash->create();
+    ensure(hc, "could not make hash ctx");
+    static const char label[] = "quant token secret";
+    hc->update(hc, label, sizeof(label));
+    uint8_t buf[512];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        hc->update(hc, buf, n);
+    hc->final(hc, ped->tok_secret, PTLS_HASH_FINAL_MODE_FREE);
+    ptls_clear_memory(buf, sizeof(buf));
+    fclose(fp);
+}
+
+
+static ptls_aead_context_t * __attribute__((nonnull))
+new_tok_aead(const struct per_engine_data * const ped,
+             const uint32_t epoch,
+             const int is_enc)
+{
+    const ptls_cipher_suite_t * const cs = &aes128gcmsha256;
+    uint8_t secret[PTLS_SHA256_DIGEST_SIZE];
+    ensure(ptls_hkdf_expand_label(
+               cs->hash, secret, sizeof(secret),
+               ptls_iovec_init(ped->tok_secret, sizeof(ped->tok_secret)),
+               "quant tok", ptls_iovec_init(&epoch, sizeof(epoch)), 0) == 0,
+           "ptls_hkdf_expand_label");
+    ptls_aead_context_t * const aead =
+        ptls_aead_new(cs->aead, cs->hash, is_enc, secret, AEAD_BASE_LABEL);
+    ensure(aead, "could not make token ctx");
+    ptls_clear_memory(secret, sizeof(secret));
+    return aead;
+}
+
+
+/// Switch to the token keys of the current key epoch. Epochs are based on the
+/// wall clock, so that processes sharing a token secret rotate in lockstep.
+///
+/// @param      ped   The per-engine data.
+///
+static void __attribute__((nonnull))
+rotate_tok_key(struct per_engine_data * const ped)
+{
+    const uint32_t epoch = (uint32_t)((uint64_t)time(0) / TOK_KEY_ROT);
+    if (ped->tok_enc)
+        ptls_aead_free(ped->tok_enc);
+    for (size_t i = 0; i < sizeof(ped->tok_dec) / sizeof(ped->tok_dec[0]); i++)
+        if (ped->tok_dec[i])
+            ptls_aead_free(ped->tok_dec[i]);
+
+    ped->tok_enc = new_tok_aead(ped, epoch, 1);
+    ped->tok_dec[epoch & 1] = new_tok_aead(ped, epoch, 0);
+    ped->tok_dec[(epoch - 1) & 1] = new_tok_aead(ped, epoch - 1, 0);
+    ped->tok_kid = (uint8_t)epoch;
+    ped->tok_rot = ((uint64_t)epoch + 1) * TOK_KEY_ROT;
+}
+
+
 void init_tls_ctx(const struct q_conf * const conf,
                   struct per_engine_data * const ped)
 {
@@ -1533,7 +1740,6 @@ void init_tls_ctx(const struct q_conf * const conf,
         const int ret = ptls_load_certificates(tls_ctx, conf->tls_cert);
         ensure(ret == 0, "ptls_load_certificates");
     }
-    splay_init(&tickets);
 #endif
 
     if (conf && conf->ticket_store) {
@@ -1593,26 +1799,26 @@ void init_tls_ctx(const struct q_conf * const conf,
     ped->rid_ctx =
         ptls_aead_new(cs->aead, cs->hash, 1, retry_secret, AEAD_BASE_LABEL);
     ensure(ped->rid_ctx, "could not make rit ctx");
+    init_tok_secret(conf, ped);
+    rotate_tok_key(ped);
 }
 
 
 void free_tls_ctx(struct per_engine_data * const ped)
 {
 #ifndef NO_SERVER
-    dispose_cipher(&ped->dec_tckt);
-    dispose_cipher(&ped->enc_tckt);
+    free_ticket_prot(ped);
 #endif
     ptls_aead_free(ped->rid_ctx);
+    ptls_aead_free(ped->tok_enc);
+    for (size_t i = 0; i < sizeof(ped->tok_dec) / sizeof(ped->tok_dec[0]); i++)
+        if (ped->tok_dec[i])
+            ptls_aead_free(ped->tok_dec[i]);
 
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    // free ticket cache
-    struct tls_ticket * t;
-    struct tls_ticket * tmp;
-    for (t = splay_min(tickets_by_peer, &tickets); t != 0; t = tmp) {
-        tmp = splay_next(tickets_by_peer, &tickets, t);
-        ensure(splay_remove(tickets_by_peer, &tickets, t), "removed");
-        free_ticket(t);
-    }
+    // unmap ticket cache
+    if (tickets.hdr)
+        tcache_close(&tickets);
 #endif
 
     for (size_t i = 0; i < ped->tls_ctx.certificates.count; i++)
@@ -1705,79 +1911,160 @@ uint16_t enc_aead(const struct w_iov * const v,
 }
 
 
-static ptls_hash_context_t * __attribute__((nonnull))
-prep_hash_ctx(const struct q_conn * const c,
-              const ptls_cipher_suite_t * const cs)
+/// Fill @p aad with the peer address data that a token of type @p type is bound
+/// to. Retry tokens cover the full address, since they are only good for the
+/// handshake that is being retried. NEW_TOKEN tokens are used on later conns,
+/// which usually come from a different port, so they only cover the IP.
+///
+/// @param[out] aad   Buffer for the data, at least 1 + sizeof(*peer) bytes.
+/// @param[in]  type  Token type.
+/// @param[in]  peer  Peer address.
+///
+/// @return     Length of the data.
+///
+static size_t __attribute__((nonnull))
+tok_aad(uint8_t * const aad,
+        const uint8_t type,
+        const struct w_sockaddr * const peer)
 {
-    // create hash context
-    ptls_hash_context_t * const hc = cs->hash->create();
-    ensure(hc, "could not create hash context");
-
-    // hash our git commit hash and the peer IP address
-    hc->update(hc, quant_commit_hash, quant_commit_hash_len);
-    hc->update(hc, &c->peer, sizeof(c->peer));
-
-    return hc;
+    uint8_t * pos = aad;
+    *pos++ = type;
+    const size_t ip_len = peer->addr.af == AF_INET ? sizeof(peer->addr.ip4)
+                                                   : sizeof(peer->addr.ip6);
+    memcpy(pos, &peer->addr.ip4, ip_len);
+    pos += ip_len;
+    if (type == TOK_RTRY) {
+        memcpy(pos, &peer->port, sizeof(peer->port));
+        pos += sizeof(peer->port);
+    }
+    return (size_t)(pos - aad);
 }
 
 
-void make_rtry_tok(struct q_conn * const c)
+/// Make an address validation token for @p peer.
+///
+/// @param      w      Warpcore engine.
+/// @param[in]  peer   Peer address.
+/// @param[in]  odcid  Original DCID for a Retry token, zero for NEW_TOKEN.
+/// @param[out] tok    Token buffer, at least RTRY_TOK_LEN_MAX bytes.
+///
+/// @return     Length of the token.
+///
+uint16_t make_tok(struct w_engine * const w,
+                  const struct w_sockaddr * const peer,
+                  const struct cid * const odcid,
+                  uint8_t * const tok)
 {
-    const ptls_cipher_suite_t * const cs = &aes128gcmsha256;
-    ptls_hash_context_t * const hc = prep_hash_ctx(c, cs);
-
-    // hash current scid
-    struct cid * const scid = c->scid;
-    hc->update(hc, scid->id, scid->len);
-    hc->final(hc, c->tok, PTLS_HASH_FINAL_MODE_FREE);
-
-    // append scid to hashed token
-    memcpy(&c->tok[cs->hash->digest_size], scid->id, scid->len);
-    // update max_frame_len() when this changes:
-    c->tok_len = (uint16_t)cs->hash->digest_size + scid->len;
-    // #ifdef DEBUG_PROT
-    warn(DBG, "computed Retry tok %s",
-         hex2str(c->tok, c->tok_len, (char[hex_str_len(MAX_TOK_LEN)]){""},
-                 hex_str_len(c->tok_len)));
-    // #endif
+    struct per_engine_data * const ped = ped(w);
+    const uint32_t t = (uint32_t)time(0);
+    if (unlikely(t >= ped->tok_rot))
+        rotate_tok_key(ped);
+
+    // the token is the key ID, the type and a random nonce (the key may be
+    // shared with other processes), followed by the encrypted timestamp and
+    // odcid, authenticated together with the type and the peer address
+    const uint8_t type = odcid ? TOK_RTRY : TOK_NEW;
+    uint8_t * pos = tok;
+    *pos++ = ped->tok_kid;
+    *pos++ = type;
+    uint64_t seq;
+    rand_bytes(&seq, sizeof(seq));
+    memcpy(pos, &seq, sizeof(seq));
+    pos += sizeof(seq);
+
+    uint8_t plain[sizeof(uint32_t) + CID_LEN_MAX];
+    memcpy(plain, &t, sizeof(t));
+    const size_t plain_len = sizeof(t) + (odcid ? odcid->len : 0);
+    if (odcid)
+        memcpy(&plain[sizeof(t)], odcid->id, odcid->len);
+
+    uint8_t aad[sizeof(uint8_t) + sizeof(*peer)];
+    pos += ptls_aead_encrypt(ped->tok_enc, pos, plain, plain_len, seq, aad,
+                             tok_aad(aad, type, peer));
+    const uint16_t tok_len = (uint16_t)(pos - tok);
+#ifdef DEBUG_PROT
+    warn(DBG, "computed %s tok %s", odcid ? "Retry" : "NEW_TOKEN",
+         hex2str(tok, tok_len, (char[hex_str_len(MAX_TOK_LEN)]){""},
+                 hex_str_len(tok_len)));
+#endif
+    return tok_len;
 }
 
 
-bool verify_rtry_tok(struct q_conn * const c,
-                     const uint8_t * const tok,
-                     const uint16_t tok_len)
+/// Verify an address validation token received from @p peer.
+///
+/// @param      w        Warpcore engine.
+/// @param[in]  peer     Peer address.
+/// @param[in]  tok      Token.
+/// @param[in]  tok_len  Length of @p tok.
+/// @param[out] odcid    Original DCID, if this was a Retry token.
+///
+/// @return     True if the token is valid.
+///
+bool verify_tok(struct w_engine * const w,
+                const struct w_sockaddr * const peer,
+                const uint8_t * const tok,
+                const uint16_t tok_len,
+                struct cid * const odcid)
 {
-    const ptls_cipher_suite_t * const cs = &aes128gcmsha256;
-    ptls_hash_context_t * const hc = prep_hash_ctx(c, cs);
-
-    // hash current cid included in token
-    hc->update(hc, tok + cs->hash->digest_size,
-               tok_len - cs->hash->digest_size);
-    uint8_t buf[PTLS_MAX_DIGEST_SIZE + CID_LEN_MAX];
-    hc->final(hc, buf, PTLS_HASH_FINAL_MODE_FREE);
-
-    // #ifdef DEBUG_PROT
-    warn(DBG, "computed Retry tok %s",
-         hex2str(buf, cs->hash->digest_size,
-                 (char[hex_str_len(MAX_TOK_LEN)]){""},
-                 hex_str_len(cs->hash->digest_size)));
-    // #endif
-    if (memcmp(buf, tok, cs->hash->digest_size) == 0) {
-        c->odcid.len = (uint8_t)(tok_len - cs->hash->digest_size);
-        memcpy(&c->odcid.id, tok + cs->hash->digest_size, c->odcid.len);
-        return true;
+    struct per_engine_data * const ped = ped(w);
+    static const uint16_t hdr_len =
+        sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint64_t);
+    if (unlikely(tok_len < hdr_len + sizeof(uint32_t) + AEAD_LEN ||
+                 tok_len > RTRY_TOK_LEN_MAX))
+        goto fail;
+
+    // Retry tokens are only good for the handshake that is being retried
+    const uint8_t type = tok[1];
+    const bool rtry = type == TOK_RTRY;
+    if (unlikely(rtry == false && type != TOK_NEW))
+        goto fail;
+
+    const uint32_t now = (uint32_t)time(0);
+    if (unlikely(now >= ped->tok_rot))
+        rotate_tok_key(ped);
+
+    // we only accept tokens made with the current or previous key
+    const uint8_t kid = tok[0];
+    ptls_aead_context_t * const dec = ped->tok_dec[kid & 1];
+    if (unlikely(dec == 0 || (kid != ped->tok_kid &&
+                              kid != (uint8_t)(ped->tok_kid - 1))))
+        goto fail;
+
+    uint64_t seq;
+    memcpy(&seq, &tok[sizeof(kid) + sizeof(type)], sizeof(seq));
+    uint8_t plain[sizeof(uint32_t) + CID_LEN_MAX];
+    const size_t enc_len = (size_t)(tok_len - hdr_len);
+    uint8_t aad[sizeof(uint8_t) + sizeof(*peer)];
+    const size_t n = ptls_aead_decrypt(dec, plain, &tok[hdr_len], enc_len, seq,
+                                       aad, tok_aad(aad, type, peer));
+    if (unlikely(n > enc_len || n < sizeof(uint32_t)))
+        goto fail;
+
+    uint32_t t;
+    memcpy(&t, plain, sizeof(t));
+    if (unlikely(now - t > (rtry ? RTRY_TOK_LIFE : NEW_TOK_LIFE)))
+        goto fail;
+
+    if (rtry) {
+        odcid->len = (uint8_t)(n - sizeof(t));
+        memcpy(odcid->id, &plain[sizeof(t)], odcid->len);
     }
-    // #ifdef DEBUG_PROT
-    warn(DBG, "rx'ed Retry tok %s",
-         hex2str(tok, cs->hash->digest_size,
-                 (char[hex_str_len(MAX_TOK_LEN)]){""},
-                 hex_str_len(cs->hash->digest_size)));
-    // #endif
+    return true;
+
+fail:
+#ifdef DEBUG_PROT
+    warn(DBG, "rx'ed invalid tok %s",
+         hex2str(tok, tok_len, (char[hex_str_len(MAX_TOK_LEN)]){""},
+                 hex_str_len(tok_len)));
+#endif
     return false;
 }
 
 
-void make_rit(const struct q_conn * const c,
+void make_rit(struct w_engine * const w,
+              const uint32_t vers,
+              const struct cid * const odcid,
               const uint8_t flags,
               const struct cid * const dcid,
               const struct cid * const scid,
@@ -1785,22 +2072,22 @@ void make_rit(const struct q_conn * const c,
               const uint16_t tok_len,
               uint8_t * const rit)
 {
-    uint8_t * pos = ped(c->w)->scratch;
-    uint8_t * end = pos + ped(c->w)->scratch_len;
+    uint8_t * pos = ped(w)->scratch;
+    uint8_t * end = pos + ped(w)->scratch_len;
 
     // encode the pseudo packet
-    enc1(&pos, end, c->odcid.len);
-    encb(&pos, end, c->odcid.id, c->odcid.len);
+    enc1(&pos, end, odcid->len);
+    encb(&pos, end, odcid->id, odcid->len);
     enc1(&pos, end, flags);
-    enc4(&pos, end, c->vers);
+    enc4(&pos, end, vers);
     enc1(&pos, end, dcid->len);
     encb(&pos, end, dcid->id, dcid->len);
     enc1(&pos, end, scid->len);
     encb(&pos, end, scid->id, scid->len);
     encb(&pos, end, tok, tok_len);
 
-    ptls_aead_encrypt(ped(c->w)->rid_ctx, rit, 0, 0, 0, ped(c->w)->scratch,
-                      (size_t)(pos - ped(c->w)->scratch));
+    ptls_aead_encrypt(ped(w)->rid_ctx, rit, 0, 0, 0, ped(w)->scratch,
+                      (size_t)(pos - ped(w)->scratch));
 }
 
 
@@ -1836,6 +2123,7 @@ void flip_keys(struct q_conn * const c, const bool out)
     if (out == false)
         pnd->in_kyph = new_kyph;
     pnd->out_kyph = new_kyph;
+    c->sh_hdr_len = 0;
 }
 
 
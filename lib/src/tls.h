@@ -38,7 +38,10 @@ struct pkt_meta;        // IWYU pragma: no_forward_declare pkt_meta
 struct q_conf;          // IWYU pragma: no_forward_declare q_conf
 struct q_conn;          // IWYU pragma: no_forward_declare q_conn
 struct q_stream;        // IWYU pragma: no_forward_declare q_stream
+struct tckt_key;        // IWYU pragma: no_forward_declare tckt_key
+struct w_engine;        // IWYU pragma: no_forward_declare w_engine
 struct w_iov;           // IWYU pragma: no_forward_declare w_iov
+struct w_sockaddr;      // IWYU pragma: no_forward_declare w_sockaddr
 
 // IWYU pragma: no_include <quant/quant.h>
 // IWYU pragma: no_include "quic.h"
@@ -85,6 +88,7 @@ struct tls {
     ptls_handshake_properties_t tls_hshk_prop;
     size_t max_early_data;
     uint8_t * tp_buf;
+    uint8_t * tckt; ///< Copy of the session ticket we resume with.
 };
 
 
@@ -109,6 +113,14 @@ init_tls_ctx(const struct q_conf * const conf,
 extern void __attribute__((nonnull))
 free_tls_ctx(struct per_engine_data * const ped);
 
+#ifndef NO_SERVER
+extern const struct tckt_key * __attribute__((nonnull))
+cur_tckt_key(struct per_engine_data * const ped);
+
+extern const struct tckt_key * __attribute__((nonnull))
+get_tckt_key(struct per_engine_data * const ped, const uint32_t id);
+#endif
+
 extern uint16_t __attribute__((nonnull))
 dec_aead(const struct w_iov * const xv,
          const struct w_iov * const v,
@@ -122,13 +134,22 @@ enc_aead(const struct w_iov * const v,
          struct w_iov * const xv,
          const uint16_t pkt_nr_pos);
 
-extern void __attribute__((nonnull)) make_rtry_tok(struct q_conn * const c);
-
-extern bool __attribute__((nonnull)) verify_rtry_tok(struct q_conn * const c,
-                                                     const uint8_t * const tok,
-                                                     const uint16_t tok_len);
-
-extern void __attribute__((nonnull)) make_rit(const struct q_conn * const c,
+extern uint16_t __attribute__((nonnull(1, 2, 4)))
+make_tok(struct w_engine * const w,
+         const struct w_sockaddr * const peer,
+         const struct cid * const odcid,
+         uint8_t * const tok);
+
+extern bool __attribute__((nonnull))
+verify_tok(struct w_engine * const w,
+           const struct w_sockaddr * const peer,
+           const uint8_t * const tok,
+           const uint16_t tok_len,
+           struct cid * const odcid);
+
+extern void __attribute__((nonnull)) make_rit(struct w_engine * const w,
+                                              const uint32_t vers,
+                                              const struct cid * const odcid,
                                               const uint8_t flags,
                                               const struct cid * const dcid,
                                               const struct cid * const scid,
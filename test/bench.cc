@@ -28,6 +28,14 @@
 #include <net/if.h>
 #include <sys/socket.h>
 #include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include <benchmark/benchmark.h>
 #include <quant/quant.h>
@@ -39,17 +47,22 @@ extern "C" {
 #include <picotls/openssl.h> // IWYU pragma: keep
 
 #include "conn.h" // IWYU pragma: keep
+#include "diet.h"
+#include "frame.h"
+#include "marshall.h"
 #include "pkt.h"
 #include "pn.h" // IWYU pragma: keep
 #include "quic.h"
-#include "tls.h" // IWYU pragma: keep
+#include "stream.h" // IWYU pragma: keep
+#include "tls.h"    // IWYU pragma: keep
 
 #ifdef __cplusplus
 }
 #endif
 
 
-static struct q_conn * c;
+static struct q_conn * c; ///< Client conn.
+static struct q_conn * s; ///< Server conn, whose Initial keys match c's.
 static struct w_engine * w;
 
 
@@ -87,6 +100,568 @@ BENCHMARK(BM_quic_encryption)
     ;
 
 
+static void BM_quic_decryption(benchmark::State & state)
+{
+    const auto len = uint16_t(state.range(0));
+
+    struct pkt_meta * m;
+    struct w_iov * v = alloc_iov(w, AF_INET, len, 0, &m);
+    struct pkt_meta * mx;
+    struct w_iov * x = alloc_iov(w, AF_INET, 0, 0, &mx);
+
+    rand_bytes(v->buf, len);
+    m->hdr.type = LH_INIT;
+    m->hdr.flags = LH | m->hdr.type;
+    m->hdr.hdr_len = 16;
+    m->hdr.len = len;
+    m->pn = pn_for_epoch(c, ep_init);
+    enc_aead(v, m, x, 0);
+
+    // the server's Initial RX keys match the client's TX keys
+    const struct cipher_ctx * const ctx = &s->pns[pn_init].early.in;
+    for (auto _ : state)
+        if (dec_aead(x, v, m, x->len, ctx) == 0) {
+            state.SkipWithError("dec_aead failed");
+            break;
+        }
+    state.SetBytesProcessed(int64_t(state.iterations() * len)); // NOLINT
+
+    free_iov(x, mx);
+    free_iov(v, m);
+}
+
+
+BENCHMARK(BM_quic_decryption)->RangeMultiplier(2)->Range(16, 1500);
+
+
+static void BM_pkt_hdr_dec(benchmark::State & state)
+{
+    const auto lh = bool(state.range(0));
+
+    struct pkt_meta * mx;
+    struct w_iov * x = alloc_iov(w, AF_INET, 0, 0, &mx);
+    struct pkt_meta * m;
+    struct w_iov * v = alloc_iov(w, AF_INET, 0, 0, &m);
+
+    uint8_t * pos = x->buf;
+    const uint8_t * const end = x->buf + x->len;
+    if (lh) {
+        enc1(&pos, end, LH | LH_INIT);
+        enc4(&pos, end, ok_vers[0]);
+        enc1(&pos, end, c->dcid->len);
+        encb(&pos, end, c->dcid->id, c->dcid->len);
+        enc1(&pos, end, c->scid->len);
+        encb(&pos, end, c->scid->id, c->scid->len);
+        encv(&pos, end, 0);    // token length
+        encv(&pos, end, 1200); // length
+    } else {
+        enc1(&pos, end, SH);
+        encb(&pos, end, c->scid->id, c->scid->len);
+    }
+    x->len = 1252;
+    state.SetLabel(lh ? "Initial" : "1-RTT");
+
+    uint8_t tok[MAX_TOK_LEN];
+    uint16_t tok_len;
+    uint8_t rit[RIT_LEN];
+    for (auto _ : state) {
+        tok_len = 0;
+        if (dec_pkt_hdr_beginning(x, v, m, false, tok, &tok_len, rit,
+                                  c->scid->len) == false) {
+            state.SkipWithError("dec_pkt_hdr_beginning failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+
+    free_iov(v, m);
+    free_iov(x, mx);
+}
+
+
+BENCHMARK(BM_pkt_hdr_dec)->DenseRange(0, 1);
+
+
+static void BM_hp(benchmark::State & state)
+{
+    struct pkt_meta * m;
+    struct w_iov * x = alloc_iov(w, AF_INET, 0, 0, &m);
+
+    rand_bytes(x->buf, x->len);
+    x->buf[0] = SH;
+    m->hdr.flags = SH;
+    m->hdr.type = SH;
+    const uint16_t pkt_nr_pos = 1 + c->dcid->len;
+
+    // undo_hp() is static; each xor_hp() call toggles the protection
+    const struct cipher_ctx * const ctx = &c->pns[pn_init].early.out;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(xor_hp(x, m, ctx, pkt_nr_pos, false));
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+
+    free_iov(x, m);
+}
+
+
+BENCHMARK(BM_hp);
+
+
+static const char * const frame_mix[] = {"ACK", "STREAM", "mixed"};
+
+
+static void BM_dec_frames(benchmark::State & state)
+{
+    const auto mix = size_t(state.range(0));
+    const uint16_t hdr_len = 1 + 4 + 1; // flags, dcid, pkt nr
+
+    struct pn_space * const pn = &s->pns[pn_data];
+    for (uint_t n = 0; n < 100; n++)
+        diet_insert(&pn->acked_or_lost, n, 0);
+
+    struct pkt_meta * m;
+    struct w_iov * v = alloc_iov(w, AF_INET, 0, 0, &m);
+    uint8_t * const buf = v->buf;
+    uint8_t * pos = buf + hdr_len;
+    const uint8_t * const end = buf + v->len;
+    uint16_t strm_len = 0;
+
+    if (mix != 1) {
+        // ACK w/three ranges, for pkts that were already acknowledged
+        enc1(&pos, end, FRM_ACK);
+        encv(&pos, end, 99); // largest acked
+        encv(&pos, end, 5);  // ack delay
+        encv(&pos, end, 2);  // ack range count
+        encv(&pos, end, 9);  // first ack range
+        encv(&pos, end, 4);  // gap
+        encv(&pos, end, 19); // ack range
+        encv(&pos, end, 2);  // gap
+        encv(&pos, end, 29); // ack range
+    }
+    if (mix == 2) {
+        enc1(&pos, end, FRM_MCD);
+        encv(&pos, end, 1 << 20);
+        enc1(&pos, end, FRM_PNG);
+        strm_len = 1000;
+    } else if (mix == 1)
+        strm_len = 1200;
+    if (strm_len) {
+        enc1(&pos, end, FRM_STR | F_STREAM_LEN);
+        encv(&pos, end, 0); // sid
+        encv(&pos, end, strm_len);
+        rand_bytes(pos, strm_len);
+        pos += strm_len;
+    }
+    if (mix == 2) {
+        memset(pos, FRM_PAD, 100);
+        pos += 100;
+    }
+    const auto len = uint16_t(pos - buf);
+    state.SetLabel(frame_mix[mix]);
+
+    m->hdr.flags = SH;
+    m->hdr.type = SH;
+    m->hdr.hdr_len = hdr_len;
+    m->pn = pn;
+    const struct pkt_meta tmpl = *m;
+
+    for (auto _ : state) {
+        v->buf = buf;
+        v->len = len;
+        *m = tmpl;
+        if (dec_frames(s, &v, &m) == false) {
+            state.SkipWithError("dec_frames failed");
+            break;
+        }
+        if (m->strm) {
+            // take the data back out and rewind, to stay on the in-order path
+            sq_remove_head(&m->strm->in, next);
+            m->strm->in_data_off = 0;
+        }
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()));       // NOLINT
+    state.SetBytesProcessed(int64_t(state.iterations() * len)); // NOLINT
+
+    v->buf = buf;
+    free_iov(v, m);
+    diet_free(&pn->acked_or_lost);
+}
+
+
+BENCHMARK(BM_dec_frames)->DenseRange(0, 2);
+
+
+static void BM_ack_enc(benchmark::State & state)
+{
+    const auto rngs = uint_t(state.range(0));
+
+    struct pn_space * const pn = &c->pns[pn_data];
+    for (uint_t n = 0; n < rngs; n++)
+        diet_insert(&pn->recv, n * 3, loop_now());
+
+    struct pkt_meta * m;
+    struct w_iov * v = alloc_iov(w, AF_INET, 0, 0, &m);
+    m->hdr.flags = SH;
+    m->hdr.type = SH;
+    m->pn = pn;
+    const uint8_t * const end = v->buf + v->len;
+#ifndef NO_QINFO
+    struct q_conn_info * const ci = &c->i;
+#else
+    struct q_conn_info * const ci = nullptr;
+#endif
+
+    for (auto _ : state) {
+        uint8_t * pos = v->buf;
+        benchmark::DoNotOptimize(enc_ack_frame(ci, &pos, v->buf, end, m, pn));
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+
+    free_iov(v, m);
+    diet_free(&pn->recv);
+}
+
+
+BENCHMARK(BM_ack_enc)->Arg(1)->Arg(10)->Arg(100);
+
+
+// one value per varint encoding length
+static const uint64_t varint_val[] = {37, 15293, 494878333,
+                                      151288809941952652};
+
+
+static void BM_varint_enc(benchmark::State & state)
+{
+    const uint64_t val = varint_val[state.range(0)];
+    uint8_t buf[8];
+
+    for (auto _ : state) {
+        uint8_t * pos = buf;
+        encv(&pos, buf + sizeof(buf), val);
+        benchmark::DoNotOptimize(pos);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+}
+
+
+BENCHMARK(BM_varint_enc)->DenseRange(0, 3);
+
+
+static void BM_varint_dec(benchmark::State & state)
+{
+    uint8_t buf[8];
+    uint8_t * p = buf;
+    encv(&p, buf + sizeof(buf), varint_val[state.range(0)]);
+
+    for (auto _ : state) {
+        const uint8_t * pos = buf;
+        uint64_t val;
+        benchmark::DoNotOptimize(decv(&val, &pos, buf + sizeof(buf)));
+        benchmark::DoNotOptimize(val);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+}
+
+
+BENCHMARK(BM_varint_dec)->DenseRange(0, 3);
+
+
+// the byte-at-a-time varint codec that marshall.c used to implement
+static void encv_bytewise(uint8_t ** pos, const uint64_t val)
+{
+    if (val > 0x3fffffff) {
+        *(*pos)++ = ((val >> 56) & 0x3f) + 0xc0;
+        for (int i = 48; i >= 0; i -= 8)
+            *(*pos)++ = (val >> i) & 0xff;
+    } else if (val > 0x3fff) {
+        *(*pos)++ = ((val >> 24) & 0x3f) + 0x80;
+        *(*pos)++ = (val >> 16) & 0xff;
+        *(*pos)++ = (val >> 8) & 0xff;
+        *(*pos)++ = val & 0xff;
+    } else if (val > 0x3f) {
+        *(*pos)++ = ((val >> 8) & 0x3f) + 0x40;
+        *(*pos)++ = val & 0xff;
+    } else
+        *(*pos)++ = val & 0x3f;
+}
+
+
+static bool
+decv_bytewise(uint64_t * val, const uint8_t ** pos, const uint8_t * end)
+{
+    const uint8_t len = uint8_t(1 << (**pos >> 6));
+    if (*pos + len > end)
+        return false;
+    *val = **pos & 0x3f;
+    for (uint8_t i = 1; i < len; i++)
+        *val = (*val << 8) + *(*pos + i);
+    *pos += len;
+    return true;
+}
+
+
+static void BM_varint_enc_bytewise(benchmark::State & state)
+{
+    const uint64_t val = varint_val[state.range(0)];
+    uint8_t buf[8];
+
+    for (auto _ : state) {
+        uint8_t * pos = buf;
+        encv_bytewise(&pos, val);
+        benchmark::DoNotOptimize(pos);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+}
+
+
+BENCHMARK(BM_varint_enc_bytewise)->DenseRange(0, 3);
+
+
+// decode a packet's worth of varints of random lengths, so that the length
+// class is not predictable; arg 0 is the current codec, 1 the bytewise one
+static void BM_varint_dec_mixed(benchmark::State & state)
+{
+    uint8_t buf[1500];
+    uint8_t * p = buf;
+    size_t n = 0;
+    while (p + sizeof(uint64_t) <= buf + sizeof(buf)) {
+        encv(&p, buf + sizeof(buf), varint_val[w_rand_uniform32(4)]);
+        n++;
+    }
+    const uint8_t * const end = p;
+
+    for (auto _ : state) {
+        const uint8_t * pos = buf;
+        uint64_t val;
+        while (pos < end) {
+            if (state.range(0) == 0)
+                decv(&val, &pos, end);
+            else
+                decv_bytewise(&val, &pos, end);
+            benchmark::DoNotOptimize(val);
+        }
+    }
+    state.SetItemsProcessed(int64_t(state.iterations() * n)); // NOLINT
+}
+
+
+BENCHMARK(BM_varint_dec_mixed)->DenseRange(0, 1);
+
+
+// decode ACK gap/range pairs; arg 0 uses decv2(), arg 1 two decv() calls
+static void BM_varint_dec_pairs(benchmark::State & state)
+{
+    uint8_t buf[1500];
+    uint8_t * p = buf;
+    size_t n = 0;
+    while (p + 2 * sizeof(uint64_t) <= buf + sizeof(buf)) {
+        encv(&p, buf + sizeof(buf), w_rand_uniform32(100));   // gap
+        encv(&p, buf + sizeof(buf), w_rand_uniform32(20000)); // range
+        n++;
+    }
+    const uint8_t * const end = p;
+
+    for (auto _ : state) {
+        const uint8_t * pos = buf;
+        uint64_t gap;
+        uint64_t rng;
+        while (pos < end) {
+            if (state.range(0) == 0)
+                decv2(&gap, &rng, &pos, end);
+            else {
+                decv(&gap, &pos, end);
+                decv(&rng, &pos, end);
+            }
+            benchmark::DoNotOptimize(gap);
+            benchmark::DoNotOptimize(rng);
+        }
+    }
+    state.SetItemsProcessed(int64_t(state.iterations() * n)); // NOLINT
+}
+
+
+BENCHMARK(BM_varint_dec_pairs)->DenseRange(0, 1);
+
+
+static void BM_diet_insert(benchmark::State & state)
+{
+    const auto n = uint_t(state.range(0));
+    // stride 1 merges into one interval, stride 2 leaves a gap after each
+    const auto stride = uint_t(state.range(1));
+
+    struct diet d = diet_initializer(d);
+    for (auto _ : state) {
+        for (uint_t i = 0; i < n; i++)
+            diet_insert(&d, i * stride, 0);
+        state.PauseTiming();
+        diet_free(&d);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations() * n)); // NOLINT
+}
+
+
+BENCHMARK(BM_diet_insert)->RangeMultiplier(10)->Ranges({{10, 1000}, {1, 2}});
+
+
+static void BM_diet_find(benchmark::State & state)
+{
+    const auto n = uint_t(state.range(0));
+
+    struct diet d = diet_initializer(d);
+    for (uint_t i = 0; i < n; i++)
+        diet_insert(&d, i * 2, 0);
+
+    uint_t i = 0;
+    for (auto _ : state)
+        // alternate between hits and misses
+        benchmark::DoNotOptimize(diet_find(&d, i++ % (n * 2)));
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+
+    diet_free(&d);
+}
+
+
+BENCHMARK(BM_diet_find)->RangeMultiplier(10)->Range(10, 1000);
+
+
+#ifndef NO_MIGRATION
+static void BM_cid_lookup(benchmark::State & state)
+{
+    const auto n = size_t(state.range(0));
+
+    std::vector<struct cid> cids(n);
+    khash_t(conns_by_id) h = {};
+    for (auto & id : cids) {
+        mk_rand_cid(&id, 8, false);
+        int ret;
+        const khiter_t k = kh_put(conns_by_id, &h, &id, &ret);
+        kh_val(&h, k) = c;
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        const khiter_t k = kh_get(conns_by_id, &h, &cids[i++ % n]);
+        benchmark::DoNotOptimize(kh_val(&h, k));
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+
+    kh_release(conns_by_id, &h);
+}
+
+
+BENCHMARK(BM_cid_lookup)->RangeMultiplier(10)->Range(10, 100000);
+#endif
+
+
+static void BM_retry_token_make(benchmark::State & state)
+{
+    uint8_t tok[RTRY_TOK_LEN_MAX];
+    for (auto _ : state)
+        benchmark::DoNotOptimize(make_tok(c->w, &c->peer, c->scid, tok));
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+}
+
+
+BENCHMARK(BM_retry_token_make);
+
+
+static void BM_retry_token_verify(benchmark::State & state)
+{
+    uint8_t tok[RTRY_TOK_LEN_MAX];
+    const uint16_t tok_len = make_tok(c->w, &c->peer, c->scid, tok);
+    struct cid odcid = {};
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            verify_tok(c->w, &c->peer, tok, tok_len, &odcid));
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+}
+
+
+BENCHMARK(BM_retry_token_verify);
+
+
+static void BM_retry_integrity_tag(benchmark::State & state)
+{
+    uint8_t tok[RTRY_TOK_LEN_MAX];
+    const uint16_t tok_len = make_tok(c->w, &c->peer, c->scid, tok);
+    uint8_t rit[RIT_LEN];
+
+    for (auto _ : state)
+        make_rit(c->w, c->vers, c->scid, LH | LH_RTRY, c->dcid, c->scid, tok,
+                 tok_len, rit);
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+}
+
+
+BENCHMARK(BM_retry_integrity_tag);
+
+
+#ifdef __linux__
+static int open_dtlb_miss_counter()
+{
+    struct perf_event_attr pe = {};
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return int(syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0)); // NOLINT
+}
+#endif
+
+
+static void BM_meta_access(benchmark::State & state)
+{
+    const auto huge = state.range(0) != 0;
+    const size_t n = 1000000;
+    const size_t len = n * sizeof(struct pkt_meta);
+    auto * const m = static_cast<struct pkt_meta *>(alloc_meta(len, huge));
+
+    // touch the meta-data in a random order, like ACK processing does
+    std::vector<uint32_t> idx(n);
+    for (auto & i : idx)
+        i = w_rand_uniform32(uint32_t(n));
+
+#ifdef __linux__
+    const int fd = open_dtlb_miss_counter();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);  // NOLINT
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); // NOLINT
+    }
+#endif
+
+    size_t i = 0;
+    for (auto _ : state) {
+        struct pkt_meta * const p = &m[idx[i++ % n]];
+        p->strm_data_len++;
+        benchmark::DoNotOptimize(p);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations())); // NOLINT
+
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0); // NOLINT
+        uint64_t misses = 0;
+        if (read(fd, &misses, sizeof(misses)) == sizeof(misses))
+            state.counters["dTLB_misses"] = benchmark::Counter(
+                double(misses), benchmark::Counter::kAvgIterations);
+        close(fd);
+    }
+#endif
+
+    free_meta(m, len, huge);
+}
+
+
+BENCHMARK(BM_meta_access)->Arg(0)->Arg(1);
+
+
 // BENCHMARK_MAIN()
 
 int main(int argc, char ** argv)
@@ -105,8 +680,14 @@ int main(int argc, char ** argv)
     struct cid cid = {};
     cid.len = 4;
     memcpy(cid.id, "1234", cid.len);
-    c = new_conn(w, 0, &cid, &cid, nullptr, "", bswap16(55555), nullptr);
+    struct cid odcid = {};
+    odcid.len = 4;
+    memcpy(odcid.id, "4321", odcid.len);
+    c = new_conn(w, 0, &odcid, &cid, nullptr, "", bswap16(55555), nullptr);
     init_tls(c, "", nullptr);
+    s = new_conn(w, 0, &cid, &odcid, nullptr, nullptr, bswap16(55556),
+                 nullptr);
+    init_tls(s, nullptr, nullptr);
     benchmark::RunSpecifiedBenchmarks();
 
     q_cleanup(w);
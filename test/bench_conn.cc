@@ -24,19 +24,150 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 #include <arpa/inet.h>
+#include <cinttypes>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <fcntl.h>
 #include <libgen.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include <benchmark/benchmark.h>
 #include <quant/quant.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "conn.h"   // IWYU pragma: keep
+#include "netsim.h" // IWYU pragma: keep
+
+#ifdef __cplusplus
+}
+#endif
+
 
 static struct w_engine * w;
 static struct q_conn *cc, *sc;
+static struct sockaddr_in6 sip;
+
+
+#ifdef __GLIBC__
+// count heap allocations by interposing the glibc allocator
+static uint64_t n_allocs;
+
+extern "C" {
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+
+void * malloc(size_t size) noexcept
+{
+    n_allocs++;
+    return __libc_malloc(size);
+}
+
+
+void * calloc(size_t nmemb, size_t size) noexcept
+{
+    n_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+
+void * realloc(void * ptr, size_t size) noexcept
+{
+    n_allocs++;
+    return __libc_realloc(ptr, size);
+}
+}
+#else
+static const uint64_t n_allocs = 0;
+#endif
+
+
+static uint64_t cpu_ns()
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * NS_PER_S + uint64_t(ts.tv_nsec);
+}
+
+
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+static uint64_t pkts_out(struct q_conn * const a, struct q_conn * const b)
+{
+#ifndef NO_QINFO
+    struct q_conn_info ai = {};
+    struct q_conn_info bi = {};
+    q_info(a, &ai);
+    q_info(b, &bi);
+    return ai.pkts_out + bi.pkts_out;
+#else
+    return 0;
+#endif
+}
+
+
+static uint64_t dgrams_out(struct q_conn * const a, struct q_conn * const b)
+{
+#ifndef NO_QINFO
+    struct q_conn_info ai = {};
+    struct q_conn_info bi = {};
+    q_info(a, &ai);
+    q_info(b, &bi);
+    return ai.dgrams_out + bi.dgrams_out;
+#else
+    return 0;
+#endif
+}
+
+
+/// Snapshot of the counters that are reported per packet.
+struct meter {
+    uint64_t pkts;
+    uint64_t allocs;
+    uint64_t cpu;
+    uint64_t cyc;
+
+    explicit meter(const uint64_t p = 0)
+        : pkts(p), allocs(n_allocs), cpu(cpu_ns()), cyc(cycles())
+    {
+    }
+
+    /// Report packets/s, CPU-ns/packet, cycles/packet and allocations/packet,
+    /// given that the packet count is now @p p. Comparing cycles/packet
+    /// against a -DNO_RX_FAST build shows what the RX fast path saves.
+    void report(benchmark::State & state, const uint64_t p) const
+    {
+        const auto n = double(p - pkts);
+        if (n == 0)
+            return;
+        state.counters["pkts"] =
+            benchmark::Counter(n, benchmark::Counter::kIsRate);
+        state.counters["ns/pkt"] = double(cpu_ns() - cpu) / n;
+        state.counters["cycles/pkt"] = double(cycles() - cyc) / n;
+        state.counters["allocs/pkt"] = double(n_allocs - allocs) / n;
+    }
+};
 
 
 // static void log(const struct q_conn_info * const cci,
@@ -59,23 +190,24 @@ static struct q_conn *cc, *sc;
 // }
 
 
-static inline uint64_t io(const uint64_t len)
+static inline uint64_t
+io(struct q_conn * const c, struct q_conn * const s, const uint64_t len)
 {
     // reserve a new stream
-    struct q_stream * const cs = q_rsv_stream(cc, true);
+    struct q_stream * const cs = q_rsv_stream(c, true);
     if (unlikely(cs == nullptr))
         return 0;
 
     // allocate buffers to transmit a packet
     struct w_iov_sq o = w_iov_sq_initializer(o);
-    q_alloc(w, &o, cc, q_conn_af(cc), len);
+    q_alloc(w, &o, c, q_conn_af(c), len);
 
     // send the data
     q_write(cs, &o, true);
 
     // read the data
     struct w_iov_sq i = w_iov_sq_initializer(i);
-    struct q_stream * const ss = q_read(sc, &i, true);
+    struct q_stream * const ss = q_read(s, &i, true);
     if (likely(ss)) {
         q_read_stream(ss, &i, true);
         q_free_stream(ss);
@@ -85,15 +217,6 @@ static inline uint64_t io(const uint64_t len)
     const uint64_t ilen = w_iov_sq_len(&i);
     q_free(&i);
     q_free(&o);
-
-#ifndef NO_QINFO
-    struct q_conn_info cci = {0};
-    struct q_conn_info sci = {0};
-    q_info(cc, &cci);
-    q_info(sc, &sci);
-    // log(&cci, &sci);
-#endif
-
     return ilen;
 }
 
@@ -101,14 +224,16 @@ static inline uint64_t io(const uint64_t len)
 static void BM_conn(benchmark::State & state)
 {
     const auto len = uint64_t(state.range(0));
+    const meter m(pkts_out(cc, sc));
     for (auto _ : state) {
-        const uint64_t ilen = io(len);
+        const uint64_t ilen = io(cc, sc, len);
         if (ilen != len) {
             state.SkipWithError("error");
             return;
         }
     }
     state.SetBytesProcessed(int64_t(state.iterations() * len)); // NOLINT
+    m.report(state, pkts_out(cc, sc));
 }
 
 
@@ -117,6 +242,252 @@ BENCHMARK(BM_conn)->RangeMultiplier(2)->Range(1024, 1024 * 1024 * 32)
     ;
 
 
+#define HSHK_REQ_LEN 64
+
+
+static bool
+hshk(const char * const sni, uint64_t * const pkts, uint64_t * const dgrams)
+{
+    // every handshake carries a small request, which rides in 0-RTT when
+    // there is a ticket for the server name and is sent after it otherwise
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    struct q_stream * es = nullptr;
+    q_alloc(w, &o, nullptr, AF_INET6, HSHK_REQ_LEN);
+
+    struct q_conn * const hc =
+        q_connect(w, reinterpret_cast<struct sockaddr *>(&sip), // NOLINT
+                  sni, &o, &es, true, nullptr, nullptr);
+    struct q_conn * const hs = q_accept(w, nullptr);
+    if (hc && hs && pkts) {
+        *pkts += pkts_out(hc, hs);
+        *dgrams += dgrams_out(hc, hs);
+    }
+
+    if (hc)
+        q_close(hc, 0, nullptr);
+    if (hs)
+        q_close(hs, 0, nullptr);
+    q_free(&o);
+    return hc && hs;
+}
+
+
+static void BM_hshk(benchmark::State & state)
+{
+    // 0-RTT handshakes resume from a ticket for a fixed server name; 1-RTT
+    // handshakes use a new name each time, so there is never a ticket
+    const bool zero_rtt = state.range(0) != 0;
+
+    // obtain the ticket outside the timed loop, so no iteration falls back
+    // to a full handshake
+    if (zero_rtt && hshk("0rtt.example.org", nullptr, nullptr) == false) {
+        state.SkipWithError("error");
+        return;
+    }
+
+    uint64_t n = 0;
+    uint64_t pkts = 0;
+    uint64_t dgrams = 0;
+    const meter m;
+    for (auto _ : state) {
+        char sni[32];
+        if (zero_rtt)
+            snprintf(sni, sizeof(sni), "0rtt.example.org");
+        else
+            snprintf(sni, sizeof(sni), "%" PRIu64 ".example.org", n++);
+
+        if (hshk(sni, &pkts, &dgrams) == false) {
+            state.SkipWithError("error");
+            return;
+        }
+    }
+    state.SetBytesProcessed(
+        int64_t(state.iterations() * HSHK_REQ_LEN)); // NOLINT
+    state.counters["hshks"] = benchmark::Counter(
+        double(state.iterations()), benchmark::Counter::kIsRate);
+    // how well enc_pkt() coalesces the handshake flights into datagrams
+    state.counters["dgrams/hshk"] =
+        double(dgrams) / double(state.iterations());
+    state.counters["pkts/hshk"] = double(pkts) / double(state.iterations());
+    m.report(state, pkts);
+}
+
+
+BENCHMARK(BM_hshk)->ArgName("0rtt")->Arg(1)->Arg(0);
+
+
+static void BM_streams(benchmark::State & state)
+{
+    // many small concurrent streams on one connection
+    const auto n = size_t(state.range(0));
+    std::vector<struct q_stream *> cs(n);
+    const meter m(pkts_out(cc, sc));
+    for (auto _ : state) {
+        for (auto & s : cs) {
+            s = q_rsv_stream(cc, true);
+            q_write_str(w, s, "0123456789abcdef", 16, true);
+        }
+
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        for (size_t done = 0; done < n;) {
+            struct q_stream * const ss = q_read(sc, &i, true);
+            if (ss == nullptr) {
+                state.SkipWithError("error");
+                return;
+            }
+            if (q_peer_closed_stream(ss)) {
+                q_free_stream(ss);
+                done++;
+            }
+        }
+
+        for (auto & s : cs)
+            q_free_stream(s);
+        q_free(&i);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations() * n));      // NOLINT
+    state.SetBytesProcessed(int64_t(state.iterations() * n * 16)); // NOLINT
+    m.report(state, pkts_out(cc, sc));
+}
+
+
+BENCHMARK(BM_streams)->RangeMultiplier(4)->Range(4, 256);
+
+
+static void BM_conns(benchmark::State & state)
+{
+    // a small request on each of many concurrent connections
+    const auto n = size_t(state.range(0));
+    std::vector<std::pair<struct q_conn *, struct q_conn *>> conns(n);
+    for (auto & p : conns) {
+        p.first =
+            q_connect(w, reinterpret_cast<struct sockaddr *>(&sip), // NOLINT
+                      "localhost", nullptr, nullptr, true, nullptr, nullptr);
+        p.second = q_accept(w, nullptr);
+        if (p.first == nullptr || p.second == nullptr) {
+            state.SkipWithError("error");
+            return;
+        }
+    }
+
+    uint64_t pkts = 0;
+    for (const auto & p : conns)
+        pkts += pkts_out(p.first, p.second);
+    const meter m(pkts);
+
+    for (auto _ : state)
+        for (const auto & p : conns)
+            if (io(p.first, p.second, 128) != 128) {
+                state.SkipWithError("error");
+                return;
+            }
+
+    pkts = 0;
+    for (const auto & p : conns)
+        pkts += pkts_out(p.first, p.second);
+    state.SetItemsProcessed(int64_t(state.iterations() * n));       // NOLINT
+    state.SetBytesProcessed(int64_t(state.iterations() * n * 128)); // NOLINT
+    m.report(state, pkts);
+
+    for (const auto & p : conns) {
+        q_close(p.first, 0, nullptr);
+        q_close(p.second, 0, nullptr);
+    }
+}
+
+
+BENCHMARK(BM_conns)->RangeMultiplier(10)->Range(10, 1000);
+
+
+static void BM_bidi(benchmark::State & state)
+{
+    // both ends send at the same time, so each also generates ACKs
+    const auto len = uint64_t(state.range(0));
+    const meter m(pkts_out(cc, sc));
+    for (auto _ : state) {
+        struct q_stream * const cs = q_rsv_stream(cc, true);
+        struct q_stream * const ss = q_rsv_stream(sc, true);
+        struct w_iov_sq co = w_iov_sq_initializer(co);
+        struct w_iov_sq so = w_iov_sq_initializer(so);
+        q_alloc(w, &co, cc, q_conn_af(cc), len);
+        q_alloc(w, &so, sc, q_conn_af(sc), len);
+        q_write(cs, &co, true);
+        q_write(ss, &so, true);
+
+        struct w_iov_sq ci = w_iov_sq_initializer(ci);
+        struct w_iov_sq si = w_iov_sq_initializer(si);
+        struct q_stream * const sr = q_read(sc, &si, true);
+        struct q_stream * const cr = q_read(cc, &ci, true);
+        if (sr == nullptr || cr == nullptr) {
+            state.SkipWithError("error");
+            return;
+        }
+        q_read_stream(sr, &si, true);
+        q_read_stream(cr, &ci, true);
+        const bool ok = w_iov_sq_len(&si) == len && w_iov_sq_len(&ci) == len;
+
+        q_free_stream(sr);
+        q_free_stream(cr);
+        q_free_stream(cs);
+        q_free_stream(ss);
+        q_free(&ci);
+        q_free(&si);
+        q_free(&co);
+        q_free(&so);
+        if (ok == false) {
+            state.SkipWithError("error");
+            return;
+        }
+    }
+    state.SetBytesProcessed(int64_t(state.iterations() * 2 * len)); // NOLINT
+    m.report(state, pkts_out(cc, sc));
+}
+
+
+BENCHMARK(BM_bidi)->RangeMultiplier(8)->Range(1024, 1024 * 1024 * 8);
+
+
+static void BM_loss(benchmark::State & state)
+{
+    // transfers over a simulated 20 ms link with the given loss (in percent)
+    // and 1% reordering, so that loss recovery dominates
+    const auto len = uint64_t(1024 * 1024);
+    const struct netsim_conf ns = {0,
+                                   20 * NS_PER_MS,
+                                   2 * NS_PER_MS,
+                                   0,
+                                   uint32_t(state.range(0) * 10000),
+                                   10000,
+                                   1,
+                                   0,
+                                   {}};
+    netsim_init(w, &ns);
+    netsim_bind(cc->sock);
+    netsim_bind(sc->sock);
+
+    const meter m(pkts_out(cc, sc));
+    const uint64_t t = netsim_now();
+    for (auto _ : state)
+        if (io(cc, sc, len) != len) {
+            state.SkipWithError("error");
+            break;
+        }
+    state.SetBytesProcessed(int64_t(state.iterations() * len)); // NOLINT
+    m.report(state, pkts_out(cc, sc));
+
+    struct netsim_stats s = {};
+    netsim_get_stats(&s);
+    state.counters["lost"] = double(s.lost);
+    state.counters["sim_Mbps"] =
+        double(state.iterations() * len * 8 * NS_PER_S) /
+        double(netsim_now() - t) / 1e6;
+    netsim_cleanup();
+}
+
+
+BENCHMARK(BM_loss)->ArgName("loss%")->Arg(1)->Arg(5)->Arg(10);
+
+
 // BENCHMARK_MAIN()
 
 int main(int argc __attribute__((unused)), char ** argv)
@@ -125,12 +496,18 @@ int main(int argc __attribute__((unused)), char ** argv)
     util_dlevel = WRN; // default to maximum compiled-in verbosity
 #endif
 
+    // use a fresh ticket cache, so 0-RTT only resumes tickets from this run
+    char tickets[] = "/tmp/bench_conn.XXXXXX";
+    const int tfd = mkstemp(tickets);
+    ensure(tfd != -1, "mkstemp");
+    close(tfd);
+
     // init
     const int cwd = open(".", O_CLOEXEC);
     ensure(cwd != -1, "cannot open");
     ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
-    const struct q_conf conf = {nullptr, nullptr, "dummy.crt", "dummy.key",
-                                nullptr, nullptr, 1000000};
+    const struct q_conf conf = {nullptr, tickets, "dummy.crt", "dummy.key",
+                                nullptr, nullptr, nullptr, 1000000};
     w = q_init("lo"
 #ifndef __linux__
                "0"
@@ -143,7 +520,6 @@ int main(int argc __attribute__((unused)), char ** argv)
     q_bind(w, 0, 55555);
 
     // connect to server
-    struct sockaddr_in6 sip = {};
     sip.sin6_family = AF_INET6;
     sip.sin6_port = bswap16(55555);
     inet_pton(sip.sin6_family, "::1", &sip.sin6_addr);
@@ -161,4 +537,5 @@ int main(int argc __attribute__((unused)), char ** argv)
     q_close(cc, 0, nullptr);
     q_close(sc, 0, nullptr);
     q_cleanup(w);
+    unlink(tickets);
 }
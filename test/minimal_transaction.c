@@ -138,7 +138,7 @@ void quic_transaction(const char * const req, const size_t req_len)
     DSTACK_LOG("DSTACK 1" DSTACK_LOG_NEWLINE);
 
     // XXX: change "flash" to 0 to disable 0-RTT:
-    static const struct q_conf qc = {0, "flash", 0, 0, 0, 0, 15, false};
+    static const struct q_conf qc = {0, "flash", 0, 0, 0, 0, 0, 15};
     struct w_engine * const w = q_init(IF_NAME, &qc);
 
     static const char peername[] = "172.19.235.111";
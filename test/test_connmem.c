@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <quant/quant.h>
+
+#include "conn.h"
+
+
+#define N_CONNS 32
+
+
+static size_t heap_used(void)
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    return mallinfo2().uordblks;
+#else
+    return (size_t)mallinfo().uordblks;
+#endif
+#else
+    return 0; // no portable way to get this
+#endif
+}
+
+
+static void chk_cold(const struct q_conn * const c)
+{
+    // an idle connection without Retry, migration or qlog has no cold state
+    ensure(c->tok == 0, "tok allocated");
+    ensure(c->pref_addr == 0, "pref_addr allocated");
+#ifndef NO_MIGRATION
+    ensure(c->migr == 0, "migr allocated");
+#endif
+#ifndef NO_QLOG
+    ensure(c->qlog_file == 0, "qlog_file allocated");
+#endif
+}
+
+
+int main(int argc __attribute__((unused)), char * argv[])
+{
+#ifndef NDEBUG
+    util_dlevel = ERR;
+#endif
+
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    __extension__ const struct q_conf conf = {.tls_cert = "dummy.crt",
+                                              .tls_key = "dummy.key"};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+    q_bind(w, 0, 55556);
+
+    struct sockaddr_in6 sip = {.sin6_family = AF_INET6,
+                               .sin6_port = bswap16(55556)};
+    inet_pton(AF_INET6, "::1", &sip.sin6_addr);
+
+    // open a number of idle connections and measure the heap growth
+    struct q_conn * cc[N_CONNS];
+    struct q_conn * sc[N_CONNS];
+    const size_t before = heap_used();
+    for (size_t i = 0; i < N_CONNS; i++) {
+        cc[i] = q_connect(w, (const struct sockaddr *)&sip, "localhost", 0, 0,
+                          true, 0, 0);
+        ensure(cc[i], "is zero");
+        sc[i] = q_accept(w, 0);
+        ensure(sc[i], "is zero");
+        chk_cold(cc[i]);
+        chk_cold(sc[i]);
+    }
+    const size_t after = heap_used();
+
+    printf("sizeof(struct q_conn) = %zu\n", sizeof(struct q_conn));
+    if (after > before)
+        printf("heap per idle conn = %zu (%zu conns)\n",
+               (after - before) / (2 * N_CONNS), 2 * N_CONNS);
+
+    for (size_t i = 0; i < N_CONNS; i++) {
+        q_close(cc[i], 0, 0);
+        q_close(sc[i], 0, 0);
+    }
+    q_cleanup(w);
+}
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "netsim.h"
+
+
+#define XFER_LEN (1024 * 1024)
+
+
+static uint64_t xfer(struct w_engine * const w,
+                     struct q_conn * const cc,
+                     struct q_conn * const sc)
+{
+    struct q_stream * const cs = q_rsv_stream(cc, true);
+    ensure(cs, "is zero");
+
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    q_alloc(w, &o, cc, q_conn_af(cc), XFER_LEN);
+    uint8_t n = 0;
+    struct w_iov * v;
+    sq_foreach (v, &o, next)
+        memset(v->buf, n++, v->len);
+    q_write(cs, &o, true);
+
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    struct q_stream * const ss = q_read(sc, &i, true);
+    ensure(ss, "is zero");
+    q_read_stream(ss, &i, true);
+
+    // check that the data arrived intact and in order
+    const uint64_t ilen = w_iov_sq_len(&i);
+    struct w_iov * iv = sq_first(&i);
+    sq_foreach (v, &o, next) {
+        ensure(iv && iv->len == v->len && memcmp(iv->buf, v->buf, v->len) == 0,
+               "data mismatch");
+        iv = sq_next(iv, next);
+    }
+
+    q_free_stream(ss);
+    q_free_stream(cs);
+    q_free(&i);
+    q_free(&o);
+    return ilen;
+}
+
+
+#define SHRD_LEN (64 * 1024)
+
+
+static void chk_shared(struct w_engine * const w,
+                       struct q_conn * const cc,
+                       struct q_conn * const sc)
+{
+    // one stream sends a shared payload with FIN, the other the same payload
+    // from heap memory followed by private data with FIN
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    q_alloc(w, &o, cc, q_conn_af(cc), SHRD_LEN);
+    uint_t off = 0;
+    struct w_iov * v;
+    sq_foreach (v, &o, next)
+        for (uint16_t k = 0; k < v->len; k++)
+            v->buf[k] = (uint8_t)(off++ % 251);
+    struct q_shared * const sh = q_shared_new(&o);
+    uint8_t * const buf = malloc(SHRD_LEN);
+    ensure(buf, "could not malloc");
+    for (off = 0; off < SHRD_LEN; off++)
+        buf[off] = (uint8_t)(off % 251);
+    struct q_shared * const sh_buf = q_shared_new_buf(buf, SHRD_LEN);
+
+    struct q_stream * cs[2];
+    for (size_t k = 0; k < 2; k++) {
+        cs[k] = q_rsv_stream(cc, true);
+        ensure(cs[k], "is zero");
+    }
+    q_write_shared(cs[0], sh, true);
+    q_write_shared(cs[1], sh_buf, false);
+    q_write_str(w, cs[1], "tail", 4, true);
+    // the streams keep their own references
+    q_shared_free(sh);
+    q_shared_free(sh_buf);
+
+    struct q_stream * ss[2];
+    for (size_t k = 0; k < 2; k++) {
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        ss[k] = q_read(sc, &i, true);
+        ensure(ss[k], "is zero");
+        q_read_stream(ss[k], &i, true);
+
+        const uint_t len = w_iov_sq_len(&i);
+        ensure(len == SHRD_LEN || len == SHRD_LEN + 4, "short transfer");
+        off = 0;
+        sq_foreach (v, &i, next)
+            for (uint16_t j = 0; j < v->len; j++, off++)
+                ensure(v->buf[j] == (off < SHRD_LEN ? (uint8_t)(off % 251)
+                                                    : "tail"[off - SHRD_LEN]),
+                       "data mismatch");
+        q_free(&i);
+
+        struct w_iov_sq e = w_iov_sq_initializer(e);
+        q_write(ss[k], &e, true);
+    }
+
+    // the client streams close once the server FIN arrived and our own FIN,
+    // which was sent in a copy of shared data, was ACKed
+    for (size_t k = 0; k < 2; k++) {
+        struct w_iov_sq i = w_iov_sq_initializer(i);
+        q_read_stream(cs[k], &i, true);
+        q_free(&i);
+        struct q_event ev[8];
+        for (size_t t = 0; t < 100 && q_is_stream_closed(cs[k]) == false; t++)
+            q_poll(w, ev, sizeof(ev) / sizeof(ev[0]), 10 * NS_PER_MS);
+        ensure(q_is_stream_closed(cs[k]), "strm not closed");
+    }
+
+    for (size_t k = 0; k < 2; k++) {
+        q_free_stream(ss[k]);
+        q_free_stream(cs[k]);
+    }
+}
+
+
+#define PMTU_LEN 1400
+
+
+static bool pmtud_done(const struct q_conn * const c)
+{
+    return c->rec.pmtud_hi && c->rec.pmtud_hi <= c->rec.pmtud_lo + PMTUD_STEP;
+}
+
+
+static void chk_pmtud(const struct q_conn * const c)
+{
+    ensure(pmtud_done(c), "PMTUD did not converge: %u-%u", c->rec.pmtud_lo,
+           c->rec.pmtud_hi);
+    ensure(c->rec.pmtud_lo <= PMTU_LEN && c->rec.pmtud_hi > PMTU_LEN,
+           "PMTU %u-%u does not bracket %u", c->rec.pmtud_lo, c->rec.pmtud_hi,
+           PMTU_LEN);
+    ensure(c->rec.max_pkt_size == c->rec.pmtud_lo, "not using PMTU %u",
+           c->rec.pmtud_lo);
+}
+
+
+int main(int argc __attribute__((unused)), char * argv[])
+{
+#ifndef NDEBUG
+    util_dlevel = ERR;
+#endif
+
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    // all client conns share one (unconnected) socket and are demuxed by CID
+    __extension__ const struct q_conf conf = {.tls_cert = "dummy.crt",
+                                              .tls_key = "dummy.key",
+                                              .clnt_socks = 1};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+
+    // a 10 Mb/s link with 40 ms RTT, a 64 KB buffer, 1% loss and reordering
+    const struct netsim_conf ns = {.bw = 10 * 1000 * 1000,
+                                   .rtt = 40 * NS_PER_MS,
+                                   .jitter = 5 * NS_PER_MS,
+                                   .queue = 64 * 1024,
+                                   .loss = 10000,
+                                   .reorder = 10000,
+                                   .seed = 42};
+    netsim_init(w, &ns);
+
+    struct q_conn * const srv = q_bind(w, 0, 55557);
+    struct sockaddr_in6 sip = {.sin6_family = AF_INET6,
+                               .sin6_port = bswap16(55557)};
+    inet_pton(AF_INET6, "::1", &sip.sin6_addr);
+
+    const uint64_t t_conn = netsim_now();
+    struct q_conn * const cc = q_connect(w, (const struct sockaddr *)&sip,
+                                         "localhost", 0, 0, true, 0, 0);
+    ensure(cc, "is zero");
+    struct q_conn * const sc = q_accept(w, 0);
+    ensure(sc, "is zero");
+
+    const uint64_t t_xfer = netsim_now();
+    ensure(xfer(w, cc, sc) == XFER_LEN, "short transfer");
+    const uint64_t t_done = netsim_now();
+    chk_shared(w, cc, sc);
+
+    struct netsim_stats s;
+    netsim_get_stats(&s);
+    printf("handshake %.3f s, transfer %.3f s (%.2f Mb/s)\n",
+           (double)(t_xfer - t_conn) / NS_PER_S,
+           (double)(t_done - t_xfer) / NS_PER_S,
+           (double)XFER_LEN * 8 * NS_PER_S / (double)(t_done - t_xfer) / 1e6);
+    printf("pkts tx %" PRIu64 " rx %" PRIu64 " lost %" PRIu64 " qdrop %" PRIu64
+           " reordered %" PRIu64 "\n",
+           s.tx, s.rx, s.lost, s.qdrop, s.reordered);
+
+    // the transfer cannot be faster than the simulated link
+    ensure(t_done - t_xfer >= (uint64_t)XFER_LEN * 8 * NS_PER_S / ns.bw,
+           "faster than link");
+    ensure(s.unreach == 0, "unreachable pkts");
+
+    // a second conn to the same server shares the socket of the first
+    struct q_conn * const cc2 = q_connect(w, (const struct sockaddr *)&sip,
+                                          "localhost", 0, 0, true, 0, 0);
+    ensure(cc2, "is zero");
+    struct q_conn * const sc2 = q_accept(w, 0);
+    ensure(sc2, "is zero");
+    ensure(cc2->sock == cc->sock, "socket not shared");
+    ensure(xfer(w, cc2, sc2) == XFER_LEN, "short transfer on shared socket");
+    ensure(xfer(w, cc, sc) == XFER_LEN, "short transfer on shared socket");
+
+    // the server always answers Initials on port 4434 with a stateless Retry
+    q_bind(w, 0, 4434);
+    sip.sin6_port = bswap16(4434);
+    const uint64_t t_rtry = netsim_now();
+    struct q_conn * const rc = q_connect(w, (const struct sockaddr *)&sip,
+                                         "localhost", 0, 0, true, 0, 0);
+    ensure(rc, "is zero");
+    struct q_conn * const rsc = q_accept(w, 0);
+    ensure(rsc, "is zero");
+    // the Retry exchange adds a round trip before the 1.5-RTT handshake
+    ensure(netsim_now() - t_rtry >= 2 * ns.rtt, "no retry");
+
+    ensure(rc->sock == cc->sock, "socket not shared");
+
+    q_close(rc, 0, 0);
+    q_close(rsc, 0, 0);
+    q_close(cc2, 0, 0);
+    q_close(sc2, 0, 0);
+    q_close(cc, 0, 0);
+    q_close(sc, 0, 0);
+
+    // on a link that drops datagrams larger than PMTU_LEN, DPLPMTUD must
+    // converge on a validated size just below that
+    netsim_cleanup();
+    const struct netsim_conf ns_mtu = {.bw = ns.bw,
+                                       .rtt = ns.rtt,
+                                       .queue = ns.queue,
+                                       .seed = ns.seed,
+                                       .mtu = PMTU_LEN};
+    netsim_init(w, &ns_mtu);
+    netsim_bind(srv->sock);
+    sip.sin6_port = bswap16(55557);
+    struct q_conn * const pc = q_connect(w, (const struct sockaddr *)&sip,
+                                         "localhost", 0, 0, true, 0, 0);
+    ensure(pc, "is zero");
+    struct q_conn * const ps = q_accept(w, 0);
+    ensure(ps, "is zero");
+    for (size_t k = 0; k < 8 && (pmtud_done(pc) == false ||
+                                 pmtud_done(ps) == false);
+         k++)
+        ensure(xfer(w, pc, ps) == XFER_LEN, "short transfer");
+    chk_pmtud(pc);
+    chk_pmtud(ps);
+    netsim_get_stats(&s);
+    ensure(s.toobig > 0, "no pkt exceeded the MTU");
+
+    q_close(pc, 0, 0);
+    q_close(ps, 0, 0);
+    netsim_cleanup();
+    q_cleanup(w);
+}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "quic.h"
+#include "stream.h"
+
+
+#define N_BUFS 5
+#define PLD_LEN 100 // initial payload per buffer
+
+
+static void set_pld(struct q_conn * const c, const uint16_t pld)
+{
+    c->rec.max_pkt_size = (uint16_t)(pld + AEAD_LEN + DATA_OFFSET);
+}
+
+
+static void chk(const struct q_stream * const s,
+                const uint_t cnt,
+                const uint16_t first_len)
+{
+    ensure(w_iov_sq_cnt(&s->out) == cnt, "%" PRIu " bufs, not %" PRIu,
+           w_iov_sq_cnt(&s->out), cnt);
+    ensure(sq_first(&s->out)->len == first_len, "first buf has %u bytes",
+           sq_first(&s->out)->len);
+
+    // the data must be intact and in order, with the FIN on the last buffer
+    uint_t off = 0;
+    const struct w_iov * v;
+    sq_foreach (v, &s->out, next) {
+        for (uint16_t i = 0; i < v->len; i++, off++)
+            ensure(v->buf[i] == (uint8_t)(off % 251), "data mismatch");
+        ensure(meta(v).is_fin == (sq_next(v, next) == 0), "FIN misplaced");
+    }
+    ensure(off == N_BUFS * PLD_LEN, "%" PRIu " bytes", off);
+}
+
+
+int main(int argc __attribute__((unused)), char * argv[])
+{
+#ifndef NDEBUG
+    util_dlevel = ERR;
+#endif
+
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    __extension__ const struct q_conf conf = {.tls_cert = "dummy.crt",
+                                              .tls_key = "dummy.key"};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+    q_bind(w, 0, 55558);
+
+    struct sockaddr_in6 sip = {.sin6_family = AF_INET6,
+                               .sin6_port = bswap16(55558)};
+    inet_pton(AF_INET6, "::1", &sip.sin6_addr);
+    struct q_conn * const cc = q_connect(w, (const struct sockaddr *)&sip,
+                                         "localhost", 0, 0, true, 0, 0);
+    ensure(cc, "is zero");
+    struct q_conn * const sc = q_accept(w, 0);
+    ensure(sc, "is zero");
+    struct q_stream * const s = q_rsv_stream(cc, true);
+    ensure(s, "is zero");
+
+    // queue data chunked for a small PMTU, without letting the conn send it
+    const uint16_t max_pkt_size = cc->rec.max_pkt_size;
+    set_pld(cc, PLD_LEN);
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    q_alloc(w, &q, cc, q_conn_af(cc), N_BUFS * PLD_LEN);
+    ensure(w_iov_sq_cnt(&q) == N_BUFS, "%" PRIu " bufs", w_iov_sq_cnt(&q));
+    uint_t off = 0;
+    struct w_iov * v;
+    sq_foreach (v, &q, next)
+        for (uint16_t i = 0; i < v->len; i++)
+            v->buf[i] = (uint8_t)(off++ % 251);
+    meta(sq_last(&q, w_iov, next)).is_fin = true;
+    sq_concat(&s->out, &q);
+    struct w_iov * const first = sq_first(&s->out);
+    struct w_iov * const third = sq_next(sq_next(first, next), next);
+
+    // after a PMTU increase, the first buffer absorbs the second, but must
+    // not pull data out of the third, which was already sent
+    set_pld(cc, (uint16_t)(PLD_LEN * 5 / 2));
+    meta(third).txed = true;
+    rechunk_out(s, first);
+    chk(s, N_BUFS - 1, 2 * PLD_LEN);
+    ensure(sq_next(first, next) == third && third->len == PLD_LEN,
+           "pulled from a sent buffer");
+
+    // once the third is unsent, half of it moves forward
+    meta(third).txed = false;
+    rechunk_out(s, first);
+    chk(s, N_BUFS - 1, PLD_LEN * 5 / 2);
+    ensure(third->len == PLD_LEN / 2, "third buf has %u bytes", third->len);
+
+    // after a PMTU decrease, the excess is split off into a new buffer
+    set_pld(cc, PLD_LEN / 2);
+    rechunk_out(s, first);
+    chk(s, N_BUFS, PLD_LEN / 2);
+    ensure(sq_next(first, next)->len == PLD_LEN * 2,
+           "split buf has %u bytes", sq_next(first, next)->len);
+
+    // data pulled forward into the last buffer takes the FIN with it
+    set_pld(cc, N_BUFS * PLD_LEN);
+    rechunk_out(s, first);
+    chk(s, 1, N_BUFS * PLD_LEN);
+
+    cc->rec.max_pkt_size = max_pkt_size;
+    sq_concat(&q, &s->out);
+    q_free(&q);
+
+    q_close(cc, 0, 0);
+    q_close(sc, 0, 0);
+    q_cleanup(w);
+}
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <quant/quant.h>
+
+#include "quic.h"
+
+
+#define PKT_LEN 1200
+#define N_REFS 3 // the packet plus two STREAM frames referencing it
+
+
+// every order in which the w_iovs of a packet can be freed
+static const uint8_t order[][N_REFS] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2},
+                                        {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+
+
+int main()
+{
+#ifndef NDEBUG
+    util_dlevel = ERR;
+#endif
+    __extension__ const struct q_conf conf = {.num_bufs = 64};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    const uint_t bufs = w_iov_sq_cnt(&w->iov);
+    static const uint16_t off[N_REFS] = {0, 100, 300};
+
+    for (size_t o = 0; o < sizeof(order) / sizeof(order[0]); o++) {
+        // a received packet, and w_iovs for its second and third STREAM
+        // frame, as dec_frames() makes them; the third refs the second
+        struct w_iov * v[N_REFS];
+        struct pkt_meta * m[N_REFS];
+        v[0] = alloc_iov(w, AF_INET, PKT_LEN, 0, &m[0]);
+        ensure(v[0], "is zero");
+        for (uint16_t i = 0; i < v[0]->len; i++)
+            v[0]->buf[i] = (uint8_t)i;
+        for (size_t r = 1; r < N_REFS; r++) {
+            v[r] = ref_iov(v[r - 1], m[r - 1], &m[r],
+                           (uint16_t)(off[r] - off[r - 1]));
+            ensure(v[r], "is zero");
+            ensure(v[r]->buf == v[0]->buf + off[r], "refs pkt data");
+            ensure(m[r]->rx_base == (uint32_t)w_iov_idx(v[0]) + 1, "refs pkt");
+        }
+        ensure(m[0]->rx_refs == N_REFS, "refs %u", m[0]->rx_refs);
+        ensure(w_iov_sq_cnt(&w->iov) == bufs - N_REFS, "bufs in use");
+
+        uint_t freed = 0;
+        for (size_t i = 0; i < N_REFS; i++) {
+            const uint8_t k = order[o][i];
+            free_iov(v[k], m[k]);
+            v[k] = 0;
+
+            // the packet buffer goes back to the pool after its last user
+            freed += (uint_t)(k != 0) + (uint_t)(i == N_REFS - 1);
+            ensure(w_iov_sq_cnt(&w->iov) == bufs - N_REFS + freed,
+                   "order %zu step %zu: freed %" PRIu, o, i, freed);
+
+            // and the data of the others must be untouched until then
+            for (size_t r = 0; r < N_REFS; r++)
+                ensure(v[r] == 0 || v[r]->buf[0] == (uint8_t)off[r],
+                       "order %zu step %zu: data of %zu", o, i, r);
+        }
+        ensure(w_iov_sq_cnt(&w->iov) == bufs, "leaked bufs");
+    }
+
+    q_cleanup(w);
+}
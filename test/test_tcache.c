@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "tcache.h"
+
+
+static void chk(struct tcache * const tc,
+                const char * const sni,
+                const char * const alpn,
+                const uint32_t vers,
+                const uint8_t fill)
+{
+    struct tcache_ent e;
+    ensure(tcache_find(tc, sni, alpn, &e), "found %s %s", sni, alpn);
+    ensure(strcmp(e.sni, sni) == 0 && strcmp(e.alpn, alpn) == 0, "key");
+    ensure(e.vers == vers, "vers 0x%08x != 0x%08x", e.vers, vers);
+    ensure(e.tp->max_data == vers, "tp");
+    for (uint16_t i = 0; i < e.ticket_len; i++)
+        ensure(e.ticket[i] == fill, "ticket");
+}
+
+
+int main()
+{
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+    char path[] = "/tmp/test_tcache.XXXXXX";
+    const int fd = mkstemp(path);
+    ensure(fd >= 0, "mkstemp");
+    close(fd);
+
+    struct tcache tc;
+    ensure(tcache_open(&tc, path), "open");
+
+    uint8_t ticket[512];
+    struct transport_params tp = {0};
+    char sni[32];
+
+    // fill the cache with many tickets for few peers, forcing compactions
+    for (uint32_t i = 1; i <= 10000; i++) {
+        snprintf(sni, sizeof(sni), "host%u.example.com", i % 50);
+        memset(ticket, (uint8_t)i, sizeof(ticket));
+        tp.max_data = i;
+        ensure(tcache_put(&tc, sni, i % 2 ? "hq-27" : "", &tp, i, ticket,
+                          sizeof(ticket)),
+               "put %u", i);
+        chk(&tc, sni, i % 2 ? "hq-27" : "", i, (uint8_t)i);
+    }
+
+    // a second handle sees the same (latest) tickets
+    struct tcache tc2;
+    ensure(tcache_open(&tc2, path), "open 2");
+    for (uint32_t i = 10000 - 49; i <= 10000; i++) {
+        snprintf(sni, sizeof(sni), "host%u.example.com", i % 50);
+        chk(&tc2, sni, i % 2 ? "hq-27" : "", i, (uint8_t)i);
+    }
+
+    // compaction by one handle is picked up by the other
+    tcache_compact(&tc);
+    snprintf(sni, sizeof(sni), "host%u.example.com", 0);
+    chk(&tc2, sni, "", 10000, (uint8_t)10000);
+
+    struct tcache_ent e;
+    ensure(tcache_find(&tc, "unknown", "", &e) == false, "not found");
+
+    tcache_close(&tc2);
+    tcache_close(&tc);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "quic.h"
+#include "tls.h"
+
+
+#define ROT_IVAL 2 ///< Ticket key rotation interval, in seconds.
+
+
+static struct w_engine * __attribute__((nonnull))
+init_engine(const char * const path)
+{
+    __extension__ const struct q_conf conf = {
+        .tls_cert = "dummy.crt",
+        .tls_key = "dummy.key",
+        .tls_ticket_keys = path,
+        .tls_ticket_key_rotation = ROT_IVAL,
+        .num_bufs = 100};
+    return q_init("lo"
+#ifndef __linux__
+                  "0"
+#endif
+                  ,
+                  &conf);
+}
+
+
+static bool __attribute__((nonnull))
+same_key(struct w_engine * const w1,
+         struct w_engine * const w2,
+         const uint32_t id)
+{
+    const struct tckt_key * const k1 = get_tckt_key(ped(w1), id);
+    const struct tckt_key * const k2 = get_tckt_key(ped(w2), id);
+    return k1 && k2 && k1->t == k2->t;
+}
+
+
+int main(int argc __attribute__((unused)), char * argv[])
+{
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+    char path[] = "/tmp/test_tckt.XXXXXX";
+    const int fd = mkstemp(path);
+    ensure(fd >= 0, "mkstemp");
+    close(fd);
+
+    // two engines share the key file, like the processes of a server would
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    struct w_engine * const w1 = init_engine(path);
+    struct w_engine * const w2 = init_engine(path);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+
+    // the first engine creates a key in the empty file, the second loads it
+    struct stat st;
+    ensure(stat(path, &st) == 0 && st.st_size > 0, "key file written");
+    ensure(cur_tckt_key(ped(w1))->id == 1, "w1 key id");
+    ensure(cur_tckt_key(ped(w2))->id == 1, "w2 key id");
+    ensure(same_key(w1, w2, 1), "shared key 1");
+
+    // after the interval, the first engine rotates, and the second finds the
+    // new key in the file when presented with its ID
+    sleep(ROT_IVAL);
+    ensure(cur_tckt_key(ped(w1))->id == 2, "w1 rotated");
+    ensure(same_key(w1, w2, 2), "shared key 2");
+    ensure(get_tckt_key(ped(w1), 1), "w1 still has key 1");
+
+    // unknown key IDs are rejected, also after re-reading the file
+    sleep(1);
+    ensure(get_tckt_key(ped(w1), 4711) == 0, "w1 unknown key");
+    ensure(get_tckt_key(ped(w2), 0) == 0, "w2 unknown key");
+
+    // a recreated file restarts at key ID 1, which both engines adopt
+    unlink(path);
+    sleep(ROT_IVAL);
+    ensure(cur_tckt_key(ped(w1))->id == 1, "w1 reloaded");
+    ensure(cur_tckt_key(ped(w2))->id == 1, "w2 reloaded");
+    ensure(same_key(w1, w2, 1), "shared new key 1");
+    ensure(get_tckt_key(ped(w1), 2) == 0, "w1 dropped key 2");
+    ensure(get_tckt_key(ped(w2), 2) == 0, "w2 dropped key 2");
+
+    q_cleanup(w2);
+    q_cleanup(w1);
+    unlink(path);
+    return 0;
+}
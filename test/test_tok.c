@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "quic.h"
+#include "tls.h"
+
+
+static struct w_sockaddr mk_peer(const char * const ip, const uint16_t port)
+{
+    struct w_sockaddr p = {.addr = {.af = AF_INET}, .port = bswap16(port)};
+    ensure(inet_pton(AF_INET, ip, &p.addr.ip4) == 1, "inet_pton");
+    return p;
+}
+
+
+int main(int argc __attribute__((unused)), char * argv[])
+{
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    __extension__ const struct q_conf conf = {.tls_cert = "dummy.crt",
+                                              .tls_key = "dummy.key"};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+
+    const struct w_sockaddr peer = mk_peer("127.0.0.1", 1000);
+    const struct w_sockaddr other_port = mk_peer("127.0.0.1", 2000);
+    const struct w_sockaddr other_ip = mk_peer("127.0.0.2", 1000);
+
+    struct cid odcid = {.len = 8};
+    memset(odcid.id, 0xaa, odcid.len);
+    struct cid got = {.len = 0};
+
+    uint8_t tok_rtry[RTRY_TOK_LEN_MAX];
+    const uint16_t rtry_len = make_tok(w, &peer, &odcid, tok_rtry);
+    uint8_t tok_new[RTRY_TOK_LEN_MAX];
+    const uint16_t new_len = make_tok(w, &peer, 0, tok_new);
+
+    // a Retry token is bound to the full peer address and returns the odcid
+    ensure(verify_tok(w, &peer, tok_rtry, rtry_len, &got), "rtry tok");
+    ensure(got.len == odcid.len && memcmp(got.id, odcid.id, odcid.len) == 0,
+           "rtry odcid");
+    ensure(verify_tok(w, &other_port, tok_rtry, rtry_len, &got) == false,
+           "rtry tok from other port");
+    ensure(verify_tok(w, &other_ip, tok_rtry, rtry_len, &got) == false,
+           "rtry tok from other ip");
+
+    // a NEW_TOKEN token is bound to the peer IP only
+    ensure(verify_tok(w, &peer, tok_new, new_len, &got), "new tok");
+    ensure(verify_tok(w, &other_port, tok_new, new_len, &got),
+           "new tok from other port");
+    ensure(verify_tok(w, &other_ip, tok_new, new_len, &got) == false,
+           "new tok from other ip");
+
+    // the type is authenticated, as is the rest of the token
+    tok_new[1] ^= 1;
+    ensure(verify_tok(w, &peer, tok_new, new_len, &got) == false,
+           "new tok type");
+    tok_new[1] ^= 1;
+    tok_new[new_len - 1] ^= 1;
+    ensure(verify_tok(w, &peer, tok_new, new_len, &got) == false,
+           "new tok tag");
+    tok_new[new_len - 1] ^= 1;
+    ensure(verify_tok(w, &peer, tok_new, (uint16_t)(new_len - 1), &got) ==
+               false,
+           "short new tok");
+
+    // Retry tokens expire after ten seconds, NEW_TOKEN tokens much later
+    sleep(11);
+    ensure(verify_tok(w, &peer, tok_rtry, rtry_len, &got) == false,
+           "expired rtry tok");
+    ensure(verify_tok(w, &peer, tok_new, new_len, &got), "new tok after 11s");
+
+    q_cleanup(w);
+    return 0;
+}
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <quant/quant.h>
+
+#include "marshall.h"
+
+
+// the smallest and largest value of each varint length class
+static const uint64_t vals[] = {0,
+                                63,
+                                64,
+                                16383,
+                                16384,
+                                (UINT64_C(1) << 30) - 1,
+#if HAVE_64BIT
+                                UINT64_C(1) << 30,
+                                (UINT64_C(1) << 62) - 1
+#endif
+};
+
+// and their encoded lengths
+static const uint8_t lens[] = {1, 1, 2, 2, 4, 4,
+#if HAVE_64BIT
+                               8, 8
+#endif
+};
+
+#define N_VALS (sizeof(vals) / sizeof(vals[0]))
+
+
+static void chk_decv(const uint8_t * const buf,
+                     const uint8_t * const end,
+                     const size_t i)
+{
+    const uint8_t * pos = buf;
+    uint64_t val = UINT64_MAX;
+    ensure(decv(&val, &pos, end), "decv %" PRIu64, vals[i]);
+    ensure(val == vals[i], "%" PRIu64 " != %" PRIu64, val, vals[i]);
+    ensure(pos == buf + lens[i], "pos");
+
+    // a truncated varint must not decode
+    pos = buf;
+    ensure(decv(&val, &pos, buf + lens[i] - 1) == false, "truncated");
+    ensure(pos == buf, "pos moved");
+}
+
+
+int main()
+{
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+    uint8_t buf[32];
+
+    for (size_t i = 0; i < N_VALS; i++) {
+        ensure(varint_size(vals[i]) == lens[i], "varint_size");
+
+        // encode at the start of the buffer and decode with room to spare,
+        // i.e., using a single unaligned load
+        memset(buf, 0xff, sizeof(buf));
+        uint8_t * pos = buf;
+        encv(&pos, buf + sizeof(buf), vals[i]);
+        ensure(pos == buf + lens[i], "encv len");
+        chk_decv(buf, buf + sizeof(buf), i);
+
+        // encode so the varint ends the buffer, i.e., near-end decoding
+        uint8_t * const near = buf + sizeof(buf) - lens[i];
+        pos = near;
+        encv(&pos, buf + sizeof(buf), vals[i]);
+        chk_decv(near, buf + sizeof(buf), i);
+    }
+
+    // decode all pairs, both with room to spare and right at the end
+    for (size_t i = 0; i < N_VALS; i++)
+        for (size_t j = 0; j < N_VALS; j++) {
+            const uint8_t len = (uint8_t)(lens[i] + lens[j]);
+            uint8_t * const starts[] = {buf, buf + sizeof(buf) - len};
+            for (size_t k = 0; k < sizeof(starts) / sizeof(starts[0]); k++) {
+                uint8_t * pos = starts[k];
+                encv(&pos, buf + sizeof(buf), vals[i]);
+                encv(&pos, buf + sizeof(buf), vals[j]);
+
+                const uint8_t * dpos = starts[k];
+                uint64_t v1;
+                uint64_t v2;
+                ensure(decv2(&v1, &v2, &dpos, buf + sizeof(buf)), "decv2");
+                ensure(v1 == vals[i] && v2 == vals[j],
+                       "%" PRIu64 "/%" PRIu64 " != %" PRIu64 "/%" PRIu64, v1,
+                       v2, vals[i], vals[j]);
+                ensure(dpos == starts[k] + len, "pos");
+
+                // the second varint is truncated
+                dpos = starts[k];
+                ensure(decv2(&v1, &v2, &dpos, starts[k] + len - 1) == false,
+                       "truncated");
+            }
+        }
+}